@@ -1,6 +1,8 @@
 # optional features
 HAVE_ACL=0
 HAVE_SELINUX=0
+HAVE_COPY_FILE_RANGE=1
+HAVE_INOTIFY=1
 
 # vis version
 RELEASE = HEAD
@@ -34,7 +36,7 @@ LDFLAGS_LUA = $(shell pkg-config --libs lua5.1 2> /dev/null || echo "-llua")
 LDFLAGS_TERMKEY = $(shell pkg-config --libs termkey 2> /dev/null || echo "-ltermkey")
 LDFLAGS_CURSES = $(shell pkg-config --libs ncursesw 2> /dev/null || echo "-lncursesw")
 
-LIBS = -lm -ldl -lc
+LIBS = -lm -ldl -lc -lpthread
 OS = $(shell uname)
 
 ifeq (${OS},Linux)
@@ -46,6 +48,12 @@ ifeq (${OS},Linux)
 		CFLAGS += -DHAVE_ACL
 		LIBS += -lacl
 	endif
+	ifeq (${HAVE_COPY_FILE_RANGE},1)
+		CFLAGS += -DHAVE_COPY_FILE_RANGE
+	endif
+	ifeq (${HAVE_INOTIFY},1)
+		CFLAGS += -DHAVE_INOTIFY
+	endif
 else ifeq (${OS},Darwin)
 	CFLAGS += -D_DARWIN_C_SOURCE
 else ifeq (${OS},OpenBSD)
@@ -0,0 +1,162 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "lz4.h"
+#include "util.h"
+
+/* A block is a sequence of literal runs each followed by a match, i.e. a copy
+ * of preceding data. every sequence starts with a token holding the length of
+ * both in its upper and lower 4 bits, a value of 15 is continued by further
+ * bytes which are added up until one is not 255. the literals follow, then the
+ * 2 byte little endian offset of the match. its length is stored minus 4, the
+ * minimal match length. the last sequence consists of literals only, which
+ * cover at least the last 5 bytes, matches start at least 12 bytes before the
+ * end. */
+#define MINMATCH 4
+#define LASTLITERALS 5
+#define MFLIMIT 12
+#define MAXOFFSET 65535
+#define HASH_BITS 16
+
+static uint32_t read32(const unsigned char *p) {
+	uint32_t v;
+	memcpy(&v, p, sizeof v);
+	return v;
+}
+
+static size_t hash(uint32_t v) {
+	return (v * 2654435761U) >> (32 - HASH_BITS);
+}
+
+static unsigned char *put_length(unsigned char *op, size_t len) {
+	for (; len >= 255; len -= 255)
+		*op++ = 255;
+	*op++ = len;
+	return op;
+}
+
+/* append a sequence, matches of length 0 denote the last one */
+static unsigned char *put_sequence(unsigned char *op, unsigned char *end, const unsigned char *lit,
+                                   size_t litlen, size_t offset, size_t matchlen) {
+	if ((size_t)(end - op) < 1 + litlen / 255 + 1 + litlen + 2 + matchlen / 255 + 1)
+		return NULL;
+	unsigned char *token = op++;
+	*token = MIN(litlen, 15) << 4;
+	if (litlen >= 15)
+		op = put_length(op, litlen - 15);
+	memcpy(op, lit, litlen);
+	op += litlen;
+	if (matchlen) {
+		*op++ = offset & 0xff;
+		*op++ = offset >> 8;
+		matchlen -= MINMATCH;
+		*token |= MIN(matchlen, 15);
+		if (matchlen >= 15)
+			op = put_length(op, matchlen - 15);
+	}
+	return op;
+}
+
+size_t lz4_compress(const char *src, size_t len, char *dst, size_t size) {
+	const unsigned char *start = (const unsigned char*)src, *end = start + len;
+	const unsigned char *ip = start, *anchor = start;
+	unsigned char *op = (unsigned char*)dst, *oend = op + size;
+	if (len > MFLIMIT) {
+		uint32_t *table = calloc(1 << HASH_BITS, sizeof *table);
+		if (!table)
+			return 0;
+		const unsigned char *mflimit = end - MFLIMIT, *matchlimit = end - LASTLITERALS;
+		/* incompressible data is skipped increasingly fast */
+		size_t misses = 0;
+		while (ip < mflimit) {
+			uint32_t seq = read32(ip);
+			size_t h = hash(seq);
+			const unsigned char *ref = start + table[h];
+			table[h] = ip - start;
+			if (ref >= ip || ip - ref > MAXOFFSET || read32(ref) != seq) {
+				ip += 1 + (misses++ >> 6);
+				continue;
+			}
+			misses = 0;
+			/* extend the match in both directions */
+			const unsigned char *mend = ip + MINMATCH, *rend = ref + MINMATCH;
+			while (mend < matchlimit && *mend == *rend) {
+				mend++;
+				rend++;
+			}
+			while (ip > anchor && ref > start && ip[-1] == ref[-1]) {
+				ip--;
+				ref--;
+			}
+			if (!(op = put_sequence(op, oend, anchor, ip - anchor, ip - ref, mend - ip))) {
+				free(table);
+				return 0;
+			}
+			ip = anchor = mend;
+		}
+		free(table);
+	}
+	if (!(op = put_sequence(op, oend, anchor, end - anchor, 0, 0)))
+		return 0;
+	return op - (unsigned char*)dst;
+}
+
+/* read a length continued by additional bytes, SIZE_MAX if truncated */
+static size_t get_length(const unsigned char **ip, const unsigned char *end, size_t len) {
+	unsigned char b;
+	do {
+		if (*ip == end)
+			return SIZE_MAX;
+		b = *(*ip)++;
+		len += b;
+	} while (b == 255);
+	return len;
+}
+
+size_t lz4_decompress(const char *src, size_t len, char *dst, size_t size) {
+	const unsigned char *ip = (const unsigned char*)src, *end = ip + len;
+	unsigned char *op = (unsigned char*)dst, *oend = op + size;
+	while (ip < end) {
+		unsigned char token = *ip++;
+		size_t litlen = token >> 4;
+		if (litlen == 15 && (litlen = get_length(&ip, end, litlen)) == SIZE_MAX)
+			return 0;
+		/* short runs are copied in blocks of fixed size while there is room */
+		if (litlen <= 16 && end - ip >= 16 && oend - op >= 16)
+			memcpy(op, ip, 16);
+		else if (litlen > (size_t)(end - ip) || litlen > (size_t)(oend - op))
+			return 0;
+		else
+			memcpy(op, ip, litlen);
+		op += litlen;
+		ip += litlen;
+		if (ip == end)
+			break;
+		if (end - ip < 2)
+			return 0;
+		size_t offset = ip[0] | ip[1] << 8;
+		ip += 2;
+		size_t matchlen = token & 15;
+		if (matchlen == 15 && (matchlen = get_length(&ip, end, matchlen)) == SIZE_MAX)
+			return 0;
+		matchlen += MINMATCH;
+		if (offset == 0 || offset > (size_t)(op - (unsigned char*)dst) || matchlen > (size_t)(oend - op))
+			return 0;
+		const unsigned char *ref = op - offset;
+		if (offset >= 16 && matchlen <= 32 && oend - op >= 32) {
+			memcpy(op, ref, 16);
+			memcpy(op + 16, ref + 16, 16);
+			op += matchlen;
+			continue;
+		}
+		/* overlapping matches repeat the preceding `offset' bytes */
+		while (matchlen > 0) {
+			size_t n = MIN(offset, matchlen);
+			memcpy(op, ref, n);
+			op += n;
+			matchlen -= n;
+		}
+	}
+	return op - (unsigned char*)dst;
+}
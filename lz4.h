@@ -0,0 +1,17 @@
+#ifndef LZ4_H
+#define LZ4_H
+
+#include <stddef.h>
+
+/* a minimal implementation of the LZ4 block format, trading compression ratio
+ * for speed. it is used to keep data which is rarely accessed in memory. */
+
+/* compress `len' bytes of `src' into `dst' which has room for `size' bytes.
+ * returns the compressed length or 0 if it does not fit. */
+size_t lz4_compress(const char *src, size_t len, char *dst, size_t size);
+/* decompress the block of `len' bytes at `src' into `dst' which has room for
+ * `size' bytes. returns the decompressed length or 0 if the block is invalid
+ * or does not fit. */
+size_t lz4_decompress(const char *src, size_t len, char *dst, size_t size);
+
+#endif
@@ -1373,7 +1373,7 @@ static const char *insert_register(Vis *vis, const char *keys, const Arg *arg) {
 	Register *reg = vis_register_get(vis, regid);
 	if (reg) {
 		int pos = view_cursor_get(vis_view(vis));
-		vis_insert(vis, pos, reg->data, reg->len);
+		vis_insert_register(vis, pos, reg);
 		view_cursor_to(vis_view(vis), pos + reg->len);
 	}
 	return keys;
@@ -7,18 +7,43 @@
 #include "util.h"
 
 void register_release(Register *reg) {
+	text_snapshot_unref(reg->snap);
+	reg->snap = NULL;
 	buffer_release((Buffer*)reg);
 }
 
 bool register_put(Register *reg, Text *txt, Filerange *range) {
-	size_t len = range->end - range->start;
+	/* refer to the text data instead of copying it */
+	TextSnapshot *snap = text_snapshot_range(txt, range);
+	if (!snap)
+		return false;
+	text_snapshot_unref(reg->snap);
+	reg->snap = snap;
+	reg->len = text_snapshot_size(snap);
+	return true;
+}
+
+/* store a copy of the content referred to by the snapshot */
+static bool register_copy(Register *reg) {
+	size_t len = reg->len;
 	if (!buffer_grow((Buffer*)reg, len))
 		return false;
-	reg->len = text_bytes_get(txt, range->start, len, reg->data);
+	reg->len = text_snapshot_bytes_get(reg->snap, 0, len, reg->data);
+	text_snapshot_unref(reg->snap);
+	reg->snap = NULL;
 	return true;
 }
 
+bool register_detach(Register *reg, Text *txt) {
+	if (!reg->snap || !text_snapshot_of(reg->snap, txt))
+		return true;
+	return register_copy(reg);
+}
+
 bool register_append(Register *reg, Text *txt, Filerange *range) {
+	/* further content has to be stored along with the existing one */
+	if (reg->snap && !register_copy(reg))
+		return false;
 	size_t rem = reg->size - reg->len;
 	size_t len = range->end - range->start;
 	if (len > rem && !buffer_grow((Buffer*)reg, reg->size + len - rem))
@@ -26,3 +51,9 @@ bool register_append(Register *reg, Text *txt, Filerange *range) {
 	reg->len += text_bytes_get(txt, range->start, len, reg->data + reg->len);
 	return true;
 }
+
+bool register_insert(Register *reg, Text *txt, size_t pos) {
+	if (reg->snap)
+		return text_insert_snapshot(txt, pos, reg->snap);
+	return text_insert(txt, pos, reg->data, reg->len);
+}
@@ -11,10 +11,16 @@ typedef struct {
 	size_t len;    /* current length of data */
 	size_t size;   /* maximal capacity of the register */
 	bool linewise; /* place register content on a new line when inserting? */
+	TextSnapshot *snap; /* text content referred to instead of data, if non-NULL */
 } Register;
 
 void register_release(Register *reg);
 bool register_put(Register *reg, Text *txt, Filerange *range);
 bool register_append(Register *reg, Text *txt, Filerange *range);
+/* copy the content referred to in the text, which is about to be freed.
+ * otherwise all its buffers are kept until the register is overwritten */
+bool register_detach(Register *reg, Text *txt);
+/* insert the register content into the text at pos */
+bool register_insert(Register *reg, Text *txt, size_t pos);
 
 #endif
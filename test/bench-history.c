@@ -0,0 +1,63 @@
+/* Memory kept for the undo history. A session of random inserts and
+ * deletes with a snapshot after every 3rd edit is replayed, followed by
+ * a series of undo and redo operations.
+ *
+ * usage: bench-history [edits] [undos]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/resource.h>
+#include "text.h"
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+	size_t edits = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+	size_t undos = argc > 2 ? strtoul(argv[2], NULL, 10) : 100000;
+	Text *txt = text_load(NULL);
+	if (!txt) {
+		perror("text_load");
+		return 1;
+	}
+	srand(1);
+	double start = now();
+	for (size_t i = 0; i < edits; i++) {
+		size_t size = text_size(txt);
+		if (size > 0 && rand() % 3 == 0) {
+			size_t pos = rand() % size;
+			text_delete(txt, pos, 1 + rand() % (size - pos < 8 ? size - pos : 8));
+		} else {
+			char data[8];
+			size_t len = 1 + rand() % sizeof data;
+			for (size_t j = 0; j < len; j++)
+				data[j] = 'a' + rand() % 26;
+			text_insert(txt, rand() % (size + 1), data, len);
+		}
+		if (i % 3 == 2)
+			text_snapshot(txt);
+	}
+	for (size_t i = 0; i < undos; i++)
+		text_undo(txt);
+	for (size_t i = 0; i < undos; i++)
+		text_redo(txt);
+	double end = now();
+
+	TextAllocStats stats = text_alloc_stats(txt);
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	printf("edits      %zu\n", edits);
+	printf("undo/redo  %zu\n", undos);
+	printf("pieces     %zu\n", stats.pieces);
+	printf("changes    %zu\n", stats.changes);
+	printf("actions    %zu\n", stats.actions);
+	printf("text       %.1f MB\n", (stats.memory + stats.buffers) / 1e6);
+	printf("peak RSS   %.1f MB\n", usage.ru_maxrss / 1e3);
+	printf("time       %.2f s\n", end - start);
+	text_free(txt);
+	return 0;
+}
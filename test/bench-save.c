@@ -0,0 +1,145 @@
+/* Saving a large file after a few small insertions, comparing the current
+ * text_save to the previous approach of mapping the destination file and
+ * copying every piece into it. Each is run in a separate process, such that
+ * their peak RSS can be told apart. Run it with a warm page cache.
+ *
+ * Loading maps the file and scans it for new lines, the peak RSS before
+ * the save thus already covers the file, the save should not add to it.
+ *
+ * usage: bench-save [size in MB] [file]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "text.h"
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* the save as performed before writev(2) and copy_file_range(2) were used */
+static bool save_mmap(Text *txt, const char *filename) {
+	size_t size = text_size(txt);
+	int fd = open(filename, O_CREAT|O_RDWR|O_TRUNC, 0600);
+	if (fd == -1)
+		return false;
+	if (ftruncate(fd, size) == -1)
+		goto err;
+	if (size > 0) {
+		char *buf = mmap(NULL, size, PROT_WRITE, MAP_SHARED, fd, 0);
+		if (buf == MAP_FAILED)
+			goto err;
+		char *cur = buf;
+		size_t rem = size;
+		for (Iterator it = text_iterator_get(txt, 0);
+		     rem > 0 && text_iterator_valid(&it);
+		     text_iterator_next(&it)) {
+			size_t len = it.end - it.text;
+			if (len > rem)
+				len = rem;
+			memcpy(cur, it.text, len);
+			cur += len;
+			rem -= len;
+		}
+		if (munmap(buf, size) == -1)
+			goto err;
+	}
+	if (fsync(fd) == -1)
+		goto err;
+	return close(fd) == 0;
+err:
+	close(fd);
+	return false;
+}
+
+static int run(const char *name, const char *filename, bool (*save)(Text*, const char*)) {
+	Text *txt = text_load(filename);
+	if (!txt) {
+		perror("text_load");
+		return 1;
+	}
+	srand(1);
+	for (int i = 0; i < 100; i++)
+		text_insert(txt, rand() % (text_size(txt) + 1), "inserted", 8);
+	/* the scan pages in the file, wait for it such that it is not attributed to the save */
+	while (!text_lines_ready(txt))
+		nanosleep(&(struct timespec){ .tv_nsec = 1000000 }, NULL);
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	long rss = usage.ru_maxrss;
+	char *output = malloc(strlen(filename) + sizeof ".out");
+	if (!output)
+		return 1;
+	sprintf(output, "%s.out", filename);
+	double start = now();
+	bool saved = save(txt, output);
+	double end = now();
+	getrusage(RUSAGE_SELF, &usage);
+	text_free(txt);
+	unlink(output);
+	free(output);
+	if (!saved) {
+		perror(name);
+		return 1;
+	}
+	printf("%-20s %6.2f s, peak RSS %7.1f MB before, %7.1f MB after the save\n",
+	       name, end - start, rss / 1e3, usage.ru_maxrss / 1e3);
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	size_t size = (argc > 1 ? strtoul(argv[1], NULL, 10) : 256) << 20;
+	const char *filename = argc > 2 ? argv[2] : "bench-save.txt";
+	FILE *file = fopen(filename, "w");
+	if (!file) {
+		perror(filename);
+		return 1;
+	}
+	char line[64];
+	memset(line, 'x', sizeof line - 1);
+	line[sizeof line - 1] = '\n';
+	for (size_t len = 0; len < size; len += sizeof line) {
+		if (fwrite(line, sizeof line, 1, file) != 1) {
+			perror(filename);
+			return 1;
+		}
+	}
+	if (fclose(file) == EOF) {
+		perror(filename);
+		return 1;
+	}
+
+	printf("size %zu MB\n", size >> 20);
+	struct {
+		const char *name;
+		bool (*save)(Text*, const char*);
+	} saves[] = {
+		{ "old (mmap + memcpy)", save_mmap },
+		{ "new (text_save)", text_save },
+	};
+	int status = 0;
+	for (size_t i = 0; i < sizeof saves / sizeof *saves; i++) {
+		fflush(stdout);
+		pid_t pid = fork();
+		if (pid == -1) {
+			perror("fork");
+			status = 1;
+			break;
+		}
+		if (pid == 0)
+			exit(run(saves[i].name, filename, saves[i].save));
+		int child;
+		if (waitpid(pid, &child, 0) == -1 || !WIFEXITED(child) || WEXITSTATUS(child))
+			status = 1;
+	}
+	unlink(filename);
+	return status;
+}
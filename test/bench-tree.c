@@ -0,0 +1,45 @@
+/* Insert latency with a snapshot after each random insert. Every insert
+ * splits a piece, hence the number of pieces grows by about 2 per insert
+ * and position lookups have to cope with an increasingly long chain.
+ *
+ * usage: bench-tree [inserts...]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "text.h"
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void run(size_t inserts) {
+	Text *txt = text_load(NULL);
+	if (!txt) {
+		perror("text_load");
+		exit(1);
+	}
+	srand(1);
+	double start = now();
+	for (size_t i = 0; i < inserts; i++) {
+		text_insert(txt, rand() % (text_size(txt) + 1), "x", 1);
+		text_snapshot(txt);
+	}
+	double end = now();
+	printf("%8zu inserts %10.2f us/insert\n", inserts, (end - start) / inserts);
+	text_free(txt);
+}
+
+int main(int argc, char *argv[]) {
+	if (argc > 1) {
+		for (int i = 1; i < argc; i++)
+			run(strtoul(argv[i], NULL, 10));
+	} else {
+		run(12000);
+		run(36000);
+		run(60000);
+	}
+	return 0;
+}
@@ -15,6 +15,7 @@
  */
 #include <ctype.h>
 #include <string.h>
+#include <stdint.h>
 #include "text-motions.h"
 #include "text-util.h"
 #include "util.h"
@@ -553,6 +554,10 @@ size_t text_bracket_match(Text *txt, size_t pos) {
 }
 
 size_t text_bracket_match_except(Text *txt, size_t pos, const char *except) {
+	return text_bracket_match_range(txt, pos, except, NULL);
+}
+
+size_t text_bracket_match_range(Text *txt, size_t pos, const char *except, Filerange *limit) {
 	int direction, count = 1;
 	char search, current, c;
 	bool instring = false;
@@ -588,8 +593,11 @@ size_t text_bracket_match_except(Text *txt, size_t pos, const char *except) {
 	default: return pos;
 	}
 
+	size_t start = limit ? limit->start : 0;
+	size_t end = limit ? limit->end : SIZE_MAX;
+
 	if (direction >= 0) { /* forward search */
-		while (text_iterator_byte_next(&it, &c)) {
+		while (it.pos + 1 < end && text_iterator_byte_next(&it, &c)) {
 			if (c != current && c == '"')
 				instring = !instring;
 			if (!instring) {
@@ -600,7 +608,7 @@ size_t text_bracket_match_except(Text *txt, size_t pos, const char *except) {
 			}
 		}
 	} else { /* backwards */
-		while (text_iterator_byte_prev(&it, &c)) {
+		while (it.pos > start && text_iterator_byte_prev(&it, &c)) {
 			if (c != current && c == '"')
 				instring = !instring;
 			if (!instring) {
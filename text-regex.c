@@ -31,14 +31,34 @@ void text_regex_free(Regex *r) {
 	free(r);
 }
 
+/* get the data of the range without copying it if possible, i.e. if it is
+ * held by a single chunk and the regex library does not rely on NUL termination */
+static char *text_search_data(Text *txt, size_t pos, size_t *len, regmatch_t *match, int *eflags, char **buf) {
+	*buf = NULL;
+#ifdef REG_STARTEND
+	struct iovec iov;
+	Filerange r = { pos, pos + *len };
+	if (text_chunks_get(txt, &r, &iov, 1) && iov.iov_len == *len) {
+		match->rm_so = 0;
+		match->rm_eo = *len;
+		*eflags |= REG_STARTEND;
+		return iov.iov_base;
+	}
+#endif
+	if (!(*buf = malloc(*len + 1)))
+		return NULL;
+	*len = text_bytes_get(txt, pos, *len, *buf);
+	(*buf)[*len] = '\0';
+	return *buf;
+}
+
 int text_search_range_forward(Text *txt, size_t pos, size_t len, Regex *r, size_t nmatch, RegexMatch pmatch[], int eflags) {
-	char *buf = malloc(len + 1);
-	if (!buf)
+	char *buf;
+	regmatch_t match[nmatch + 1];
+	const char *data = text_search_data(txt, pos, &len, match, &eflags, &buf);
+	if (!data)
 		return REG_NOMATCH;
-	len = text_bytes_get(txt, pos, len, buf);
-	buf[len] = '\0';
-	regmatch_t match[nmatch];
-	int ret = regexec(&r->regex, buf, nmatch, match, eflags);
+	int ret = regexec(&r->regex, data, nmatch, match, eflags);
 	if (!ret) {
 		for (size_t i = 0; i < nmatch; i++) {
 			pmatch[i].start = match[i].rm_so == -1 ? EPOS : pos + match[i].rm_so;
@@ -50,21 +70,29 @@ int text_search_range_forward(Text *txt, size_t pos, size_t len, Regex *r, size_
 }
 
 int text_search_range_backward(Text *txt, size_t pos, size_t len, Regex *r, size_t nmatch, RegexMatch pmatch[], int eflags) {
-	char *buf = malloc(len + 1);
-	if (!buf)
+	char *buf;
+	regmatch_t match[nmatch + 1];
+	const char *data = text_search_data(txt, pos, &len, match, &eflags, &buf);
+	if (!data)
 		return REG_NOMATCH;
-	len = text_bytes_get(txt, pos, len, buf);
-	buf[len] = '\0';
-	regmatch_t match[nmatch];
-	char *cur = buf;
 	int ret = REG_NOMATCH;
-	while (!regexec(&r->regex, cur, nmatch, match, eflags)) {
+	for (size_t cur = 0; ; ) {
+		/* match offsets are relative to the start of the searched string,
+		 * which only moves along if the data was copied */
+		size_t base = buf ? cur : 0;
+		int flags = eflags;
+		if (base && data[base-1] != '\n')
+			flags |= REG_NOTBOL;
+		match[0].rm_so = cur;
+		match[0].rm_eo = len;
+		if (regexec(&r->regex, data + base, nmatch, match, flags))
+			break;
 		ret = 0;
 		for (size_t i = 0; i < nmatch; i++) {
-			pmatch[i].start = match[i].rm_so == -1 ? EPOS : pos + (size_t)(cur - buf) + match[i].rm_so;
-			pmatch[i].end = match[i].rm_eo == -1 ? EPOS : pos + (size_t)(cur - buf) + match[i].rm_eo;
+			pmatch[i].start = match[i].rm_so == -1 ? EPOS : pos + base + match[i].rm_so;
+			pmatch[i].end = match[i].rm_eo == -1 ? EPOS : pos + base + match[i].rm_eo;
 		}
-		cur += match[0].rm_eo;
+		cur = base + match[0].rm_eo;
 	}
 	free(buf);
 	return ret;
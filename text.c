@@ -13,16 +13,28 @@
  * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
+#ifdef HAVE_COPY_FILE_RANGE
+#define _GNU_SOURCE
+#endif
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
 #include <string.h>
 #include <time.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 #ifdef HAVE_ACL
 #include <sys/acl.h>
 #endif
@@ -33,24 +45,87 @@
 #include "text.h"
 #include "text-util.h"
 #include "util.h"
+#include "lz4.h"
 
-/* Allocate buffers holding the actual file content in junks of size: */
+/* Insertion buffers grow geometrically up to: */
 #define BUFFER_SIZE (1 << 20)
 /* Files smaller than this value are copied on load, larger ones are mmap(2)-ed
  * directely. Hence the former can be truncated, while doing so on the latter
  * results in havoc. */
 #define BUFFER_MMAP_SIZE (1 << 23)
+/* The number of new lines within a buffer is sampled at multiples of: */
+#define BUFFER_LINES_BLOCK (1 << 16)
+/* Buffers and hence pieces hold at most this many bytes, such that offsets
+ * fit into 32 bits. Larger files are mmap(2)-ed in multiple buffers. */
+#define BUFFER_MAX (1 << 30)
+/* Data read by text_load_fd is stored in buffers growing up to this size: */
+#define BUFFER_LOAD_MAX (1 << 26)
+/* Insertion buffers holding less data than this are not compressed by text_compress */
+#define BUFFER_PACK_MIN (1 << 16)
+/* Number of buffer size classes of the pool, the largest one spans 4 << 12 pages */
+#define POOL_CLASSES 52
+/* Address space of released buffers kept for reuse by all texts, in bytes */
+#define POOL_CACHE (1 << 28)
+/* Pieces, changes and actions are allocated in chunks of up to this many objects: */
+#define SLAB_OBJECTS (1 << 12)
+/* Data of the loaded file in chunks of at least this size is written by the
+ * kernel, smaller ones are gathered with the remaining data into one writev(2) */
+#define BUFFER_COPY_SIZE (1 << 16)
+/* Size of the memory buffer in which journal records are gathered before being written */
+#define JOURNAL_BUFFER (1 << 16)
+/* Files smaller than this are scanned quickly enough that no line index file is kept */
+#define INDEX_MIN (1 << 26)
+/* Files in other encodings are transcoded in chunks of this many source bytes */
+#define DECODE_CHUNK (1 << 18)
+/* Snapshots copy the pieces in blocks of up to this many, which later ones share */
+#define SNAPSHOT_BLOCK 256
+/* Marks the new line count of a piece which was not yet determined */
+#define LINES_UNKNOWN UINT32_MAX
+/* Content hashes are computed modulo this prime, see hash_bytes */
+#define HASH_PRIME ((UINT64_C(1) << 61) - 1)
+/* Marks a content hash which was not yet determined */
+#define HASH_UNKNOWN UINT64_MAX
 
 /* Buffer holding the file content, either readonly mmap(2)-ed from the original
- * file or heap allocated to store the modifications.
+ * file or anonymous memory storing the modifications. The latter might later be
+ * spilled to the history file which is then mapped in place of the memory, or
+ * be compressed while it is not used. Its memory is then released, but the
+ * address range remains reserved until the data is decompressed into it again.
+ * Files in an encoding other than UTF-8 stay mapped as is, their content is
+ * decoded into an anonymous mapping chunk by chunk as the pieces are accessed.
  */
+typedef struct {
+	const char *src;           /* encoded data within the mapped file */
+	size_t src_len;
+	size_t off, len;           /* range of the decoded data within the buffer */
+	bool decoded;              /* whether the range holds the data */
+} DecodeChunk;
+
 typedef struct Buffer Buffer;
 struct Buffer {
 	size_t size;               /* maximal capacity */
 	size_t len;                /* current used length / insertion position */
 	char *data;                /* actual data */
-	enum { MMAP, MALLOC} type; /* type of allocation */
+	enum { MMAP, ANON, SPILL, PACKED, DECODED } type; /* type of allocation */
+	int fd;                    /* file mapped at data, -1 if there is none to copy from */
+	off_t offset;              /* file offset of the mapping */
 	Buffer *next;              /* next junk */
+	uint32_t id;               /* index into the buffer table of the text, starting from 1 */
+	size_t *lines;             /* lines[i] number of '\n' in data[0, i*BUFFER_LINES_BLOCK) */
+	size_t lines_count;        /* number of valid entries in lines, computed on demand */
+	size_t lines_size;         /* number of allocated entries in lines */
+	uint64_t *hashes;          /* hashes[i] content hash of data[0, i*BUFFER_LINES_BLOCK) */
+	size_t hashes_count;       /* number of valid entries in hashes, computed on demand */
+	size_t hashes_size;        /* number of allocated entries in hashes */
+	size_t undo_len;           /* number of bytes already written to the undo file */
+	uint64_t *undo_pages;      /* bitmap of the pages of a mapped file buffer written to it */
+	char *packed;              /* compressed data of a PACKED buffer */
+	size_t packed_len;         /* its length in bytes */
+	bool cold;                 /* whether unused since the last text_compress, modified atomically */
+	bool dense;                /* whether compression did not pay off */
+	DecodeChunk *chunks;       /* source of a DECODED buffer, ordered by offset */
+	size_t chunk_count;
+	enum TextEncoding encoding;/* in which the source is encoded */
 };
 
 /* A piece holds a reference (but doesn't itself store) a certain amount of data.
@@ -60,13 +135,34 @@ struct Buffer {
  * Generally pieces are never destroyed, but kept around to peform undo/redo
  * operations.
  */
+typedef struct Node Node;
 struct Piece {
-	Text *text;             /* text to which this piece belongs */
 	Piece *prev, *next;     /* pointers to the logical predecessor/successor */
-	Piece *global_prev;     /* double linked list in order of allocation, */
-	Piece *global_next;     /* used to free individual pieces */
-	const char *data;       /* pointer into a Buffer holding the data */
-	size_t len;             /* the length in number of bytes of the data */
+	Node *node;             /* index node while the piece is part of the text, NULL otherwise */
+	uint32_t buf;           /* id of the buffer holding the data, 0 for sentinels */
+	uint32_t off;           /* offset of the data within the buffer */
+	uint32_t len;           /* the length in number of bytes of the data */
+	uint32_t lines;         /* number of '\n' in data, LINES_UNKNOWN if not yet counted */
+	uint64_t hash;          /* content hash of the data, HASH_UNKNOWN if not yet computed */
+};
+
+/* The pieces which are part of the text are indexed by position as well as
+ * by data address. The necessary tree nodes only exist while a piece is
+ * active, pieces which are merely kept around for undo/redo do not pay for
+ * them.
+ */
+struct Node {
+	Piece *piece;           /* indexed piece, links unused nodes while they are free */
+	Node *parent;           /* position index: parent node */
+	Node *left, *right;     /* subtrees holding the preceding/following pieces */
+	Node *addr_parent;      /* address index: parent node, */
+	Node *addr_left;        /* subtrees holding the pieces with lower/higher */
+	Node *addr_right;       /* data addresses, only used for non-empty pieces */
+	size_t subtree_len;     /* sum of the lengths of all pieces in this subtree */
+	size_t subtree_lines;   /* sum of the new lines in this subtree, EPOS if unknown */
+	uint64_t subtree_hash;  /* content hash of this subtree, HASH_UNKNOWN if not yet computed */
+	uint64_t subtree_pow;   /* hash_pow(subtree_len), valid along with subtree_hash */
+	unsigned int priority;  /* random heap priority keeping the trees balanced */
 };
 
 /* used to transform a global position (byte offset starting from the beginning
@@ -91,10 +187,20 @@ struct Change {
 	Span old;               /* all pieces which are being modified/swapped out by the change */
 	Span new;               /* all pieces which are introduced/swapped in by the change */
 	size_t pos;             /* absolute position at which the change occured */
-	Change *next;           /* next change which is part of the same action */
-	Change *prev;           /* previous change which is part of the same action */
+	Change *next;           /* next (older) change which is part of the same action */
 };
 
+/* An Edit is a pending modification registered by text_edit_apply. */
+typedef struct {
+	size_t pos;             /* position in bytes relative to the text at text_edit_begin time */
+	size_t len;             /* number of bytes to delete */
+	size_t data_len;        /* number of bytes to insert */
+	uint32_t buf;           /* id of the buffer holding the inserted data, 0 if none */
+	uint32_t off;           /* offset of the inserted data within its buffer */
+	size_t seq;             /* registration order, edits at the same position keep it */
+	size_t newpos;          /* position in the modified text, set upon commit */
+} Edit;
+
 /* An Action is a list of Changes which are used to undo/redo all modifications
  * since the last snapshot operation. Actions are stored in a directed graph structure.
  */
@@ -103,44 +209,274 @@ struct Action {
 	Change *change;         /* the most recent change */
 	Action *next;           /* the next (child) action in the undo tree */
 	Action *prev;           /* the previous (parent) operation in the undo tree */
-	Action *earlier;        /* the previous Action, chronologically */
-	Action *later;          /* the next Action, chronologically */
 	time_t time;            /* when the first change of this action was performed */
-	size_t seq;             /* a unique, strictly increasing identifier */
+	size_t seq;             /* a unique, strictly increasing identifier, index into the action table */
+};
+
+/* Pieces, changes and actions are never freed individually. Instead they are
+ * carved out of larger chunks which are all released when the text is freed.
+ */
+typedef struct SlabChunk SlabChunk;
+struct SlabChunk {
+	SlabChunk *next;        /* previously allocated chunk */
+	size_t size;            /* capacity in bytes of the object area following this header */
 };
 
 typedef struct {
-	size_t pos;             /* position in bytes from start of file */
-	size_t lineno;          /* line number in file i.e. number of '\n' in [0, pos) */
-} LineCache;
+	size_t size;            /* size of an individual object */
+	SlabChunk *chunks;      /* most recently allocated chunk */
+	size_t used;            /* bytes handed out from the most recent chunk */
+	size_t count;           /* number of objects allocated */
+	size_t memory;          /* bytes reserved by all chunks */
+} Slab;
+
+/* Anonymous memory of insertion and load buffers is shared by all texts of the
+ * process. Its size is rounded up to one of POOL_CLASSES size classes, growing
+ * in quarter steps from a single page, such that small files do not occupy
+ * more than necessary. The memory of released buffers is returned to the system,
+ * while their address range is kept to be reused by the same class. Larger
+ * buffers are mapped individually.
+ */
+typedef struct {
+	char **free;            /* address ranges of released buffers */
+	size_t count;           /* number of them */
+	size_t size;            /* number of entries the array has room for */
+} PoolClass;
+
+typedef struct {
+	pthread_mutex_t lock;   /* buffers might be released by other threads */
+	int zero;               /* /dev/zero from which memory is mapped, -1 until needed */
+	PoolClass classes[POOL_CLASSES];
+	size_t committed;       /* bytes currently handed out */
+	size_t pooled;          /* bytes of address space kept for reuse */
+	size_t compressed;      /* bytes of buffer data held compressed */
+	size_t packed;          /* bytes of compressed data */
+	size_t unpacks;         /* number of buffers decompressed on demand */
+	uint64_t unpack_time;   /* nanoseconds spent doing so */
+	uint64_t unpack_max;    /* longest time taken by one of them */
+} Pool;
+
+static Pool pool = { .lock = PTHREAD_MUTEX_INITIALIZER, .zero = -1 };
+
+/* recovery point of a thread reading file content, to which an access to a
+ * truncated file jumps back from the SIGBUS handler, see text_sigbus_abort */
+static __thread sigjmp_buf *sigbus_recover;
+
+typedef struct Journal Journal;
+typedef struct Scan Scan;
+
+/* content read by a worker thread, whose truncated pages read as zero bytes
+ * if they are accessed outside of a recovery point, see text_sigbus_abort */
+static __thread Scan *sigbus_scan;
+static __thread TextSnapshot *sigbus_snap;
+
+/* range of a buffer of the loaded file which the history refers to, it is
+ * stored as part of the buffer restored from the previous one */
+typedef struct {
+	uint32_t buf, off, len;    /* range of the buffer taken over */
+	uint32_t orig;             /* restored buffer the range is stored in */
+	size_t orig_off;
+} UndoMove;
 
 /* The main struct holding all information of a given file */
 struct Text {
 	Buffer *buf;            /* original file content at the time of load operation */
 	Buffer *buffers;        /* all buffers which have been allocated to hold insertion data */
-	Piece *pieces;          /* all pieces which have been allocated, used to free them */
+	Buffer **buffer_table;  /* all buffers indexed by their id */
+	size_t buffer_count;    /* number of entries in the buffer table, including unused slot 0 */
+	Slab pieces;            /* allocator for all pieces */
+	Slab changes;           /* allocator for all changes */
+	Slab actions;           /* allocator for all actions */
+	Slab nodes;             /* allocator for index nodes */
+	Node *nodes_free;       /* unused index nodes available for reuse */
+	size_t nodes_free_count;/* number of unused index nodes */
 	Piece *cache;           /* most recently modified piece */
+	Edit *edits;            /* pending (or last committed) batch of edits */
+	size_t edits_count;     /* number of edits in the batch */
+	size_t edits_size;      /* number of edits the array has room for */
 	Piece begin, end;       /* sentinel nodes which always exists but don't hold any data */
+	Node *tree;             /* root of the position index over all active pieces */
+	Node *addr_tree;        /* root of the address index over all non-empty active pieces */
+	unsigned int seed;      /* state of the pseudo random generator for tree priorities */
 	Action *history;        /* undo tree */
 	Action *current_action; /* action holding all file changes until a snapshot is performed */
 	Action *last_action;    /* the last action added to the tree, chronologically */
+	Action **action_table;  /* all actions indexed by their sequence number, i.e. in chronological order */
+	size_t action_table_size; /* number of entries the action table has room for */
 	Action *saved_action;   /* the last action at the time of the save operation */
+	uint64_t saved_hash;    /* content hash of the saved state, HASH_UNKNOWN if not determined */
+	size_t saved_size;      /* its size in bytes, valid along with saved_hash */
 	size_t size;            /* current file content size in bytes */
+	size_t history_limit;   /* maximal size of insertion buffers kept in memory, 0 if unlimited */
+	size_t history_memory;  /* size of all insertion buffers currently kept in memory */
+	size_t history_size;    /* number of bytes spilled to the history file */
+	int history_fd;         /* unlinked temporary file holding spilled buffers, -1 if none */
+	uint32_t spill_next;    /* id of the oldest buffer which might still be spilled */
+	size_t undo_size;       /* size of the undo file as of the last complete write, 0 if none */
+	size_t undo_pieces;     /* number of pieces written to the undo file */
+	size_t undo_actions;    /* number of actions written to the undo file */
+	UndoMove *undo_moves;   /* ranges of the file the history was loaded for, sorted by buffer and offset */
+	size_t undo_move_count;
+	struct stat undo_info;  /* stat of the undo file after the last write */
 	struct stat info;       /* stat as probed at load time */
-	LineCache lines;        /* mapping between absolute pos in bytes and logical line breaks */
+	TextSnapshot *snapshot; /* most recent snapshot of the whole text, shared until the next modification */
+	bool snapshot_modified; /* whether the text was modified since, within the following range */
+	size_t snapshot_start, snapshot_end; /* range holding all modifications, in current positions */
+	unsigned int refs;      /* 1 + number of snapshots referring to the buffers, modified atomically */
+	TextSave *save;         /* pending background save, NULL if none */
+	Journal *journal;       /* crash recovery journal of all modifications, NULL if none */
+	Buffer *load;           /* buffer receiving the data read by text_load_fd, NULL if none */
+	Piece *load_piece;      /* piece referring to the most recently read data */
+	size_t load_changes;    /* number of changes allocated when the read data was last linked or extended */
+	size_t loaded;          /* number of bytes appended by text_load_fd */
+	size_t loaded_saved;    /* value of loaded at the time of the last save */
+	Scan *scan;             /* properties of the loaded file content, NULL if unknown */
 	enum TextNewLine newlines; /* which type of new lines does the file use */
+	enum TextEncoding encoding; /* of the file, content other than UTF-8 is transcoded */
+	bool bom;               /* whether the file starts with a byte order mark */
+};
+
+/* A read only view of the text content at a given point in time. The active
+ * pieces are copied, such that the chain remains intact while the text is
+ * further modified. The data itself is shared, since buffers are only ever
+ * appended to and not freed before the last reference to them is dropped.
+ *
+ * The copies are stored in blocks, which are shared by the next snapshot of
+ * the whole text unless they hold modified pieces. The pieces of a block are
+ * linked to its own sentinels, which the iterators resolve to the adjacent
+ * blocks of the snapshot at hand, see snapshot_link. To find a block among
+ * those of a snapshot, each one is labeled such that the labels of all blocks
+ * sharing it are in the order of their positions.
+ */
+typedef struct {
+	Piece piece;            /* copy of a piece */
+	size_t pos;             /* its start position relative to the block */
+} SnapshotPiece;
+
+typedef struct {
+	Piece head, tail;       /* sentinels preceding the first and following the last piece */
+	uint64_t label;         /* orders the blocks of the snapshots sharing it */
+	unsigned int refs;      /* number of snapshots referring to it, modified atomically */
+	size_t len;             /* sum of the lengths of its pieces */
+	size_t count;           /* number of pieces */
+	SnapshotPiece pieces[]; /* room for SNAPSHOT_BLOCK pieces */
+} SnapshotBlock;
+
+struct TextSnapshot {
+	Text *txt;              /* text whose buffers are referenced */
+	Text view;              /* size, buffer table and sentinels used by the iterators */
+	SnapshotBlock **blocks; /* copies of the pieces forming the text at snapshot time */
+	size_t *pos;            /* absolute start position of each block */
+	size_t block_count;
+	unsigned int refs;      /* number of references, modified atomically */
 };
 
+/* A save performed by a separate thread which writes a snapshot of the text */
+struct TextSave {
+	Text *txt;              /* text to mark as saved, NULL if it was freed in the meantime */
+	TextSnapshot *snap;     /* content being written */
+	Action *saved;          /* action corresponding to the snapshotted state */
+	char *filename;         /* destination */
+	char *tmpname;          /* temporary file written by the thread, moved into place once complete */
+	int fd;                 /* its descriptor, owned by the thread */
+	pthread_t thread;       /* writer thread */
+	size_t written;         /* bytes written so far, modified atomically */
+	bool done;              /* whether the writer thread terminated, modified atomically */
+	bool success;           /* whether the file was saved, valid once done */
+	int error;              /* errno value in case of failure */
+	struct stat info;       /* stat of the new file */
+	size_t journal;         /* journal offset following the records of the saved state, EPOS if none */
+	size_t loaded;          /* number of bytes appended by text_load_fd as of the snapshot */
+};
+
+/* The loaded file content is scanned once to determine its properties along
+ * with the new line checkpoints of its buffers. The data of mmap(2)-ed files
+ * is scanned by a separate thread, which only reads the buffers and thereby
+ * also pages them in. The checkpoints are taken over once it is done. The
+ * thread then continues to compute the content hash checkpoints, which are
+ * taken over separately.
+ */
+typedef struct {
+	Buffer *buf;            /* buffer taking over the checkpoints */
+	const char *data;       /* its data as of load time */
+	size_t len;
+	size_t *lines;          /* new line checkpoints as in Buffer */
+	uint64_t *hashes;       /* content hash checkpoints as in Buffer */
+} ScanChunk;
+
+struct Scan {
+	TextLoadInfo info;      /* properties determined so far */
+	ScanChunk *chunks;      /* one per loaded buffer */
+	size_t count;
+	bool threaded;          /* whether the scanner thread has yet to be joined */
+	pthread_t thread;       /* scanner thread */
+	pthread_mutex_t lock;   /* protects the signaling of done */
+	pthread_cond_t cond;    /* signaled once done */
+	bool done;              /* whether the scan terminated, modified atomically */
+	bool stop;              /* whether the scan should be aborted, modified atomically */
+	bool complete;          /* whether all data was scanned, valid once done */
+	bool adopted;           /* whether the results were taken over */
+	bool hashing;           /* whether the thread is computing the hashes, modified atomically */
+	bool stop_hash;         /* whether the hashes are no longer of interest, modified atomically */
+	bool hashed;            /* whether all hashes were computed, valid once no longer hashing */
+	bool hashes_adopted;    /* whether the hashes were taken over */
+	char *index;            /* file to which the results are written, modified atomically */
+	struct stat index_info; /* file information of the indexed content, set along with it */
+	size_t line;            /* length of the current line */
+	unsigned int need;      /* number of UTF-8 continuation bytes still expected */
+	unsigned char lo, hi;   /* valid range of the next continuation byte */
+	unsigned char last;     /* last byte scanned */
+	bool newline;           /* whether a new line was found */
+};
+
+/* slab allocation */
+static void slab_init(Slab *slab, size_t size);
+static void *slab_alloc(Slab *slab);
+static void slab_release(Slab *slab);
+/* buffer pool */
+static char *pool_alloc(size_t *size);
+static void pool_release(char *data, size_t size);
+static bool pool_commit(char *data, size_t size);
+static bool pool_decommit(char *data, size_t size);
+static int pool_zero(void);
 /* buffer management */
+static Buffer *buffer_anon(size_t size);
 static Buffer *buffer_alloc(Text *txt, size_t size);
+static Buffer *buffer_load(Text *txt);
 static Buffer *buffer_read(Text *txt, size_t size, int fd);
 static Buffer *buffer_mmap(Text *txt, size_t size, int fd, off_t offset);
 static void buffer_free(Buffer *buf);
+static char *buffer_data(Buffer *buf);
+static bool buffer_pack(Buffer *buf);
+static bool buffer_unpack(Buffer *buf);
+static Buffer *buffer_decoded(Text *txt, enum TextEncoding encoding, DecodeChunk *chunks, size_t count);
+static void buffer_decode(Buffer *buf, size_t off, size_t len);
 static bool buffer_capacity(Buffer *buf, size_t len);
 static const char *buffer_append(Buffer *buf, const char *data, size_t len);
 static bool buffer_insert(Buffer *buf, size_t pos, const char *data, size_t len);
 static bool buffer_delete(Buffer *buf, size_t pos, size_t len);
-static const char *buffer_store(Text *txt, const char *data, size_t len);
+static Buffer *buffer_store(Text *txt, const char *data, size_t len);
+static bool buffer_register(Text *txt, Buffer *buf);
+static size_t buffer_copy(Buffer *buf, size_t off, size_t len, int fd);
+static ssize_t iterator_write(Iterator it, size_t size, int fd, size_t *progress);
+static ssize_t iterator_save(Iterator it, size_t size, int fd, size_t *progress);
+static int save_atomic_open(const char *filename, char **tmpname);
+static bool save_atomic_commit(int fd, char *tmpname, const char *filename, struct stat *info);
+static ssize_t iterator_save_guarded(Iterator it, size_t size, int fd, size_t *progress);
+static bool buffer_spill(Text *txt, Buffer *buf);
+static void buffer_spill_all(Text *txt);
+static size_t buffer_lines(Buffer *buf, size_t off);
+static size_t buffer_lines_skip(Buffer *buf, size_t off, size_t end, size_t *lines);
+static uint64_t buffer_hash(Buffer *buf, size_t off);
+/* load time scan */
+static Scan *scan_new(Text *txt);
+static void scan_adopt(Text *txt, Buffer *buf);
+static bool scan_adopt_hashes(Text *txt);
+static void scan_finish(Scan *s);
+static void scan_free(Scan *s);
+/* line index file */
+static int index_begin(Scan *s);
+static void index_finish(Scan *s, int fd);
 /* cache layer */
 static void cache_piece(Text *txt, Piece *p);
 static bool cache_contains(Text *txt, Piece *p);
@@ -148,23 +484,63 @@ static bool cache_insert(Text *txt, Piece *p, size_t off, const char *data, size
 static bool cache_delete(Text *txt, Piece *p, size_t off, size_t len);
 /* piece management */
 static Piece *piece_alloc(Text *txt);
-static void piece_free(Piece *p);
-static void piece_init(Piece *p, Piece *prev, Piece *next, const char *data, size_t len);
+static void piece_init(Piece *p, Piece *prev, Piece *next, uint32_t buf, size_t off, size_t len);
+static const char *piece_data(const Text *txt, const Piece *p);
+static const char *piece_addr(const Text *txt, const Piece *p);
 static Location piece_get_intern(Text *txt, size_t pos);
 static Location piece_get_extern(Text *txt, size_t pos);
+/* index nodes */
+static bool node_reserve(Text *txt, size_t count);
+static Node *node_alloc(Text *txt);
+static void node_free(Text *txt, Node *node);
+/* position index */
+static void tree_insert(Text *txt, Piece *prev, Piece *p);
+static void tree_remove(Text *txt, Piece *p);
+static Location tree_lookup(Text *txt, size_t pos);
+static size_t tree_pos(Node *node);
+/* address index */
+static bool addr_contains(Text *txt, Node *node);
+static void addr_insert(Text *txt, Node *node);
+static void addr_remove(Text *txt, Node *node);
+static Piece *addr_lookup(Text *txt, const char *addr);
 /* span management */
 static void span_init(Span *span, Piece *start, Piece *end);
 static void span_swap(Text *txt, Span *old, Span *new);
+static bool span_append(Text *txt, Span *span, uint32_t buf, size_t off, size_t len);
 /* change management */
 static Change *change_alloc(Text *txt, size_t pos);
-static void change_free(Change *c);
+static Change *change_reverse(Change *c);
 /* action management */
 static Action *action_alloc(Text *txt);
-static void action_free(Action *a);
-/* logical line counting cache */
-static void lineno_cache_invalidate(LineCache *cache);
-static size_t lines_skip_forward(Text *txt, size_t pos, size_t lines, size_t *lines_skiped);
-static size_t lines_count(Text *txt, size_t pos, size_t len);
+static bool action_reserve(Text *txt);
+/* crash recovery journal */
+static void journal_record(Journal *j, size_t pos, size_t deleted, const struct iovec *iov, size_t count);
+static void journal_append(Journal *j, size_t pos, const char *data, size_t len);
+static void journal_swap(Text *txt, Span *old, Span *new);
+static void journal_free(Journal *j);
+static size_t journal_offset(Journal *j);
+static void journal_restart(Text *txt, size_t keep);
+/* read only snapshots */
+static void snapshot_invalidate(Text *txt);
+static void snapshot_modify(Text *txt, size_t pos, size_t old_len, size_t new_len);
+static void snapshot_piece_modify(Text *txt, Piece *p, size_t off, size_t old_len, size_t new_len);
+static Piece *iterator_piece(const Text *txt, Piece *p);
+static void text_release(Text *txt);
+/* logical line index */
+static size_t lines_count(const char *data, size_t len);
+static size_t lines_skip(const char *data, size_t len, size_t *lines);
+static size_t piece_lines(Text *txt, Piece *p);
+static size_t piece_lines_count(Text *txt, Piece *p, size_t len);
+static size_t piece_lines_skip(Text *txt, Piece *p, size_t *lines);
+static size_t tree_lines_count(Text *txt, Node *node);
+static size_t tree_lines_skip(Text *txt, Node *node, size_t *lines);
+/* content hashes */
+static uint64_t hash_mul(uint64_t a, uint64_t b);
+static uint64_t hash_pow(size_t len);
+static uint64_t hash_bytes(uint64_t hash, const char *data, size_t len);
+static uint64_t piece_hash(Text *txt, Piece *p);
+static uint64_t tree_hash(Text *txt, Node *node, uint64_t *pow);
+static void saved_hash_capture(Text *txt);
 
 static ssize_t write_all(int fd, const char *buf, size_t count) {
 	size_t rem = count;
@@ -183,21 +559,193 @@ static ssize_t write_all(int fd, const char *buf, size_t count) {
 	return count - rem;
 }
 
-/* allocate a new buffer of MAX(size, BUFFER_SIZE) bytes */
-static Buffer *buffer_alloc(Text *txt, size_t size) {
+static void slab_init(Slab *slab, size_t size) {
+	*slab = (Slab){ .size = size };
+}
+
+/* returns a zero initialized object, chunks grow geometrically up to
+ * SLAB_OBJECTS objects such that small texts remain cheap */
+static void *slab_alloc(Slab *slab) {
+	SlabChunk *chunk = slab->chunks;
+	if (!chunk || chunk->size - slab->used < slab->size) {
+		size_t objects = chunk ? MIN(2 * chunk->size / slab->size, SLAB_OBJECTS) : 8;
+		size_t size = objects * slab->size;
+		if (!(chunk = calloc(1, sizeof(SlabChunk) + size)))
+			return NULL;
+		chunk->next = slab->chunks;
+		chunk->size = size;
+		slab->chunks = chunk;
+		slab->used = 0;
+		slab->memory += sizeof(SlabChunk) + size;
+	}
+	void *obj = (char*)(chunk + 1) + slab->used;
+	slab->used += slab->size;
+	slab->count++;
+	return obj;
+}
+
+static void slab_release(Slab *slab) {
+	for (SlabChunk *next, *chunk = slab->chunks; chunk; chunk = next) {
+		next = chunk->next;
+		free(chunk);
+	}
+	slab_init(slab, slab->size);
+}
+
+/* number of pages of the given size class: 1, 2, .., 7, 8, 10, 12, 14, 16, 20, .. */
+static size_t pool_pages(int c) {
+	return c < 7 ? (size_t)c + 1 : (size_t)(4 + (c - 7) % 4) << ((c - 7) / 4 + 1);
+}
+
+/* smallest size class spanning `pages', -1 if there is none */
+static int pool_class(size_t pages) {
+	for (int c = 0; c < POOL_CLASSES; c++) {
+		if (pool_pages(c) >= pages)
+			return c;
+	}
+	return -1;
+}
+
+/* returns the descriptor of /dev/zero from which memory is mapped, -1 if it
+ * can not be opened. once opened it remains valid, e.g. for signal handlers */
+static int pool_zero(void) {
+	pthread_mutex_lock(&pool.lock);
+	if (pool.zero == -1)
+		pool.zero = open("/dev/zero", O_RDONLY|O_CLOEXEC);
+	int zero = pool.zero;
+	pthread_mutex_unlock(&pool.lock);
+	return zero;
+}
+
+/* returns zero initialized memory of at least `size' bytes, which is set to the
+ * actual size. it is mapped such that it can later be replaced by the history file */
+static char *pool_alloc(size_t *size) {
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t pages = MAX((*size + page - 1) / page, 1);
+	int c = pool_class(pages);
+	if (c != -1)
+		pages = pool_pages(c);
+	*size = pages * page;
+	char *data = MAP_FAILED;
+	pthread_mutex_lock(&pool.lock);
+	if (pool.zero == -1)
+		pool.zero = open("/dev/zero", O_RDONLY|O_CLOEXEC);
+	if (c != -1 && pool.classes[c].count) {
+		data = pool.classes[c].free[--pool.classes[c].count];
+		pool.pooled -= *size;
+		if (mprotect(data, *size, PROT_READ|PROT_WRITE) == -1) {
+			munmap(data, *size);
+			data = MAP_FAILED;
+		}
+	}
+	if (data == MAP_FAILED && pool.zero != -1)
+		data = mmap(NULL, *size, PROT_READ|PROT_WRITE, MAP_PRIVATE, pool.zero, 0);
+	if (data != MAP_FAILED)
+		pool.committed += *size;
+	pthread_mutex_unlock(&pool.lock);
+	return data == MAP_FAILED ? NULL : data;
+}
+
+/* return memory obtained from pool_alloc. its content is discarded by mapping
+ * inaccessible zero pages over it, which neither occupy memory nor count
+ * towards the commit charge of the process */
+static void pool_release(char *data, size_t size) {
+	size_t page = sysconf(_SC_PAGESIZE);
+	pthread_mutex_lock(&pool.lock);
+	pool.committed -= size;
+	int c = pool_class(size / page);
+	PoolClass *class = c != -1 && pool_pages(c) * page == size ? &pool.classes[c] : NULL;
+	if (class && class->count == class->size) {
+		size_t count = class->size ? 2 * class->size : 16;
+		char **free = realloc(class->free, count * sizeof *free);
+		if (free) {
+			class->free = free;
+			class->size = count;
+		}
+	}
+	if (class && class->count < class->size && pool.pooled + size <= POOL_CACHE &&
+	    mmap(data, size, PROT_NONE, MAP_PRIVATE|MAP_FIXED, pool.zero, 0) != MAP_FAILED) {
+		class->free[class->count++] = data;
+		pool.pooled += size;
+	} else {
+		munmap(data, size);
+	}
+	pthread_mutex_unlock(&pool.lock);
+}
+
+/* release the memory of a buffer obtained from pool_alloc like pool_release,
+ * but keep its address range reserved for the same buffer */
+static bool pool_decommit(char *data, size_t size) {
+	pthread_mutex_lock(&pool.lock);
+	bool success = mmap(data, size, PROT_NONE, MAP_PRIVATE|MAP_FIXED, pool.zero, 0) != MAP_FAILED;
+	if (success)
+		pool.committed -= size;
+	pthread_mutex_unlock(&pool.lock);
+	return success;
+}
+
+/* make the decommitted range accessible again, it is zero initialized */
+static bool pool_commit(char *data, size_t size) {
+	pthread_mutex_lock(&pool.lock);
+	bool success = mprotect(data, size, PROT_READ|PROT_WRITE) == 0;
+	if (success)
+		pool.committed += size;
+	pthread_mutex_unlock(&pool.lock);
+	return success;
+}
+
+static Buffer *buffer_anon(size_t size) {
 	Buffer *buf = calloc(1, sizeof(Buffer));
 	if (!buf)
 		return NULL;
-	if (BUFFER_SIZE > size)
-		size = BUFFER_SIZE;
-	if (!(buf->data = malloc(size))) {
+	if (!(buf->data = pool_alloc(&size))) {
 		free(buf);
 		return NULL;
 	}
-	buf->type = MALLOC;
+	buf->type = ANON;
+	buf->fd = -1;
 	buf->size = size;
-	buf->next = txt->buffers;
-	txt->buffers = buf;
+	return buf;
+}
+
+/* allocate a new insertion buffer of at least `size' bytes. successive ones
+ * grow geometrically up to BUFFER_SIZE, such that small texts remain cheap */
+static Buffer *buffer_alloc(Text *txt, size_t size) {
+	Buffer *head = txt->buffers;
+	if (head)
+		size = MAX(size, MIN(2 * head->size, BUFFER_SIZE));
+	Buffer *buf = buffer_anon(size);
+	if (!buf)
+		return NULL;
+	if (!buffer_register(txt, buf)) {
+		buffer_free(buf);
+		return NULL;
+	}
+	txt->history_memory += buf->size;
+	buffer_spill_all(txt);
+	return buf;
+}
+
+/* allocate a buffer for data read by text_load_fd, each one twice as large as
+ * its predecessor. it is kept behind the insertion buffer such that the latter
+ * is still used by buffer_store and the read data remains contiguous */
+static Buffer *buffer_load(Text *txt) {
+	Buffer *prev = txt->load, *head = txt->buffers;
+	Buffer *buf = buffer_anon(prev ? MIN(2 * prev->size, BUFFER_LOAD_MAX) : BUFFER_SIZE);
+	if (!buf)
+		return NULL;
+	if (!buffer_register(txt, buf)) {
+		buffer_free(buf);
+		return NULL;
+	}
+	if (head) {
+		txt->buffers = head;
+		buf->next = head->next;
+		head->next = buf;
+	}
+	txt->load = buf;
+	txt->history_memory += buf->size;
+	buffer_spill_all(txt);
 	return buf;
 }
 
@@ -209,8 +757,6 @@ static Buffer *buffer_read(Text *txt, size_t size, int fd) {
 		char data[4096];
 		ssize_t len = read(fd, data, MIN(sizeof(data), size));
 		if (len == -1) {
-			txt->buffers = buf->next;
-			buffer_free(buf);
 			return NULL;
 		} else if (len == 0) {
 			break;
@@ -234,23 +780,372 @@ static Buffer *buffer_mmap(Text *txt, size_t size, int fd, off_t offset) {
 		}
 	}
 	buf->type = MMAP;
+	/* keep the file open such that its data can be copied by the kernel */
+	buf->fd = dup(fd);
+	/* needed to replace pages of a truncated file, see text_sigbus_recover */
+	pool_zero();
+	buf->offset = offset;
 	buf->size = size;
 	buf->len = size;
+	if (!buffer_register(txt, buf)) {
+		buffer_free(buf);
+		return NULL;
+	}
+	return buf;
+}
+
+/* add the buffer to the list of all buffers and assign it an id */
+static bool buffer_register(Text *txt, Buffer *buf) {
+	if (txt->buffer_count >= UINT32_MAX)
+		return false;
+	size_t count = txt->buffer_count ? txt->buffer_count + 1 : 2;
+	Buffer **table = realloc(txt->buffer_table, count * sizeof *table);
+	if (!table)
+		return false;
+	if (txt->buffer_count == 0)
+		table[txt->buffer_count++] = NULL;
+	buf->id = txt->buffer_count;
+	table[txt->buffer_count++] = buf;
+	txt->buffer_table = table;
 	buf->next = txt->buffers;
 	txt->buffers = buf;
-	return buf;
+	return true;
+}
+
+/* write the buffer content to the history file and map it at the address of
+ * the existing memory, such that pieces and marks referring to it remain valid */
+static bool buffer_spill(Text *txt, Buffer *buf) {
+	if (txt->history_fd == -1) {
+		char name[PATH_MAX];
+		const char *tmp = getenv("TMPDIR");
+		if (!tmp || !*tmp)
+			tmp = "/tmp";
+		if (snprintf(name, sizeof name, "%s/vis-history-XXXXXX", tmp) >= (int)sizeof name)
+			return false;
+		if ((txt->history_fd = mkstemp(name)) == -1)
+			return false;
+		unlink(name);
+	}
+	if (write_all(txt->history_fd, buf->data, buf->size) != (ssize_t)buf->size) {
+		/* drop the partially written data */
+		if (ftruncate(txt->history_fd, txt->history_size) == -1 ||
+		    lseek(txt->history_fd, txt->history_size, SEEK_SET) == -1) {
+			close(txt->history_fd);
+			txt->history_fd = -1;
+			txt->history_size = 0;
+		}
+		return false;
+	}
+	void *data = mmap(buf->data, buf->size, PROT_READ, MAP_PRIVATE|MAP_FIXED,
+	                  txt->history_fd, txt->history_size);
+	if (data == MAP_FAILED)
+		return false;
+	txt->history_size += buf->size;
+	txt->history_memory -= buf->size;
+	buf->type = SPILL;
+	return true;
+}
+
+/* spill the oldest insertion buffers until the history limit is met. the most
+ * recently allocated buffer is kept, since data is still appended to it */
+static void buffer_spill_all(Text *txt) {
+	if (txt->spill_next == 0)
+		txt->spill_next = 1;
+	while (txt->history_limit && txt->history_memory > txt->history_limit &&
+	       txt->spill_next < txt->buffer_count) {
+		Buffer *buf = txt->buffer_table[txt->spill_next];
+		if (buf == txt->buffers || buf == txt->load)
+			return;
+		if (buf->type == PACKED && !buffer_unpack(buf))
+			return;
+		if (buf->type == ANON && !buffer_spill(txt, buf))
+			return;
+		txt->spill_next++;
+	}
 }
 
 static void buffer_free(Buffer *buf) {
 	if (!buf)
 		return;
-	if (buf->type == MALLOC)
-		free(buf->data);
-	else if (buf->type == MMAP && buf->data)
+	if (buf->data && buf->size && (buf->type == MMAP || buf->type == DECODED))
+		munmap(buf->data, buf->size);
+	else if (buf->type == PACKED && pool_commit(buf->data, buf->size))
+		pool_release(buf->data, buf->size);
+	else if (buf->type == PACKED)
 		munmap(buf->data, buf->size);
+	else if (buf->data && buf->size)
+		pool_release(buf->data, buf->size);
+	if (buf->type == PACKED) {
+		pthread_mutex_lock(&pool.lock);
+		pool.compressed -= buf->len;
+		pool.packed -= buf->packed_len;
+		pthread_mutex_unlock(&pool.lock);
+	}
+	if (buf->fd != -1)
+		close(buf->fd);
+	free(buf->packed);
+	free(buf->chunks);
+	free(buf->lines);
+	free(buf->hashes);
+	free(buf->undo_pages);
 	free(buf);
 }
 
+/* returns the buffer data, which is decompressed or decoded if necessary. the
+ * buffer is thereby considered used, which might also happen from other threads. */
+static char *buffer_data(Buffer *buf) {
+	if (__atomic_load_n(&buf->cold, __ATOMIC_RELAXED))
+		__atomic_store_n(&buf->cold, false, __ATOMIC_RELAXED);
+	if (buf->type == PACKED && !buffer_unpack(buf))
+		return NULL;
+	if (buf->type == DECODED)
+		buffer_decode(buf, 0, buf->len);
+	return buf->data;
+}
+
+/* compress the data of an insertion buffer and release its memory. the result
+ * is only kept if it saves at least an eighth. */
+static bool buffer_pack(Buffer *buf) {
+	size_t size = buf->len - buf->len / 8;
+	char *packed = malloc(size);
+	if (!packed)
+		return false;
+	size_t len = lz4_compress(buf->data, buf->len, packed, size);
+	if (!len) {
+		buf->dense = true;
+		goto err;
+	}
+	char *shrunk = realloc(packed, len);
+	if (shrunk)
+		packed = shrunk;
+	if (!pool_decommit(buf->data, buf->size))
+		goto err;
+	buf->packed = packed;
+	buf->packed_len = len;
+	buf->type = PACKED;
+	pthread_mutex_lock(&pool.lock);
+	pool.compressed += buf->len;
+	pool.packed += len;
+	pthread_mutex_unlock(&pool.lock);
+	return true;
+err:
+	free(packed);
+	return false;
+}
+
+/* decompress the data back into the address range of the buffer */
+static bool buffer_unpack(Buffer *buf) {
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (!pool_commit(buf->data, buf->size))
+		return false;
+	if (lz4_decompress(buf->packed, buf->packed_len, buf->data, buf->size) != buf->len) {
+		pool_decommit(buf->data, buf->size);
+		return false;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	uint64_t time = (uint64_t)(end.tv_sec - start.tv_sec) * 1000000000 + end.tv_nsec - start.tv_nsec;
+	pthread_mutex_lock(&pool.lock);
+	pool.compressed -= buf->len;
+	pool.packed -= buf->packed_len;
+	pool.unpacks++;
+	pool.unpack_time += time;
+	pool.unpack_max = MAX(pool.unpack_max, time);
+	pthread_mutex_unlock(&pool.lock);
+	free(buf->packed);
+	buf->packed = NULL;
+	buf->packed_len = 0;
+	buf->type = ANON;
+	return true;
+}
+
+/* store the UTF-8 encoding of code point cp at dest unless it is NULL,
+ * returns its length */
+static size_t utf8_put(char *dest, uint32_t cp) {
+	unsigned char b[4];
+	size_t len;
+	if (cp < 0x80) {
+		b[0] = cp;
+		len = 1;
+	} else if (cp < 0x800) {
+		b[0] = 0xC0 | cp >> 6;
+		b[1] = 0x80 | (cp & 0x3F);
+		len = 2;
+	} else if (cp < 0x10000) {
+		b[0] = 0xE0 | cp >> 12;
+		b[1] = 0x80 | (cp >> 6 & 0x3F);
+		b[2] = 0x80 | (cp & 0x3F);
+		len = 3;
+	} else {
+		b[0] = 0xF0 | cp >> 18;
+		b[1] = 0x80 | (cp >> 12 & 0x3F);
+		b[2] = 0x80 | (cp >> 6 & 0x3F);
+		b[3] = 0x80 | (cp & 0x3F);
+		len = 4;
+	}
+	if (dest)
+		memcpy(dest, b, len);
+	return len;
+}
+
+static uint32_t utf16_unit(enum TextEncoding encoding, const unsigned char *s) {
+	return encoding == TEXT_ENCODING_UTF16LE ? (uint32_t)s[1] << 8 | s[0] : (uint32_t)s[0] << 8 | s[1];
+}
+
+/* transcode len bytes of data to UTF-8, stored at dest unless it is NULL.
+ * returns the length of the result, unpaired surrogates and a trailing odd
+ * byte are replaced by U+FFFD. */
+static size_t decode(enum TextEncoding encoding, const char *data, size_t len, char *dest) {
+	const unsigned char *s = (const unsigned char*)data, *end = s + len;
+	size_t n = 0;
+	if (encoding == TEXT_ENCODING_UTF8) {
+		if (dest)
+			memcpy(dest, data, len);
+		return len;
+	}
+	if (encoding == TEXT_ENCODING_LATIN1) {
+		for (; s < end; s++)
+			n += utf8_put(dest ? dest + n : NULL, *s);
+		return n;
+	}
+	while (s < end) {
+		uint32_t cp = 0xFFFD;
+		if (end - s >= 2) {
+			cp = utf16_unit(encoding, s);
+			s += 2;
+			if (0xD800 <= cp && cp < 0xDC00 && end - s >= 2) {
+				uint32_t lo = utf16_unit(encoding, s);
+				if (0xDC00 <= lo && lo < 0xE000) {
+					cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+					s += 2;
+				}
+			}
+			if (0xD800 <= cp && cp < 0xE000)
+				cp = 0xFFFD;
+		} else {
+			s = end;
+		}
+		n += utf8_put(dest ? dest + n : NULL, cp);
+	}
+	return n;
+}
+
+/* returns the length of data transcoded to UTF-8 as determined by decode */
+static size_t decode_len(enum TextEncoding encoding, const char *data, size_t len) {
+	const unsigned char *s = (const unsigned char*)data, *end = s + len;
+	size_t n = len;
+	if (encoding == TEXT_ENCODING_LATIN1) {
+		for (; s < end; s++)
+			n += *s >> 7;
+		return n;
+	}
+	uint32_t prev = 0;
+	for (n = 0; end - s >= 2; s += 2) {
+		uint32_t u = utf16_unit(encoding, s);
+		uint32_t next = end - s >= 4 ? utf16_unit(encoding, s + 2) : 0;
+		/* the units of a surrogate pair take 2 bytes each, unpaired ones are replaced */
+		bool paired = ((u & 0xFC00) == 0xDC00 && (prev & 0xFC00) == 0xD800) ||
+		              ((u & 0xFC00) == 0xD800 && (next & 0xFC00) == 0xDC00);
+		n += 1 + (u >= 0x80) + (u >= 0x800) - paired;
+		prev = u;
+	}
+	return s < end ? n + 3 : n;
+}
+
+/* returns the length of the next chunk of encoded data, which does not split a surrogate pair */
+static size_t decode_chunk(enum TextEncoding encoding, const char *data, size_t len) {
+	if (len <= DECODE_CHUNK)
+		return len;
+	len = DECODE_CHUNK;
+	if (encoding != TEXT_ENCODING_LATIN1) {
+		uint32_t last = utf16_unit(encoding, (const unsigned char*)data + len - 2);
+		if (0xD800 <= last && last < 0xDC00)
+			len -= 2;
+	}
+	return len;
+}
+
+/* create a buffer for the decoded content of the given chunks, whose offsets
+ * are relative to the first one. its address range is reserved up front, but
+ * memory is only committed once a chunk is decoded. */
+static Buffer *buffer_decoded(Text *txt, enum TextEncoding encoding, DecodeChunk *chunks, size_t count) {
+	Buffer *buf = calloc(1, sizeof(Buffer));
+	if (!buf)
+		return NULL;
+	buf->type = DECODED;
+	buf->fd = -1;
+	buf->encoding = encoding;
+	buf->len = buf->size = chunks[count-1].off + chunks[count-1].len;
+	if (!(buf->chunks = malloc(count * sizeof *chunks)))
+		goto err;
+	memcpy(buf->chunks, chunks, count * sizeof *chunks);
+	buf->chunk_count = count;
+	int zero = pool_zero();
+	if (zero == -1)
+		goto err;
+	buf->data = mmap(NULL, buf->size, PROT_READ|PROT_WRITE, MAP_PRIVATE, zero, 0);
+	if (buf->data == MAP_FAILED) {
+		buf->data = NULL;
+		goto err;
+	}
+	if (!buffer_register(txt, buf))
+		goto err;
+	return buf;
+err:
+	buffer_free(buf);
+	return NULL;
+}
+
+/* decode all chunks overlapping the range [off, off+len) of a DECODED buffer */
+static void buffer_decode(Buffer *buf, size_t off, size_t len) {
+	size_t lo = 0, hi = buf->chunk_count;
+	while (lo + 1 < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (buf->chunks[mid].off <= off)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	for (DecodeChunk *c = buf->chunks + lo; c < buf->chunks + buf->chunk_count; c++) {
+		if (c->off >= off + len && c->off > off)
+			break;
+		if (!c->decoded)
+			decode(buf->encoding, c->src, c->src_len, buf->data + c->off);
+		c->decoded = true;
+	}
+}
+
+/* let the kernel copy len bytes at offset off of the buffer from the underlying
+ * file to fd. returns the number of bytes copied, which might be less if this
+ * is not supported for the given file descriptors. */
+static size_t buffer_copy(Buffer *buf, size_t off, size_t len, int fd) {
+	off_t pos = buf->offset + off;
+	size_t rem = len;
+	if (buf->fd == -1)
+		return 0;
+#ifdef HAVE_COPY_FILE_RANGE
+	while (rem > 0) {
+		ssize_t copied = copy_file_range(buf->fd, &pos, fd, NULL, rem, 0);
+		if (copied == -1 && errno == EINTR)
+			continue;
+		if (copied <= 0)
+			break;
+		rem -= copied;
+	}
+#endif
+#ifdef __linux__
+	while (rem > 0) {
+		ssize_t copied = sendfile(fd, buf->fd, &pos, rem);
+		if (copied == -1 && errno == EINTR)
+			continue;
+		if (copied <= 0)
+			break;
+		rem -= copied;
+	}
+#endif
+	return len - rem;
+}
+
 /* check whether buffer has enough free space to store len bytes */
 static bool buffer_capacity(Buffer *buf, size_t len) {
 	return buf->size - buf->len >= len;
@@ -264,12 +1159,14 @@ static const char *buffer_append(Buffer *buf, const char *data, size_t len) {
 }
 
 /* stores the given data in a buffer, allocates a new one if necessary. returns
- * a pointer to the storage location or NULL if allocation failed. */
-static const char *buffer_store(Text *txt, const char *data, size_t len) {
+ * the buffer to whose end the data was appended or NULL if allocation failed.
+ * buffers restored from the undo file are mapped read only and never reused. */
+static Buffer *buffer_store(Text *txt, const char *data, size_t len) {
 	Buffer *buf = txt->buffers;
-	if ((!buf || !buffer_capacity(buf, len)) && !(buf = buffer_alloc(txt, len)))
+	if ((!buf || buf->type != ANON || !buffer_capacity(buf, len)) && !(buf = buffer_alloc(txt, len)))
 		return NULL;
-	return buffer_append(buf, data, len);
+	buffer_append(buf, data, len);
+	return buf;
 }
 
 /* insert data into buffer at an arbitrary position, this should only be used with
@@ -279,6 +1176,9 @@ static bool buffer_insert(Buffer *buf, size_t pos, const char *data, size_t len)
 		return false;
 	if (buf->len == pos)
 		return buffer_append(buf, data, len);
+	/* checkpoints after the modification point are no longer valid */
+	buf->lines_count = MIN(buf->lines_count, pos / BUFFER_LINES_BLOCK + 1);
+	buf->hashes_count = MIN(buf->hashes_count, pos / BUFFER_LINES_BLOCK + 1);
 	char *insert = buf->data + pos;
 	memmove(insert + len, insert, buf->len - pos);
 	memcpy(insert, data, len);
@@ -295,16 +1195,103 @@ static bool buffer_delete(Buffer *buf, size_t pos, size_t len) {
 		buf->len -= len;
 		return true;
 	}
+	buf->lines_count = MIN(buf->lines_count, pos / BUFFER_LINES_BLOCK + 1);
+	buf->hashes_count = MIN(buf->hashes_count, pos / BUFFER_LINES_BLOCK + 1);
 	char *delete = buf->data + pos;
 	memmove(delete, delete + len, buf->len - pos - len);
 	buf->len -= len;
 	return true;
 }
 
+/* returns the number of new lines in the first off bytes of the buffer.
+ * the count is derived from the closest preceding checkpoint, missing
+ * checkpoints are computed on demand. */
+static size_t buffer_lines(Buffer *buf, size_t off) {
+	size_t block = off / BUFFER_LINES_BLOCK;
+	if (block >= buf->lines_size) {
+		size_t size = MAX(block + 1, 2 * buf->lines_size);
+		size_t *lines = realloc(buf->lines, size * sizeof *lines);
+		if (lines) {
+			buf->lines = lines;
+			buf->lines_size = size;
+		}
+	}
+	if (buf->lines_count == 0 && buf->lines_size > 0)
+		buf->lines[buf->lines_count++] = 0;
+	while (buf->lines_count <= block && buf->lines_count < buf->lines_size) {
+		size_t i = buf->lines_count++;
+		const char *data = buf->data + (i - 1) * BUFFER_LINES_BLOCK;
+		buf->lines[i] = buf->lines[i-1] + lines_count(data, BUFFER_LINES_BLOCK);
+	}
+	if (buf->lines_count == 0)
+		return lines_count(buf->data, off);
+	block = MIN(block, buf->lines_count - 1);
+	size_t start = block * BUFFER_LINES_BLOCK;
+	return buf->lines[block] + lines_count(buf->data + start, off - start);
+}
+
+/* returns the offset following the n-th new line within the buffer range
+ * [off, end) or end if there are fewer. n is decremented by the number of
+ * skipped lines. */
+static size_t buffer_lines_skip(Buffer *buf, size_t off, size_t end, size_t *lines) {
+	size_t count = buffer_lines(buf, off);
+	size_t target = count + *lines;
+	size_t block = off / BUFFER_LINES_BLOCK, last = end / BUFFER_LINES_BLOCK;
+	if (block < buf->lines_count) {
+		/* binary search the last known checkpoint preceding the target */
+		size_t lo = block, hi = MIN(last, buf->lines_count - 1);
+		while (lo < hi) {
+			size_t mid = lo + (hi - lo + 1) / 2;
+			if (buf->lines[mid] < target)
+				lo = mid;
+			else
+				hi = mid - 1;
+		}
+		/* extend the checkpoints until the target is reached */
+		for (block = lo; block < last && block + 1 >= buf->lines_count; block++) {
+			if (buffer_lines(buf, (block + 1) * BUFFER_LINES_BLOCK) >= target ||
+			    block + 1 >= buf->lines_count)
+				break;
+		}
+		if (block * BUFFER_LINES_BLOCK > off) {
+			off = block * BUFFER_LINES_BLOCK;
+			count = buf->lines[block];
+		}
+	}
+	*lines = target - count;
+	return off + lines_skip(buf->data + off, end - off, lines);
+}
+
+/* returns the content hash of the first off bytes of the buffer. it is
+ * derived from the closest preceding checkpoint, like the new line count. */
+static uint64_t buffer_hash(Buffer *buf, size_t off) {
+	size_t block = off / BUFFER_LINES_BLOCK;
+	if (block >= buf->hashes_size) {
+		size_t size = MAX(block + 1, 2 * buf->hashes_size);
+		uint64_t *hashes = realloc(buf->hashes, size * sizeof *hashes);
+		if (hashes) {
+			buf->hashes = hashes;
+			buf->hashes_size = size;
+		}
+	}
+	if (buf->hashes_count == 0 && buf->hashes_size > 0)
+		buf->hashes[buf->hashes_count++] = 0;
+	while (buf->hashes_count <= block && buf->hashes_count < buf->hashes_size) {
+		size_t i = buf->hashes_count++;
+		const char *data = buf->data + (i - 1) * BUFFER_LINES_BLOCK;
+		buf->hashes[i] = hash_bytes(buf->hashes[i-1], data, BUFFER_LINES_BLOCK);
+	}
+	if (buf->hashes_count == 0)
+		return hash_bytes(0, buf->data, off);
+	block = MIN(block, buf->hashes_count - 1);
+	size_t start = block * BUFFER_LINES_BLOCK;
+	return hash_bytes(buf->hashes[block], buf->data + start, off - start);
+}
+
 /* cache the given piece if it is the most recently changed one */
 static void cache_piece(Text *txt, Piece *p) {
 	Buffer *buf = txt->buffers;
-	if (!buf || p->data < buf->data || p->data + p->len != buf->data + buf->len)
+	if (!buf || p->buf != buf->id || p->off + p->len != buf->len)
 		return;
 	txt->cache = p;
 }
@@ -326,7 +1313,7 @@ static bool cache_contains(Text *txt, Piece *p) {
 			break;
 	}
 
-	return found && p->data + p->len == buf->data + buf->len;
+	return found && p->buf == buf->id && p->off + p->len == buf->len;
 }
 
 /* try to insert a junk of data at a given piece offset. the insertion is only
@@ -336,10 +1323,23 @@ static bool cache_insert(Text *txt, Piece *p, size_t off, const char *data, size
 	if (!cache_contains(txt, p))
 		return false;
 	Buffer *buf = txt->buffers;
-	size_t bufpos = p->data + off - buf->data;
+	size_t bufpos = p->off + off;
 	if (!buffer_insert(buf, bufpos, data, len))
 		return false;
+	snapshot_piece_modify(txt, p, off, 0, len);
+	size_t lines = p->lines != LINES_UNKNOWN ? lines_count(data, len) : 0;
 	p->len += len;
+	if (p->lines != LINES_UNKNOWN)
+		p->lines += lines;
+	p->hash = HASH_UNKNOWN;
+	for (Node *cur = p->node; cur; cur = cur->parent) {
+		cur->subtree_len += len;
+		if (cur->subtree_lines != EPOS)
+			cur->subtree_lines += lines;
+		cur->subtree_hash = HASH_UNKNOWN;
+	}
+	if (!addr_contains(txt, p->node))
+		addr_insert(txt, p->node);
 	txt->current_action->change->new.len += len;
 	txt->size += len;
 	return true;
@@ -353,10 +1353,25 @@ static bool cache_delete(Text *txt, Piece *p, size_t off, size_t len) {
 	if (!cache_contains(txt, p))
 		return false;
 	Buffer *buf = txt->buffers;
-	size_t bufpos = p->data + off - buf->data;
-	if (off + len > p->len || !buffer_delete(buf, bufpos, len))
+	size_t bufpos = p->off + off;
+	if (off + len > p->len)
+		return false;
+	size_t lines = p->lines != LINES_UNKNOWN ? lines_count(buf->data + bufpos, len) : 0;
+	if (!buffer_delete(buf, bufpos, len))
 		return false;
+	snapshot_piece_modify(txt, p, off, len, 0);
 	p->len -= len;
+	if (p->lines != LINES_UNKNOWN)
+		p->lines -= lines;
+	p->hash = HASH_UNKNOWN;
+	for (Node *cur = p->node; cur; cur = cur->parent) {
+		cur->subtree_len -= len;
+		if (cur->subtree_lines != EPOS)
+			cur->subtree_lines -= lines;
+		cur->subtree_hash = HASH_UNKNOWN;
+	}
+	if (p->len == 0)
+		addr_remove(txt, p->node);
 	txt->current_action->change->new.len -= len;
 	txt->size -= len;
 	return true;
@@ -383,9 +1398,20 @@ static void span_init(Span *span, Piece *start, Piece *end) {
  * adjusts the document size accordingly.
  */
 static void span_swap(Text *txt, Span *old, Span *new) {
-	if (old->len == 0 && new->len == 0) {
+	if (txt->journal && (old->len || new->len))
+		journal_swap(txt, old, new);
+	if (old->len == 0 && new->len == 0)
 		return;
-	} else if (old->len == 0) {
+	if (txt->snapshot) {
+		Piece *prev = old->len ? old->start->prev : new->start->prev;
+		if (prev == &txt->begin)
+			snapshot_modify(txt, 0, old->len, new->len);
+		else if (prev->node)
+			snapshot_modify(txt, tree_pos(prev->node) + prev->len, old->len, new->len);
+		else
+			snapshot_invalidate(txt);
+	}
+	if (old->len == 0) {
 		/* insert new span */
 		new->start->prev->next = new->start;
 		new->end->next->prev = new->end;
@@ -398,15 +1424,55 @@ static void span_swap(Text *txt, Span *old, Span *new) {
 		old->start->prev->next = new->start;
 		old->end->next->prev = new->end;
 	}
+	/* keep the position index in sync with the piece chain */
+	if (old->len != 0) {
+		for (Piece *p = old->start; p; p = p->next) {
+			tree_remove(txt, p);
+			if (p == old->end)
+				break;
+		}
+	}
+	if (new->len != 0) {
+		Piece *prev = new->start->prev;
+		for (Piece *p = new->start; p; p = p->next) {
+			tree_insert(txt, prev, p);
+			prev = p;
+			if (p == new->end)
+				break;
+		}
+	}
 	txt->size -= old->len;
 	txt->size += new->len;
 }
 
+/* append a piece referring to `len' bytes at offset `off' of the given buffer
+ * to a span under construction. data adjacent to the one of the last piece
+ * is merged into it. */
+static bool span_append(Text *txt, Span *span, uint32_t buf, size_t off, size_t len) {
+	if (len == 0)
+		return true;
+	Piece *p = span->end;
+	span->len += len;
+	if (p && p->buf == buf && p->off + p->len == off) {
+		p->len += len;
+		return true;
+	}
+	if (!(p = piece_alloc(txt)))
+		return false;
+	piece_init(p, span->end, NULL, buf, off, len);
+	if (span->end)
+		span->end->next = p;
+	else
+		span->start = p;
+	span->end = p;
+	return true;
+}
+
 /* allocate a new action, set its pointers to the other actions in the history,
  * and set it as txt->history. All further changes will be associated with this action. */
 static Action *action_alloc(Text *txt) {
-	Action *new = calloc(1, sizeof(Action));
-	if (!new)
+	Action *new;
+	if (!action_reserve(txt) || !(new = slab_alloc(&txt->actions)))
 		return NULL;
 	new->time = time(NULL);
 	txt->current_action = new;
@@ -416,11 +1482,7 @@ static Action *action_alloc(Text *txt) {
 		new->seq = 0;
 	else
 		new->seq = txt->last_action->seq + 1;
-
-	/* set earlier, later pointers */
-	if (txt->last_action)
-		txt->last_action->later = new;
-	new->earlier = txt->last_action;
+	txt->action_table[new->seq] = new;
 
 	if (!txt->history) {
 		txt->history = new;
@@ -434,120 +1496,390 @@ static Action *action_alloc(Text *txt) {
 	return new;
 }
 
-static void action_free(Action *a) {
-	if (!a)
-		return;
-	for (Change *next, *c = a->change; c; c = next) {
-		next = c->next;
-		change_free(c);
-	}
-	free(a);
+/* make room for another entry in the action table */
+static bool action_reserve(Text *txt) {
+	if (txt->actions.count < txt->action_table_size)
+		return true;
+	size_t size = txt->action_table_size ? 2 * txt->action_table_size : 64;
+	Action **table = realloc(txt->action_table, size * sizeof *table);
+	if (!table)
+		return false;
+	txt->action_table = table;
+	txt->action_table_size = size;
+	return true;
 }
 
 static Piece *piece_alloc(Text *txt) {
-	Piece *p = calloc(1, sizeof(Piece));
-	if (!p)
-		return NULL;
-	p->text = txt;
-	p->global_next = txt->pieces;
-	if (txt->pieces)
-		txt->pieces->global_prev = p;
-	txt->pieces = p;
-	return p;
+	return slab_alloc(&txt->pieces);
 }
 
-static void piece_free(Piece *p) {
-	if (!p)
-		return;
-	if (p->global_prev)
-		p->global_prev->global_next = p->global_next;
-	if (p->global_next)
-		p->global_next->global_prev = p->global_prev;
-	if (p->text->pieces == p)
-		p->text->pieces = p->global_next;
-	if (p->text->cache == p)
-		p->text->cache = NULL;
-	free(p);
-}
-
-static void piece_init(Piece *p, Piece *prev, Piece *next, const char *data, size_t len) {
+static void piece_init(Piece *p, Piece *prev, Piece *next, uint32_t buf, size_t off, size_t len) {
 	p->prev = prev;
 	p->next = next;
-	p->data = data;
+	p->buf = buf;
+	p->off = off;
 	p->len = len;
+	p->lines = LINES_UNKNOWN;
+	p->hash = HASH_UNKNOWN;
 }
 
-/* returns the piece holding the text at byte offset pos. if pos happens to
- * be at a piece boundry i.e. the first byte of a piece then the previous piece
- * to the left is returned with an offset of piece->len. this is convenient for
- * modifications to the piece chain where both pieces (the returned one and the
- * one following it) are needed, but unsuitable as a public interface.
- *
- * in particular if pos is zero, the begin sentinel piece is returned.
- */
-static Location piece_get_intern(Text *txt, size_t pos) {
-	size_t cur = 0;
-	for (Piece *p = &txt->begin; p->next; p = p->next) {
-		if (cur <= pos && pos <= cur + p->len)
-			return (Location){ .piece = p, .off = pos - cur };
-		cur += p->len;
+/* returns a pointer to the data of the piece, NULL for sentinels. transcoded
+ * content is only decoded for the chunk holding the piece. */
+static const char *piece_data(const Text *txt, const Piece *p) {
+	Buffer *buf = txt->buffer_table ? txt->buffer_table[p->buf] : NULL;
+	if (buf && buf->type == DECODED) {
+		buffer_decode(buf, p->off, p->len);
+		return buf->data + p->off;
 	}
+	const char *data = buf ? buffer_data(buf) : NULL;
+	return data ? data + p->off : NULL;
+}
 
-	return (Location){ 0 };
+/* returns the address of the piece data without accessing it, as used by the
+ * address index and marks. it is valid even while the data is compressed. */
+static const char *piece_addr(const Text *txt, const Piece *p) {
+	Buffer *buf = txt->buffer_table ? txt->buffer_table[p->buf] : NULL;
+	return buf ? buf->data + p->off : NULL;
 }
 
-/* similiar to piece_get_intern but usable as a public API. returns the piece
- * holding the text at byte offset pos. never returns a sentinel piece.
- * it pos is the end of file (== text_size()) and the file is not empty then
- * the last piece holding data is returned.
+/* Index nodes are never returned to the allocator, instead unused ones are
+ * kept for reuse. Since every state reached by undo/redo existed before,
+ * swapping spans in/out thus never requires new nodes. New modifications
+ * reserve the needed nodes upfront such that they can fail gracefully.
  */
-static Location piece_get_extern(Text *txt, size_t pos) {
-	size_t cur = 0;
 
-	if (pos > 0 && pos == txt->size) {
-		Piece *p = txt->begin.next;
-		while (p->next->next)
-			p = p->next;
-		return (Location){ .piece = p, .off = p->len };
+static bool node_reserve(Text *txt, size_t count) {
+	while (txt->nodes_free_count < count) {
+		Node *node = slab_alloc(&txt->nodes);
+		if (!node)
+			return false;
+		node_free(txt, node);
 	}
+	return true;
+}
 
-	for (Piece *p = txt->begin.next; p->next; p = p->next) {
-		if (cur <= pos && pos < cur + p->len)
-			return (Location){ .piece = p, .off = pos - cur };
-		cur += p->len;
+static Node *node_alloc(Text *txt) {
+	Node *node = txt->nodes_free;
+	if (node) {
+		txt->nodes_free = (Node*)node->piece;
+		txt->nodes_free_count--;
+		*node = (Node){ 0 };
+	} else if (!(node = slab_alloc(&txt->nodes))) {
+		return NULL;
 	}
+	/* xorshift pseudo random number generator */
+	txt->seed ^= txt->seed << 13;
+	txt->seed ^= txt->seed >> 17;
+	txt->seed ^= txt->seed << 5;
+	node->priority = txt->seed;
+	return node;
+}
 
+static void node_free(Text *txt, Node *node) {
+	node->piece = (Piece*)txt->nodes_free;
+	txt->nodes_free = node;
+	txt->nodes_free_count++;
+}
+
+/* The active pieces are additionally stored in a balanced binary search tree
+ * (a treap) ordered by their position within the text. Each node is augmented
+ * with the total length of its subtree, hence the piece holding a given byte
+ * offset can be located in O(log n) where n is the number of active pieces.
+ * The tree mirrors the piece chain, it is updated whenever spans are swapped
+ * in/out. Nodes are ordered by position and form a max-heap with respect to
+ * their randomly assigned priorities.
+ */
+
+static size_t tree_len(Node *node) {
+	return node ? node->subtree_len : 0;
+}
+
+static size_t tree_lines(Node *node) {
+	return node ? node->subtree_lines : 0;
+}
+
+static void tree_update(Node *node) {
+	Piece *p = node->piece;
+	node->subtree_len = tree_len(node->left) + p->len + tree_len(node->right);
+	size_t left = tree_lines(node->left), right = tree_lines(node->right);
+	if (left == EPOS || p->lines == LINES_UNKNOWN || right == EPOS)
+		node->subtree_lines = EPOS;
+	else
+		node->subtree_lines = left + p->lines + right;
+	node->subtree_hash = HASH_UNKNOWN;
+}
+
+/* replace the link from the parent of `old' (or the root) with `new' */
+static void tree_replace(Text *txt, Node *old, Node *new) {
+	Node *parent = old->parent;
+	if (!parent)
+		txt->tree = new;
+	else if (parent->left == old)
+		parent->left = new;
+	else
+		parent->right = new;
+	if (new)
+		new->parent = parent;
+}
+
+/* rotate `node' up, such that it takes the place of its parent */
+static void tree_rotate(Text *txt, Node *node) {
+	Node *parent = node->parent;
+	tree_replace(txt, parent, node);
+	if (parent->left == node) {
+		parent->left = node->right;
+		if (node->right)
+			node->right->parent = parent;
+		node->right = parent;
+	} else {
+		parent->right = node->left;
+		if (node->left)
+			node->left->parent = parent;
+		node->left = parent;
+	}
+	parent->parent = node;
+	tree_update(parent);
+	tree_update(node);
+}
+
+/* insert piece `p' into the tree, directly following `prev' which is
+ * either an already indexed piece or the begin sentinel */
+static void tree_insert(Text *txt, Piece *prev, Piece *p) {
+	Node *node = node_alloc(txt);
+	if (!node)
+		return;
+	node->piece = p;
+	node->subtree_len = p->len;
+	node->subtree_lines = p->lines == LINES_UNKNOWN ? EPOS : p->lines;
+	node->subtree_hash = HASH_UNKNOWN;
+	p->node = node;
+	Node *parent = NULL, **link = &txt->tree;
+	if (prev != &txt->begin && prev->node->right) {
+		parent = prev->node->right;
+		link = &parent->left;
+	} else if (prev != &txt->begin) {
+		parent = prev->node;
+		link = &parent->right;
+	} else if (txt->tree) {
+		parent = txt->tree;
+		link = &parent->left;
+	}
+	/* descend to the leftmost node of the chosen subtree */
+	while (*link) {
+		parent = *link;
+		link = &parent->left;
+	}
+	*link = node;
+	node->parent = parent;
+	for (Node *cur = parent; cur; cur = cur->parent) {
+		cur->subtree_len += p->len;
+		if (p->lines == LINES_UNKNOWN)
+			cur->subtree_lines = EPOS;
+		else if (cur->subtree_lines != EPOS)
+			cur->subtree_lines += p->lines;
+		cur->subtree_hash = HASH_UNKNOWN;
+	}
+	while (node->parent && node->parent->priority < node->priority)
+		tree_rotate(txt, node);
+	if (p->len)
+		addr_insert(txt, node);
+}
+
+static void tree_remove(Text *txt, Piece *p) {
+	Node *node = p->node;
+	if (!node)
+		return;
+	/* rotate the node down until it has at most one child */
+	while (node->left && node->right) {
+		if (node->left->priority > node->right->priority)
+			tree_rotate(txt, node->left);
+		else
+			tree_rotate(txt, node->right);
+	}
+	Node *child = node->left ? node->left : node->right;
+	tree_replace(txt, node, child);
+	for (Node *cur = node->parent; cur; cur = cur->parent) {
+		cur->subtree_len -= p->len;
+		if (cur->subtree_lines != EPOS)
+			cur->subtree_lines -= p->lines;
+		cur->subtree_hash = HASH_UNKNOWN;
+	}
+	if (addr_contains(txt, node))
+		addr_remove(txt, node);
+	p->node = NULL;
+	node_free(txt, node);
+}
+
+/* returns the piece holding the byte at offset pos, pos has to be in the
+ * interval [0, text_size(txt)) */
+static Location tree_lookup(Text *txt, size_t pos) {
+	size_t cur = 0;
+	for (Node *node = txt->tree; node; ) {
+		size_t left = tree_len(node->left);
+		if (pos < cur + left) {
+			node = node->left;
+		} else if (pos < cur + left + node->piece->len) {
+			return (Location){ .piece = node->piece, .off = pos - cur - left };
+		} else {
+			cur += left + node->piece->len;
+			node = node->right;
+		}
+	}
 	return (Location){ 0 };
 }
 
+/* returns the absolute position of the first byte of an indexed piece */
+static size_t tree_pos(Node *node) {
+	size_t pos = tree_len(node->left);
+	for (; node->parent; node = node->parent) {
+		if (node->parent->right == node)
+			pos += tree_len(node->parent->left) + node->parent->piece->len;
+	}
+	return pos;
+}
+
+/* Marks are addresses pointing into the data of a piece. To resolve them
+ * the non-empty active pieces are additionally indexed by the address of
+ * their data. Their data ranges never overlap, hence the piece containing
+ * a mark can be found in O(log n), its position is then determined by
+ * walking up the position index. The address index is a treap using the
+ * same priorities as the position index.
+ */
+
+static bool addr_contains(Text *txt, Node *node) {
+	return node->addr_parent || txt->addr_tree == node;
+}
+
+static void addr_replace(Text *txt, Node *old, Node *new) {
+	Node *parent = old->addr_parent;
+	if (!parent)
+		txt->addr_tree = new;
+	else if (parent->addr_left == old)
+		parent->addr_left = new;
+	else
+		parent->addr_right = new;
+	if (new)
+		new->addr_parent = parent;
+}
+
+static void addr_rotate(Text *txt, Node *node) {
+	Node *parent = node->addr_parent;
+	addr_replace(txt, parent, node);
+	if (parent->addr_left == node) {
+		parent->addr_left = node->addr_right;
+		if (node->addr_right)
+			node->addr_right->addr_parent = parent;
+		node->addr_right = parent;
+	} else {
+		parent->addr_right = node->addr_left;
+		if (node->addr_left)
+			node->addr_left->addr_parent = parent;
+		node->addr_left = parent;
+	}
+	parent->addr_parent = node;
+}
+
+static void addr_insert(Text *txt, Node *node) {
+	const char *data = piece_addr(txt, node->piece);
+	Node *parent = NULL, **link = &txt->addr_tree;
+	while (*link) {
+		parent = *link;
+		link = data < piece_addr(txt, parent->piece) ? &parent->addr_left : &parent->addr_right;
+	}
+	*link = node;
+	node->addr_parent = parent;
+	node->addr_left = node->addr_right = NULL;
+	while (node->addr_parent && node->addr_parent->priority < node->priority)
+		addr_rotate(txt, node);
+}
+
+static void addr_remove(Text *txt, Node *node) {
+	while (node->addr_left && node->addr_right) {
+		if (node->addr_left->priority > node->addr_right->priority)
+			addr_rotate(txt, node->addr_left);
+		else
+			addr_rotate(txt, node->addr_right);
+	}
+	addr_replace(txt, node, node->addr_left ? node->addr_left : node->addr_right);
+	node->addr_left = node->addr_right = node->addr_parent = NULL;
+}
+
+/* returns the active piece whose data contains the given address */
+static Piece *addr_lookup(Text *txt, const char *addr) {
+	for (Node *node = txt->addr_tree; node; ) {
+		const char *data = piece_addr(txt, node->piece);
+		if (addr < data)
+			node = node->addr_left;
+		else if (addr >= data + node->piece->len)
+			node = node->addr_right;
+		else
+			return node->piece;
+	}
+	return NULL;
+}
+
+/* returns the piece holding the text at byte offset pos. if pos happens to
+ * be at a piece boundry i.e. the first byte of a piece then the previous piece
+ * to the left is returned with an offset of piece->len. this is convenient for
+ * modifications to the piece chain where both pieces (the returned one and the
+ * one following it) are needed, but unsuitable as a public interface.
+ *
+ * in particular if pos is zero, the begin sentinel piece is returned.
+ */
+static Location piece_get_intern(Text *txt, size_t pos) {
+	if (pos == 0)
+		return (Location){ .piece = &txt->begin, .off = 0 };
+	if (pos > txt->size)
+		return (Location){ 0 };
+	Location loc = tree_lookup(txt, pos - 1);
+	loc.off++;
+	return loc;
+}
+
+/* similiar to piece_get_intern but usable as a public API. returns the piece
+ * holding the text at byte offset pos. never returns a sentinel piece.
+ * it pos is the end of file (== text_size()) and the file is not empty then
+ * the last piece holding data is returned.
+ */
+static Location piece_get_extern(Text *txt, size_t pos) {
+	if (pos > 0 && pos == txt->size) {
+		Piece *p = txt->end.prev;
+		return (Location){ .piece = p, .off = p->len };
+	}
+	if (pos >= txt->size)
+		return (Location){ 0 };
+	return tree_lookup(txt, pos);
+}
+
 /* allocate a new change, associate it with current action or a newly
  * allocated one if none exists. */
 static Change *change_alloc(Text *txt, size_t pos) {
 	Action *a = txt->current_action;
 	if (!a) {
+		saved_hash_capture(txt);
 		a = action_alloc(txt);
 		if (!a)
 			return NULL;
 	}
-	Change *c = calloc(1, sizeof(Change));
+	Change *c = slab_alloc(&txt->changes);
 	if (!c)
 		return NULL;
 	c->pos = pos;
 	c->next = a->change;
-	if (a->change)
-		a->change->prev = c;
 	a->change = c;
 	return c;
 }
 
-static void change_free(Change *c) {
-	if (!c)
-		return;
-	/* only free the new part of the span, the old one is still in use */
-	piece_free(c->new.start);
-	if (c->new.start != c->new.end)
-		piece_free(c->new.end);
-	free(c);
+/* reverse a list of changes, returns its new head */
+static Change *change_reverse(Change *c) {
+	Change *prev = NULL;
+	while (c) {
+		Change *next = c->next;
+		c->next = prev;
+		prev = c;
+		c = next;
+	}
+	return prev;
 }
 
 /* When inserting new data there are 2 cases to consider.
@@ -582,23 +1914,34 @@ bool text_insert(Text *txt, size_t pos, const char *data, size_t len) {
 		return true;
 	if (pos > txt->size)
 		return false;
-	if (pos < txt->lines.pos)
-		lineno_cache_invalidate(&txt->lines);
+	if (len > BUFFER_MAX) {
+		/* pieces can not hold more than BUFFER_MAX bytes */
+		return text_insert(txt, pos, data, BUFFER_MAX) &&
+		       text_insert(txt, pos + BUFFER_MAX, data + BUFFER_MAX, len - BUFFER_MAX);
+	}
 
 	Location loc = piece_get_intern(txt, pos);
 	Piece *p = loc.piece;
 	if (!p)
 		return false;
 	size_t off = loc.off;
-	if (cache_insert(txt, p, off, data, len))
+	if (cache_insert(txt, p, off, data, len)) {
+		if (txt->journal)
+			journal_append(txt->journal, pos, data, len);
 		return true;
+	}
+
+	if (!node_reserve(txt, 3))
+		return false;
 
 	Change *c = change_alloc(txt, pos);
 	if (!c)
 		return false;
 
-	if (!(data = buffer_store(txt, data, len)))
+	Buffer *buf = buffer_store(txt, data, len);
+	if (!buf)
 		return false;
+	size_t bufpos = buf->len - len;
 
 	Piece *new = NULL;
 
@@ -607,7 +1950,7 @@ bool text_insert(Text *txt, size_t pos, const char *data, size_t len) {
 		 * remove, just add a new piece holding the extra text */
 		if (!(new = piece_alloc(txt)))
 			return false;
-		piece_init(new, p, p->next, data, len);
+		piece_init(new, p, p->next, buf->id, bufpos, len);
 		span_init(&c->new, new, new);
 		span_init(&c->old, NULL, NULL);
 	} else {
@@ -621,9 +1964,9 @@ bool text_insert(Text *txt, size_t pos, const char *data, size_t len) {
 		Piece *after = piece_alloc(txt);
 		if (!before || !new || !after)
 			return false;
-		piece_init(before, p->prev, new, p->data, off);
-		piece_init(new, before, after, data, len);
-		piece_init(after, new, p->next, p->data + off, p->len - off);
+		piece_init(before, p->prev, new, p->buf, p->off, off);
+		piece_init(new, before, after, buf->id, bufpos, len);
+		piece_init(after, new, p->next, p->buf, p->off + off, p->len - off);
 
 		span_init(&c->new, before, after);
 		span_init(&c->old, p, p);
@@ -674,15 +2017,16 @@ static size_t action_undo(Text *txt, Action *a) {
 
 static size_t action_redo(Text *txt, Action *a) {
 	size_t pos = EPOS;
-	Change *c = a->change;
-	while (c->next)
-		c = c->next;
-	for ( ; c; c = c->prev) {
+	/* changes are kept most recent first, temporarily reverse them
+	 * to reapply them in their original order */
+	Change *first = change_reverse(a->change);
+	for (Change *c = first; c; c = c->next) {
 		span_swap(txt, &c->old, &c->new);
 		pos = c->pos;
 		if (c->new.len > c->old.len)
 			pos += c->new.len - c->old.len;
 	}
+	a->change = change_reverse(first);
 	return pos;
 }
 
@@ -693,9 +2037,9 @@ size_t text_undo(Text *txt) {
 	Action *a = txt->history->prev;
 	if (!a)
 		return pos;
+	saved_hash_capture(txt);
 	pos = action_undo(txt, txt->history);
 	txt->history = a;
-	lineno_cache_invalidate(&txt->lines);
 	return pos;
 }
 
@@ -706,77 +2050,80 @@ size_t text_redo(Text *txt) {
 	Action *a = txt->history->next;
 	if (!a)
 		return pos;
+	saved_hash_capture(txt);
 	pos = action_redo(txt, a);
 	txt->history = a;
-	lineno_cache_invalidate(&txt->lines);
 	return pos;
 }
 
-static bool history_change_branch(Action *a) {
-	bool changed = false;
-	while (a->prev) {
-		if (a->prev->next != a) {
-			a->prev->next = a;
-			changed = true;
-		}
-		a = a->prev;
-	}
-	return changed;
-}
-
+/* move to the state of action `a' taking the shortest path through the undo
+ * tree: undo up to the lowest common ancestor of the current action and `a',
+ * then redo down to `a'. returns the position of the last change. */
 static size_t history_traverse_to(Text *txt, Action *a) {
 	size_t pos = EPOS;
-	if (!a)
+	if (!a || a == txt->history)
 		return pos;
-	bool changed = history_change_branch(a);
-	if (!changed) {
-		if (a->seq == txt->history->seq) {
-			return txt->lines.pos;
-		} else if (a->seq > txt->history->seq) {
-			while (txt->history != a)
-				pos = text_redo(txt);
-			return pos;
-		} else if (a->seq < txt->history->seq) {
-			while (txt->history != a)
-				pos = text_undo(txt);
-			return pos;
+	/* taking a snapshot makes sure that txt->current_action is reset */
+	text_snapshot(txt);
+	saved_hash_capture(txt);
+	/* parents are always older than their children, hence advancing whichever
+	 * action is more recent leads to the common ancestor. while doing so the
+	 * branch leading to `a' is selected for the subsequent redo operations. */
+	Action *ancestor = txt->history;
+	for (Action *cur = a; ancestor != cur; ) {
+		if (ancestor->seq > cur->seq) {
+			ancestor = ancestor->prev;
+		} else {
+			cur->prev->next = cur;
+			cur = cur->prev;
 		}
-	} else {
-		while (txt->history->prev && txt->history->prev->next == txt->history)
-			text_undo(txt);
-		pos = text_undo(txt);
-		while (txt->history != a)
-			pos = text_redo(txt);
-		return pos;
+	}
+	while (txt->history != ancestor) {
+		pos = action_undo(txt, txt->history);
+		txt->history = txt->history->prev;
+	}
+	while (txt->history != a) {
+		txt->history = txt->history->next;
+		pos = action_redo(txt, txt->history);
 	}
 	return pos;
 }
 
 size_t text_earlier(Text *txt, int count) {
 	Action *a = txt->history;
-	while (count-- > 0 && a->earlier)
-		a = a->earlier;
+	if (count > 0)
+		a = txt->action_table[(size_t)count < a->seq ? a->seq - count : 0];
 	return history_traverse_to(txt, a);
 }
 
 size_t text_later(Text *txt, int count) {
 	Action *a = txt->history;
-	while (count-- > 0 && a->later)
-		a = a->later;
+	size_t last = txt->actions.count - 1;
+	if (count > 0)
+		a = txt->action_table[(size_t)count < last - a->seq ? a->seq + count : last];
 	return history_traverse_to(txt, a);
 }
 
+/* actions are created in chronological order, hence (unless the clock was
+ * adjusted) the one closest to the given time is found by binary search */
 size_t text_restore(Text *txt, time_t time) {
-	Action *a = txt->history;
-	while (time < a->time && a->earlier)
-		a = a->earlier;
-	while (time > a->time && a->later)
-		a = a->later;
-	time_t diff = labs(a->time - time);
-	if (a->earlier && a->earlier != txt->history && labs(a->earlier->time - time) < diff)
-		a = a->earlier;
-	if (a->later && a->later != txt->history && labs(a->later->time - time) < diff)
-		a = a->later;
+	Action **table = txt->action_table;
+	size_t lo = 0, hi = txt->actions.count;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (table[mid]->time <= time)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	/* table[lo-1] is the last action created before or at time, table[lo] the first one after it */
+	Action *a;
+	if (lo == 0)
+		a = table[0];
+	else if (lo == txt->actions.count || time - table[lo-1]->time <= table[lo]->time - time)
+		a = table[lo-1];
+	else
+		a = table[lo];
 	return history_traverse_to(txt, a);
 }
 
@@ -826,31 +2173,45 @@ static bool preserve_selinux_context(int src, int dest) {
  *   - POSXI ACL can not be preserved (if enabled)
  *   - SELinux security context can not be preserved (if enabled)
  */
-static bool text_save_atomic_range(Text *txt, Filerange *range, const char *filename) {
-	struct stat meta = { 0 }, oldmeta = { 0 };
+static bool save_atomic(Iterator it, size_t size, const char *filename, struct stat *info, size_t *progress) {
+	char *tmpname;
+	int fd = save_atomic_open(filename, &tmpname);
+	if (fd == -1)
+		return false;
+	ssize_t written = iterator_save_guarded(it, size, fd, progress);
+	if (written == -1 || (size_t)written != size) {
+		int saved_errno = written == -1 ? errno : EIO;
+		close(fd);
+		unlink(tmpname);
+		free(tmpname);
+		errno = saved_errno;
+		return false;
+	}
+	return save_atomic_commit(fd, tmpname, filename, info);
+}
+
+/* create `filename~` with the ownership, permissions, ACL and security context
+ * of the existing file. this is where an atomic save fails if it is not
+ * possible at all, see above */
+static int save_atomic_open(const char *filename, char **tmpname) {
+	struct stat oldmeta = { 0 };
 	int fd = -1, oldfd = -1, saved_errno;
-	char *tmpname = NULL;
-	size_t size = text_range_size(range);
 	size_t namelen = strlen(filename) + 1 /* ~ */ + 1 /* \0 */;
 
+	*tmpname = NULL;
 	if ((oldfd = open(filename, O_RDONLY)) == -1 && errno != ENOENT)
 		goto err;
 	if (oldfd != -1 && lstat(filename, &oldmeta) == -1)
 		goto err;
-	if (oldfd != -1) {
-		if (S_ISLNK(oldmeta.st_mode)) /* symbolic link */
-			goto err;
-		if (oldmeta.st_nlink > 1) /* hard link */
-			goto err;
+	if (oldfd != -1 && (S_ISLNK(oldmeta.st_mode) /* symbolic link */ || oldmeta.st_nlink > 1 /* hard link */)) {
+		errno = ENOTSUP;
+		goto err;
 	}
-	if (!(tmpname = calloc(1, namelen)))
+	if (!(*tmpname = calloc(1, namelen)))
 		goto err;
-	snprintf(tmpname, namelen, "%s~", filename);
+	snprintf(*tmpname, namelen, "%s~", filename);
 
-	/* O_RDWR is needed because otherwise we can't map with MAP_SHARED */
-	if ((fd = open(tmpname, O_CREAT|O_RDWR|O_TRUNC, oldfd == -1 ? S_IRUSR|S_IWUSR : oldmeta.st_mode)) == -1)
-		goto err;
-	if (ftruncate(fd, size) == -1)
+	if ((fd = open(*tmpname, O_CREAT|O_WRONLY|O_TRUNC, oldfd == -1 ? S_IRUSR|S_IWUSR : oldmeta.st_mode)) == -1)
 		goto err;
 	if (oldfd != -1) {
 		if (!preserve_acl(oldfd, fd) || !preserve_selinux_context(oldfd, fd))
@@ -862,35 +2223,27 @@ static bool text_save_atomic_range(Text *txt, Filerange *range, const char *file
 		 * the group permissions to the same as for others */
 		if (oldmeta.st_gid != getgid() && fchown(fd, (uid_t)-1, oldmeta.st_gid) == -1)
 			goto err;
+		close(oldfd);
 	}
-
-	if (size > 0) {
-		void *buf = mmap(NULL, size, PROT_WRITE, MAP_SHARED, fd, 0);
-		if (buf == MAP_FAILED)
-			goto err;
-
-		char *cur = buf;
-		size_t rem = size;
-
-		for (Iterator it = text_iterator_get(txt, range->start);
-		     rem > 0 && text_iterator_valid(&it);
-		     text_iterator_next(&it)) {
-			size_t len = it.end - it.text;
-			if (len > rem)
-				len = rem;
-			memcpy(cur, it.text, len);
-			cur += len;
-			rem -= len;
-		}
-
-		if (munmap(buf, size) == -1)
-			goto err;
-	}
-
-	if (oldfd != -1) {
+	return fd;
+err:
+	saved_errno = errno;
+	if (oldfd != -1)
 		close(oldfd);
-		oldfd = -1;
+	if (fd != -1) {
+		close(fd);
+		unlink(*tmpname);
 	}
+	free(*tmpname);
+	*tmpname = NULL;
+	errno = saved_errno;
+	return -1;
+}
+
+/* move the completely written `tmpname' into place, takes ownership of `fd' and `tmpname' */
+static bool save_atomic_commit(int fd, char *tmpname, const char *filename, struct stat *info) {
+	struct stat meta = { 0 };
+	int saved_errno;
 
 	if (fsync(fd) == -1)
 		goto err;
@@ -907,82 +2260,110 @@ static bool text_save_atomic_range(Text *txt, Filerange *range, const char *file
 	if (rename(tmpname, filename) == -1)
 		goto err;
 
-	if (meta.st_mtime)
-		txt->info = meta;
+	*info = meta;
 	free(tmpname);
 	return true;
 err:
 	saved_errno = errno;
-	if (oldfd != -1)
-		close(oldfd);
 	if (fd != -1)
 		close(fd);
-	if (tmpname && *tmpname)
-		unlink(tmpname);
+	unlink(tmpname);
 	free(tmpname);
 	errno = saved_errno;
 	return false;
 }
 
+static bool text_save_atomic_range(Text *txt, Filerange *range, const char *filename) {
+	struct stat meta;
+	if (!save_atomic(text_iterator_get(txt, range->start), text_range_size(range), filename, &meta, NULL))
+		return false;
+	if (meta.st_mtime)
+		txt->info = meta;
+	return true;
+}
+
 bool text_save(Text *txt, const char *filename) {
 	Filerange r = (Filerange){ .start = 0, .end = text_size(txt) };
 	return text_save_range(txt, &r, filename);
 }
 
+/* The buffers mapping the file identified by `meta' are copied to a temporary
+ * file and remapped at the same position such that all pointers from the
+ * various pieces are still valid, while the file itself can be overwritten.
+ */
+static bool buffers_unshare(Text *txt, struct stat *meta) {
+	size_t page = sysconf(_SC_PAGESIZE);
+	int fd = -1;
+	off_t offset = 0;
+	/* the scanner thread reads the mappings being replaced */
+	scan_finish(txt->scan);
+	for (Buffer *buf = txt->buffers; buf; buf = buf->next) {
+		struct stat info;
+		if (buf->type != MMAP || !buf->size || buf->fd == -1 || fstat(buf->fd, &info) == -1 ||
+		    info.st_dev != meta->st_dev || info.st_ino != meta->st_ino)
+			continue;
+		if (fd == -1) {
+			char tmpname[32] = "/tmp/vis-XXXXXX";
+			mode_t mask = umask(S_IXUSR | S_IRWXG | S_IRWXO);
+			fd = mkstemp(tmpname);
+			umask(mask);
+			if (fd == -1)
+				return false;
+			if (unlink(tmpname) == -1)
+				goto err;
+		}
+		/* mappings start at page aligned offsets */
+		if (lseek(fd, offset, SEEK_SET) == -1)
+			goto err;
+		ssize_t written = write_all(fd, buf->data, buf->size);
+		if (written == -1 || (size_t)written != buf->size)
+			goto err;
+		if (mmap(buf->data, buf->size, PROT_READ, MAP_SHARED|MAP_FIXED, fd, offset) == MAP_FAILED)
+			goto err;
+		/* further data is copied from the temporary file */
+		int dupfd = dup(fd);
+		close(buf->fd);
+		buf->fd = dupfd;
+		buf->offset = offset;
+		offset += (buf->size + page - 1) / page * page;
+	}
+	if (fd != -1)
+		close(fd);
+	return true;
+err:
+	close(fd);
+	return false;
+}
+
 /* First try to save the file atomically using rename(2) if this does not
  * work overwrite the file in place. However if something goes wrong during
  * this overwrite the original file is permanently damaged.
  */
 bool text_save_range(Text *txt, Filerange *range, const char *filename) {
 	struct stat meta;
-	int fd = -1, newfd = -1;
+	int fd = -1;
+	if (txt->save) {
+		errno = EBUSY;
+		return false;
+	}
 	if (!filename || text_save_atomic_range(txt, range, filename))
 		goto ok;
+	/* the content can not be converted, overwriting the file would not help */
+	if (errno == EILSEQ)
+		return false;
 	if ((fd = open(filename, O_CREAT|O_WRONLY, S_IRUSR|S_IWUSR)) == -1)
 		goto err;
 	if (fstat(fd, &meta) == -1)
 		goto err;
-	if (meta.st_dev == txt->info.st_dev && meta.st_ino == txt->info.st_ino &&
-	    txt->buf && txt->buf->type == MMAP && txt->buf->size) {
-		/* The file we are going to overwrite is currently mmap-ed from
-		 * text_load, therefore we copy the mmap-ed buffer to a temporary
-		 * file and remap it at the same position such that all pointers
-		 * from the various pieces are still valid.
-		 */
-		size_t size = txt->buf->size;
-		char tmpname[32] = "/tmp/vis-XXXXXX";
-		mode_t mask = umask(S_IXUSR | S_IRWXG | S_IRWXO);
-		newfd = mkstemp(tmpname);
-		umask(mask);
-		if (newfd == -1)
-			goto err;
-		if (unlink(tmpname) == -1)
-			goto err;
-		ssize_t written = write_all(newfd, txt->buf->data, size);
-		if (written == -1 || (size_t)written != size)
-			goto err;
-		if (munmap(txt->buf->data, size) == -1)
-			goto err;
-
-		void *data = mmap(txt->buf->data, size, PROT_READ, MAP_SHARED, newfd, 0);
-		if (data == MAP_FAILED)
-			goto err;
-		if (data != txt->buf->data) {
-			munmap(data, size);
-			goto err;
-		}
-		if (close(newfd) == -1) {
-			newfd = -1;
-			goto err;
-		}
-		txt->buf->data = data;
-		newfd = -1;
-	}
+	/* the file we are going to overwrite might be mapped by any of the
+	 * buffers, e.g. in chunks of BUFFER_MAX or with data appended later */
+	if (!buffers_unshare(txt, &meta))
+		goto err;
 	/* overwrite the exisiting file content, if somehting goes wrong
 	 * here we are screwed, TODO: make a backup before? */
 	if (ftruncate(fd, 0) == -1)
 		goto err;
-	ssize_t written = text_write_range(txt, range, fd);
+	ssize_t written = iterator_save(text_iterator_get(txt, range->start), text_range_size(range), fd, NULL);
 	if (written == -1 || (size_t)written != text_range_size(range))
 		goto err;
 
@@ -995,13 +2376,16 @@ bool text_save_range(Text *txt, Filerange *range, const char *filename) {
 	txt->info = meta;
 ok:
 	txt->saved_action = txt->history;
+	txt->loaded_saved = txt->loaded;
+	txt->saved_hash = HASH_UNKNOWN;
 	text_snapshot(txt);
+	/* the journal continues from the saved content */
+	if (filename && txt->journal && range->start == 0 && range->end == txt->size)
+		journal_restart(txt, journal_offset(txt->journal));
 	return true;
 err:
 	if (fd != -1)
 		close(fd);
-	if (newfd != -1)
-		close(newfd);
 	return false;
 }
 
@@ -1010,89 +2394,2813 @@ ssize_t text_write(Text *txt, int fd) {
 	return text_write_range(txt, &r, fd);
 }
 
-ssize_t text_write_range(Text *txt, Filerange *range, int fd) {
-	size_t size = text_range_size(range), rem = size;
-	for (Iterator it = text_iterator_get(txt, range->start);
-	     rem > 0 && text_iterator_valid(&it);
-	     text_iterator_next(&it)) {
-		size_t prem = it.end - it.text;
-		if (prem > rem)
-			prem = rem;
-		ssize_t written = write_all(fd, it.text, prem);
-		if (written == -1)
+/* write all count entries of iov, which is modified in the process. returns
+ * the number of bytes written or -1 in case of an error */
+static ssize_t writev_all(int fd, struct iovec *iov, int count) {
+	size_t total = 0;
+	while (count > 0) {
+		ssize_t written = writev(fd, iov, count);
+		if (written < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				continue;
 			return -1;
-		rem -= written;
-		if ((size_t)written != prem)
+		} else if (written == 0) {
 			break;
+		}
+		total += written;
+		for (; count > 0 && (size_t)written >= iov->iov_len; iov++, count--)
+			written -= iov->iov_len;
+		if (count > 0) {
+			iov->iov_base = (char*)iov->iov_base + written;
+			iov->iov_len -= written;
+		}
 	}
-	return size - rem;
+	return total;
 }
 
-/* load the given file as starting point for further editing operations.
- * to start with an empty document, pass NULL as filename. */
-Text *text_load(const char *filename) {
-	Text *txt = calloc(1, sizeof(Text));
-	if (!txt)
-		return NULL;
-	int fd = -1;
-	piece_init(&txt->begin, NULL, &txt->end, NULL, 0);
-	piece_init(&txt->end, &txt->begin, NULL, NULL, 0);
-	lineno_cache_invalidate(&txt->lines);
-	if (filename) {
-		if ((fd = open(filename, O_RDONLY)) == -1)
-			goto out;
-		if (fstat(fd, &txt->info) == -1)
-			goto out;
-		if (!S_ISREG(txt->info.st_mode)) {
-			errno = S_ISDIR(txt->info.st_mode) ? EISDIR : ENOTSUP;
-			goto out;
+/* write `size' bytes starting from the iterator position. data held in memory
+ * is gathered into as few writev(2) calls as possible, larger chunks of the
+ * loaded file are copied by the kernel without being paged into user space.
+ * the number of bytes written so far is published in `progress' if given. */
+static ssize_t iterator_write(Iterator it, size_t size, int fd, size_t *progress) {
+	struct iovec iov[64];
+	int count = 0;
+	size_t rem = size, written = 0, pending = 0;
+	for (; rem > 0 && text_iterator_valid(&it); text_iterator_next(&it)) {
+		size_t len = MIN((size_t)(it.end - it.text), rem);
+		Buffer *buf = it.txt->buffer_table[it.piece->buf];
+		bool copy = buf->fd != -1 && len >= BUFFER_COPY_SIZE;
+		rem -= len;
+		/* the total length has to fit into a ssize_t */
+		if (count == LENGTH(iov) || pending >= BUFFER_MAX || (copy && count)) {
+			ssize_t ret = writev_all(fd, iov, count);
+			if (ret == -1)
+				return -1;
+			written += ret;
+			if ((size_t)ret != pending)
+				return written;
+			count = 0;
+			pending = 0;
+		}
+		if (copy) {
+			size_t copied = buffer_copy(buf, it.text - buf->data, len, fd);
+			written += copied;
+			it.text += copied;
+			len -= copied;
+		}
+		if (progress)
+			__atomic_store_n(progress, written, __ATOMIC_RELAXED);
+		if (len > 0) {
+			iov[count].iov_base = (char*)it.text;
+			iov[count].iov_len = len;
+			count++;
+			pending += len;
 		}
-		// XXX: use lseek(fd, 0, SEEK_END); instead?
-		size_t size = txt->info.st_size;
-		if (size < BUFFER_MMAP_SIZE)
-			txt->buf = buffer_read(txt, size, fd);
-		else
-			txt->buf = buffer_mmap(txt, size, fd, 0);
-		if (!txt->buf)
-			goto out;
-		Piece *p = piece_alloc(txt);
-		if (!p)
-			goto out;
-		piece_init(&txt->begin, NULL, p, NULL, 0);
-		piece_init(p, &txt->begin, &txt->end, txt->buf->data, txt->buf->len);
-		piece_init(&txt->end, p, NULL, NULL, 0);
-		txt->size = txt->buf->len;
 	}
-	/* write an empty action */
-	change_alloc(txt, EPOS);
-	text_snapshot(txt);
-	txt->saved_action = txt->history;
+	ssize_t ret = writev_all(fd, iov, count);
+	if (ret == -1)
+		return -1;
+	if (progress)
+		__atomic_store_n(progress, written + ret, __ATOMIC_RELAXED);
+	return written + ret;
+}
 
-	if (fd != -1)
-		close(fd);
-	return txt;
-out:
-	if (fd != -1)
-		close(fd);
-	text_free(txt);
-	return NULL;
+/* append code point cp in the given encoding to out, fails if it is not representable */
+static bool encode(enum TextEncoding encoding, uint32_t cp, unsigned char *out, size_t *len) {
+	if (encoding == TEXT_ENCODING_LATIN1) {
+		if (cp > 0xFF)
+			return false;
+		out[(*len)++] = cp;
+		return true;
+	}
+	if ((0xD800 <= cp && cp < 0xE000) || cp > 0x10FFFF)
+		cp = 0xFFFD;
+	uint32_t units[2] = { cp };
+	int count = 1;
+	if (cp >= 0x10000) {
+		cp -= 0x10000;
+		units[0] = 0xD800 | cp >> 10;
+		units[1] = 0xDC00 | (cp & 0x3FF);
+		count = 2;
+	}
+	for (int i = 0; i < count; i++) {
+		bool le = encoding == TEXT_ENCODING_UTF16LE;
+		out[(*len)++] = le ? units[i] & 0xFF : units[i] >> 8;
+		out[(*len)++] = le ? units[i] >> 8 : units[i] & 0xFF;
+	}
+	return true;
 }
 
-struct stat text_stat(Text *txt) {
-	return txt->info;
+/* write the text converted to the encoding of its file, a byte order mark is
+ * prepended when starting at the beginning. invalid UTF-8 is replaced by
+ * U+FFFD. returns the number of text bytes written. */
+static ssize_t iterator_save(Iterator it, size_t size, int fd, size_t *progress) {
+	enum TextEncoding encoding = it.txt->encoding;
+	if (encoding == TEXT_ENCODING_UTF8)
+		return iterator_write(it, size, fd, progress);
+	unsigned char out[1 << 16];
+	size_t len = 0, rem = size;
+	uint32_t cp = 0;
+	unsigned int need = 0;
+	if (it.pos == 0 && it.txt->bom)
+		encode(encoding, 0xFEFF, out, &len);
+	for (; rem > 0 && text_iterator_valid(&it); text_iterator_next(&it)) {
+		size_t n = MIN((size_t)(it.end - it.text), rem);
+		const unsigned char *s = (const unsigned char*)it.text, *end = s + n;
+		for (; s < end; s++) {
+			if (len > sizeof(out) - 8) {
+				if (write_all(fd, (char*)out, len) != (ssize_t)len)
+					return -1;
+				len = 0;
+			}
+			unsigned char c = *s;
+			if (need && (c & 0xC0) == 0x80) {
+				cp = cp << 6 | (c & 0x3F);
+				if (--need)
+					continue;
+			} else {
+				/* incomplete sequence */
+				if (need && !encode(encoding, 0xFFFD, out, &len))
+					goto eilseq;
+				need = 0;
+				if (c < 0x80) {
+					cp = c;
+				} else if (0xC2 <= c && c < 0xE0) {
+					cp = c & 0x1F;
+					need = 1;
+				} else if (0xE0 <= c && c < 0xF0) {
+					cp = c & 0x0F;
+					need = 2;
+				} else if (0xF0 <= c && c < 0xF5) {
+					cp = c & 0x07;
+					need = 3;
+				} else {
+					cp = 0xFFFD;
+				}
+				if (need)
+					continue;
+			}
+			if (!encode(encoding, cp, out, &len))
+				goto eilseq;
+		}
+		rem -= n;
+		if (progress)
+			__atomic_store_n(progress, size - rem, __ATOMIC_RELAXED);
+	}
+	if (need && !encode(encoding, 0xFFFD, out, &len))
+		goto eilseq;
+	if (write_all(fd, (char*)out, len) != (ssize_t)len)
+		return -1;
+	return size - rem;
+eilseq:
+	errno = EILSEQ;
+	return -1;
 }
 
-/* A delete operation can either start/stop midway through a piece or at
- * a boundry. In the former case a new piece is created to represent the
- * remaining text before/after the modification point.
- *
- *      /-+ --> +---------+ --> +-----+ --> +-----+ --> +-\
- *      | |     | existing|     |demo |     |text |     | |
- *      \-+ <-- +---------+ <-- +-----+ <-- +-----+ <-- +-/
- *                   ^                         ^
- *                   |------ delete range -----|
- *
- *      /-+ --> +----+ --> +--+ --> +-\
+/* the content of a file truncated while a writer thread saves it is lost,
+ * hence the save is aborted with EIO. the main thread instead reads zero
+ * bytes in place of the missing content, see text_sigbus_recover */
+static ssize_t iterator_save_guarded(Iterator it, size_t size, int fd, size_t *progress) {
+	sigjmp_buf jmpbuf;
+	volatile ssize_t written = -1;
+	errno = EIO;
+	if (!sigsetjmp(jmpbuf, 1)) {
+		sigbus_recover = &jmpbuf;
+		written = iterator_save(it, size, fd, progress);
+	}
+	sigbus_recover = NULL;
+	return written;
+}
+
+ssize_t text_write_range(Text *txt, Filerange *range, int fd) {
+	return iterator_write(text_iterator_get(txt, range->start), text_range_size(range), fd, NULL);
+}
+
+static void *save_thread(void *arg) {
+	TextSave *save = arg;
+	sigbus_snap = save->snap;
+	Iterator it = text_snapshot_iterator_get(save->snap, 0);
+	size_t size = text_snapshot_size(save->snap);
+	ssize_t written = iterator_save_guarded(it, size, save->fd, &save->written);
+	if (written == -1 || (size_t)written != size) {
+		save->error = written == -1 ? errno : EIO;
+		close(save->fd);
+		unlink(save->tmpname);
+		free(save->tmpname);
+	} else {
+		save->success = save_atomic_commit(save->fd, save->tmpname, save->filename, &save->info);
+		save->error = errno;
+	}
+	save->fd = -1;
+	save->tmpname = NULL;
+	__atomic_store_n(&save->done, true, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+TextSave *text_save_begin(Text *txt, Filerange *range, const char *filename) {
+	if (txt->save) {
+		errno = EBUSY;
+		return NULL;
+	}
+	TextSave *save = calloc(1, sizeof *save);
+	if (!save)
+		return NULL;
+	save->fd = -1;
+	if (!(save->filename = strdup(filename)))
+		goto err;
+	/* everything which prevents an atomic save fails here rather than in the
+	 * thread, such that the caller can resort to text_save_range. an in place
+	 * overwrite modifies the buffers and thus has to be synchronous */
+	if ((save->fd = save_atomic_open(filename, &save->tmpname)) == -1)
+		goto err;
+	text_snapshot(txt);
+	if (!(save->snap = text_snapshot_range(txt, range)))
+		goto err;
+	/* compressed data is only ever unpacked by the main thread */
+	for (size_t i = 0; i < save->snap->block_count; i++) {
+		SnapshotBlock *block = save->snap->blocks[i];
+		for (size_t j = 0; j < block->count; j++) {
+			if (!piece_data(&save->snap->view, &block->pieces[j].piece))
+				goto err;
+		}
+	}
+	/* signals are handled by the main thread, except for SIGBUS raised by
+	 * accesses to truncated files which is handled by the faulting thread */
+	sigset_t blocked, old;
+	sigfillset(&blocked);
+	sigdelset(&blocked, SIGBUS);
+	pthread_sigmask(SIG_SETMASK, &blocked, &old);
+	int error = pthread_create(&save->thread, NULL, save_thread, save);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (error) {
+		errno = error;
+		goto err;
+	}
+	save->saved = txt->history;
+	save->loaded = txt->loaded;
+	save->journal = EPOS;
+	if (txt->journal && range->start == 0 && range->end == txt->size)
+		save->journal = journal_offset(txt->journal);
+	save->txt = txt;
+	txt->save = save;
+	return save;
+err:
+	if (save->fd != -1) {
+		close(save->fd);
+		unlink(save->tmpname);
+	}
+	free(save->tmpname);
+	text_snapshot_unref(save->snap);
+	free(save->filename);
+	free(save);
+	return NULL;
+}
+
+size_t text_save_progress(TextSave *save, size_t *total) {
+	if (total)
+		*total = text_snapshot_size(save->snap);
+	return __atomic_load_n(&save->written, __ATOMIC_RELAXED);
+}
+
+bool text_save_done(TextSave *save) {
+	return __atomic_load_n(&save->done, __ATOMIC_ACQUIRE);
+}
+
+bool text_save_finish(TextSave *save) {
+	pthread_join(save->thread, NULL);
+	Text *txt = save->txt;
+	bool success = save->success;
+	if (txt) {
+		txt->save = NULL;
+		if (success) {
+			txt->saved_action = save->saved;
+			txt->loaded_saved = save->loaded;
+			txt->saved_hash = HASH_UNKNOWN;
+			if (save->info.st_mtime)
+				txt->info = save->info;
+			if (save->journal != EPOS)
+				journal_restart(txt, save->journal);
+		}
+	}
+	text_snapshot_unref(save->snap);
+	free(save->filename);
+	if (!success)
+		errno = save->error;
+	free(save);
+	return success;
+}
+
+/* bytes of a word, all set to the given value */
+#define WORD_BYTES(c) (((uint64_t)-1 / 0xff) * (c))
+
+/* marks the zero bytes of the word by setting their 0x80 bit */
+static uint64_t word_zero(uint64_t w) {
+	return ~(((w & WORD_BYTES(0x7f)) + WORD_BYTES(0x7f)) | w) & WORD_BYTES(0x80);
+}
+
+/* index of the first marked byte in memory order */
+static unsigned int word_first(uint64_t mask) {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	return __builtin_clzll(mask) / 8;
+#else
+	return __builtin_ctzll(mask) / 8;
+#endif
+}
+
+/* index of the last marked byte in memory order */
+static unsigned int word_last(uint64_t mask) {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	return 7 - __builtin_ctzll(mask) / 8;
+#else
+	return 7 - __builtin_clzll(mask) / 8;
+#endif
+}
+
+/* the mask without its first marked byte */
+static uint64_t word_next(uint64_t mask) {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	return mask & ~(WORD_BYTES(0x80) << (56 - 8 * word_first(mask)));
+#else
+	return mask & (mask - 1);
+#endif
+}
+
+/* advance the UTF-8 validation by one byte */
+static void scan_utf8(Scan *s, unsigned char c) {
+	if (s->need) {
+		if (c < s->lo || c > s->hi)
+			s->info.utf8 = false;
+		s->lo = 0x80;
+		s->hi = 0xbf;
+		s->need--;
+		return;
+	}
+	if (c < 0x80)
+		return;
+	s->lo = 0x80;
+	s->hi = 0xbf;
+	if (0xc2 <= c && c <= 0xdf) {
+		s->need = 1;
+	} else if (0xe0 <= c && c <= 0xef) {
+		/* reject overlong encodings and surrogates */
+		s->need = 2;
+		if (c == 0xe0)
+			s->lo = 0xa0;
+		else if (c == 0xed)
+			s->hi = 0x9f;
+	} else if (0xf0 <= c && c <= 0xf4) {
+		/* reject overlong encodings and code points above U+10FFFF */
+		s->need = 3;
+		if (c == 0xf0)
+			s->lo = 0x90;
+		else if (c == 0xf4)
+			s->hi = 0x8f;
+	} else {
+		s->info.utf8 = false;
+	}
+}
+
+/* the line preceding the new line at `nl' ends, it started at `*line' */
+static void scan_newline(Scan *s, const char *start, const char *nl, const char **line) {
+	if (!s->newline) {
+		unsigned char prev = nl > start ? nl[-1] : s->last;
+		s->info.crlf = prev == '\r';
+		s->newline = true;
+	}
+	size_t len = s->line + (nl - *line);
+	if (len > s->info.longest_line)
+		s->info.longest_line = len;
+	s->line = 0;
+	*line = nl + 1;
+}
+
+/* scan the given data, returns the number of new lines it contains. it is
+ * processed a word at a time, only those containing NUL bytes or non ASCII
+ * characters are examined byte wise, as long as these are still of interest. */
+static size_t scan_data(Scan *s, const char *data, size_t len) {
+	const char *start = data, *cur = data, *end = data + len, *line = data;
+	size_t lines = 0;
+	while (cur < end) {
+		uint64_t ascii = s->info.utf8 ? WORD_BYTES(0x80) : 0;
+		bool binary = s->info.binary;
+		for (uint64_t w; s->need == 0 && end - cur >= (ptrdiff_t)sizeof w; cur += sizeof w) {
+			memcpy(&w, cur, sizeof w);
+			if ((w & ascii) || (!binary && word_zero(w)))
+				break;
+			uint64_t nl = word_zero(w ^ WORD_BYTES('\n'));
+			if (!nl)
+				continue;
+			scan_newline(s, start, cur + word_first(nl), &line);
+			lines += (nl >> 7) * WORD_BYTES(0x01) >> 56;
+			/* further lines within the word are shorter than it */
+			if (s->info.longest_line < sizeof w) {
+				for (nl = word_next(nl); nl; nl = word_next(nl))
+					scan_newline(s, start, cur + word_first(nl), &line);
+			} else {
+				line = cur + word_last(nl) + 1;
+			}
+		}
+		if (cur == end)
+			break;
+		unsigned char c = *cur;
+		if (c == '\n') {
+			scan_newline(s, start, cur, &line);
+			lines++;
+		} else if (c == '\0') {
+			s->info.binary = true;
+		}
+		if (s->info.utf8)
+			scan_utf8(s, c);
+		cur++;
+	}
+	s->line += end - line;
+	if (len)
+		s->last = end[-1];
+	return lines;
+}
+
+/* scan the data of a chunk block by block, recording the new line checkpoints */
+static bool scan_chunk(Scan *s, ScanChunk *c, const char *data) {
+	size_t blocks = c->len / BUFFER_LINES_BLOCK + 1, lines = 0;
+	if (!(c->lines = malloc(blocks * sizeof *c->lines)))
+		return false;
+	for (size_t i = 0; i < blocks; i++) {
+		if (__atomic_load_n(&s->stop, __ATOMIC_RELAXED))
+			return false;
+		size_t off = i * BUFFER_LINES_BLOCK;
+		c->lines[i] = lines;
+		lines += scan_data(s, data + off, MIN(BUFFER_LINES_BLOCK, c->len - off));
+	}
+	s->info.lines += lines;
+	return true;
+}
+
+/* complete the scan, the properties are only known if all data was covered */
+static void scan_end(Scan *s, bool complete) {
+	if (s->line > s->info.longest_line)
+		s->info.longest_line = s->line;
+	if (s->need)
+		s->info.utf8 = false;
+	s->complete = complete;
+}
+
+/* scan all chunks, returns whether this was completed */
+static bool scan_chunks(Scan *s) {
+	for (size_t i = 0; i < s->count; i++) {
+		if (!scan_chunk(s, &s->chunks[i], s->chunks[i].data))
+			return false;
+	}
+	return true;
+}
+
+/* compute the content hash checkpoints of all chunks, returns whether this was completed */
+static bool scan_hashes(Scan *s) {
+	for (size_t i = 0; i < s->count; i++) {
+		ScanChunk *c = &s->chunks[i];
+		size_t blocks = c->len / BUFFER_LINES_BLOCK + 1;
+		if (!(c->hashes = malloc(blocks * sizeof *c->hashes)))
+			return false;
+		c->hashes[0] = 0;
+		for (size_t j = 1; j < blocks; j++) {
+			if (__atomic_load_n(&s->stop_hash, __ATOMIC_RELAXED))
+				return false;
+			const char *data = c->data + (j - 1) * BUFFER_LINES_BLOCK;
+			c->hashes[j] = hash_bytes(c->hashes[j-1], data, BUFFER_LINES_BLOCK);
+		}
+	}
+	return true;
+}
+
+/* run one of the scan phases, which is abandoned if the file is truncated */
+static bool scan_guarded(Scan *s, bool (*scan)(Scan*)) {
+	sigjmp_buf jmpbuf;
+	volatile bool complete = false;
+	if (!sigsetjmp(jmpbuf, 1)) {
+		sigbus_recover = &jmpbuf;
+		complete = scan(s);
+	}
+	sigbus_recover = NULL;
+	return complete;
+}
+
+static void *scan_thread(void *arg) {
+	Scan *s = arg;
+	sigbus_scan = s;
+	bool complete = scan_guarded(s, scan_chunks);
+	scan_end(s, complete);
+	/* the index is written before the results can be taken over */
+	int index = complete ? index_begin(s) : -1;
+	pthread_mutex_lock(&s->lock);
+	__atomic_store_n(&s->done, true, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+	/* the new line checkpoints can be adopted while the hashes are computed */
+	s->hashed = complete && scan_guarded(s, scan_hashes);
+	index_finish(s, index);
+	__atomic_store_n(&s->hashing, false, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+/* scan the content of all loaded buffers, in a separate thread if they are
+ * mapped from a file */
+static Scan *scan_new(Text *txt) {
+	Scan *s = calloc(1, sizeof *s);
+	if (!s)
+		return NULL;
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->cond, NULL);
+	s->info.utf8 = true;
+	s->count = txt->buffer_count ? txt->buffer_count - 1 : 0;
+	if (s->count && !(s->chunks = calloc(s->count, sizeof *s->chunks)))
+		goto err;
+	bool mapped = false;
+	for (size_t i = 0; i < s->count; i++) {
+		Buffer *buf = txt->buffer_table[i+1];
+		s->chunks[i] = (ScanChunk){ .buf = buf, .data = buf->data, .len = buf->len };
+		mapped |= buf->type == MMAP;
+	}
+
+	if (mapped) {
+		sigset_t blocked, old;
+		sigfillset(&blocked);
+		sigdelset(&blocked, SIGBUS);
+		pthread_sigmask(SIG_SETMASK, &blocked, &old);
+		s->hashing = true;
+		s->threaded = !pthread_create(&s->thread, NULL, scan_thread, s);
+		pthread_sigmask(SIG_SETMASK, &old, NULL);
+		if (s->threaded)
+			return s;
+		s->hashing = false;
+	}
+
+	/* data read into memory is scanned right away, its hashes are
+	 * computed on demand */
+	scan_end(s, scan_chunks(s));
+	s->done = true;
+	scan_adopt(txt, NULL);
+	return s;
+err:
+	scan_free(s);
+	return NULL;
+}
+
+/* take over the results of a completed scan. if the checkpoints of `buf' are
+ * requested, a pending scan covering it is waited for rather than duplicating
+ * its work. the scanner thread continues to compute the hashes. */
+static void scan_adopt(Text *txt, Buffer *buf) {
+	Scan *s = txt->scan;
+	if (!s || s->adopted)
+		return;
+	if (!__atomic_load_n(&s->done, __ATOMIC_ACQUIRE)) {
+		if (!(buf && buf->id <= s->count))
+			return;
+		pthread_mutex_lock(&s->lock);
+		while (!__atomic_load_n(&s->done, __ATOMIC_ACQUIRE))
+			pthread_cond_wait(&s->cond, &s->lock);
+		pthread_mutex_unlock(&s->lock);
+	}
+	s->adopted = true;
+	if (!s->complete)
+		return;
+	for (size_t i = 0; i < s->count; i++) {
+		ScanChunk *c = &s->chunks[i];
+		size_t blocks = c->len / BUFFER_LINES_BLOCK + 1;
+		if (c->buf->lines_count >= blocks)
+			continue;
+		free(c->buf->lines);
+		c->buf->lines = c->lines;
+		c->buf->lines_count = c->buf->lines_size = blocks;
+		c->lines = NULL;
+	}
+}
+
+/* take over the hash checkpoints computed by the scanner thread, returns
+ * false while it is still busy doing so */
+static bool scan_adopt_hashes(Text *txt) {
+	Scan *s = txt->scan;
+	if (!s || s->hashes_adopted)
+		return true;
+	if (__atomic_load_n(&s->hashing, __ATOMIC_ACQUIRE))
+		return false;
+	s->hashes_adopted = true;
+	if (!s->hashed)
+		return true;
+	for (size_t i = 0; i < s->count; i++) {
+		ScanChunk *c = &s->chunks[i];
+		size_t blocks = c->len / BUFFER_LINES_BLOCK + 1;
+		if (c->buf->hashes_count >= blocks)
+			continue;
+		free(c->buf->hashes);
+		c->buf->hashes = c->hashes;
+		c->buf->hashes_count = c->buf->hashes_size = blocks;
+		c->hashes = NULL;
+	}
+	return true;
+}
+
+/* wait for the scanner thread to terminate, it no longer accesses the buffers.
+ * the new line checkpoints are completed, the hashes are not */
+static void scan_finish(Scan *s) {
+	if (!s || !s->threaded)
+		return;
+	__atomic_store_n(&s->stop_hash, true, __ATOMIC_RELAXED);
+	pthread_join(s->thread, NULL);
+	s->threaded = false;
+}
+
+static void scan_free(Scan *s) {
+	if (!s)
+		return;
+	__atomic_store_n(&s->stop, true, __ATOMIC_RELAXED);
+	scan_finish(s);
+	for (size_t i = 0; i < s->count; i++) {
+		free(s->chunks[i].lines);
+		free(s->chunks[i].hashes);
+	}
+	free(s->index);
+	free(s->chunks);
+	pthread_mutex_destroy(&s->lock);
+	pthread_cond_destroy(&s->cond);
+	free(s);
+}
+
+/* append a piece referring to loaded buffer data to the initial text */
+static bool load_piece(Text *txt, Buffer *buf, size_t off, size_t len) {
+	Piece *p = piece_alloc(txt), *prev = txt->end.prev;
+	if (!p || !node_reserve(txt, 1))
+		return false;
+	piece_init(p, prev, &txt->end, buf->id, off, len);
+	prev->next = p;
+	txt->end.prev = p;
+	tree_insert(txt, prev, p);
+	txt->size += len;
+	return true;
+}
+
+/* determine the encoding of the file, a byte order mark takes precedence */
+static enum TextEncoding load_encoding(Text *txt, int fd, enum TextEncoding encoding) {
+	unsigned char bom[2];
+	if (encoding == TEXT_ENCODING_UTF8 || encoding == TEXT_ENCODING_LATIN1)
+		return encoding;
+	if (fd == -1) {
+		/* new UTF-16 files are marked, such that they are recognized */
+		txt->bom = encoding != TEXT_ENCODING_DETECT;
+		return txt->bom ? encoding : TEXT_ENCODING_UTF8;
+	}
+	if (pread(fd, bom, sizeof bom, 0) != sizeof bom)
+		return encoding == TEXT_ENCODING_DETECT ? TEXT_ENCODING_UTF8 : encoding;
+	enum TextEncoding found = TEXT_ENCODING_DETECT;
+	if (bom[0] == 0xFF && bom[1] == 0xFE)
+		found = TEXT_ENCODING_UTF16LE;
+	else if (bom[0] == 0xFE && bom[1] == 0xFF)
+		found = TEXT_ENCODING_UTF16BE;
+	if (encoding == TEXT_ENCODING_DETECT)
+		encoding = found == TEXT_ENCODING_DETECT ? TEXT_ENCODING_UTF8 : found;
+	txt->bom = found == encoding;
+	return encoding;
+}
+
+/* map the file and divide its content into chunks, only their decoded length
+ * is determined here. the chunks are distributed over DECODED buffers of at
+ * most BUFFER_MAX bytes each, every one is referred to by its own piece. */
+static bool load_transcoded(Text *txt, int fd, size_t size) {
+	DecodeChunk *chunks = NULL;
+	size_t count = 0, first = 0, off = 0;
+	if (!(txt->buf = buffer_mmap(txt, size, fd, 0)))
+		return false;
+	const char *src = txt->buf->data + (txt->bom ? 2 : 0), *end = txt->buf->data + size;
+	while (src < end || first < count) {
+		size_t src_len = src < end ? decode_chunk(txt->encoding, src, end - src) : 0;
+		size_t len = src_len ? decode_len(txt->encoding, src, src_len) : 0;
+		if (first < count && (src == end || off + len > BUFFER_MAX)) {
+			Buffer *buf = buffer_decoded(txt, txt->encoding, chunks + first, count - first);
+			if (!buf)
+				goto err;
+			for (size_t i = first; i < count; i++) {
+				if (!load_piece(txt, buf, chunks[i].off, chunks[i].len))
+					goto err;
+			}
+			first = count;
+			off = 0;
+		}
+		if (src == end)
+			break;
+		DecodeChunk *grown = realloc(chunks, (count + 1) * sizeof *chunks);
+		if (!grown)
+			goto err;
+		chunks = grown;
+		chunks[count++] = (DecodeChunk){ .src = src, .src_len = src_len, .off = off, .len = len };
+		off += len;
+		src += src_len;
+	}
+	free(chunks);
+	return true;
+err:
+	free(chunks);
+	return false;
+}
+
+/* load the given file as starting point for further editing operations.
+ * to start with an empty document, pass NULL as filename. */
+Text *text_load(const char *filename) {
+	return text_load_encoding(filename, TEXT_ENCODING_DETECT);
+}
+
+Text *text_load_encoding(const char *filename, enum TextEncoding encoding) {
+	Text *txt = calloc(1, sizeof(Text));
+	if (!txt)
+		return NULL;
+	int fd = -1;
+	slab_init(&txt->pieces, sizeof(Piece));
+	slab_init(&txt->changes, sizeof(Change));
+	slab_init(&txt->actions, sizeof(Action));
+	slab_init(&txt->nodes, sizeof(Node));
+	txt->seed = 2463534242;
+	txt->history_fd = -1;
+	txt->refs = 1;
+	piece_init(&txt->begin, NULL, &txt->end, 0, 0, 0);
+	piece_init(&txt->end, &txt->begin, NULL, 0, 0, 0);
+	if (filename) {
+		if ((fd = open(filename, O_RDONLY)) == -1)
+			goto out;
+		if (fstat(fd, &txt->info) == -1)
+			goto out;
+		if (!S_ISREG(txt->info.st_mode)) {
+			errno = S_ISDIR(txt->info.st_mode) ? EISDIR : ENOTSUP;
+			goto out;
+		}
+		// XXX: use lseek(fd, 0, SEEK_END); instead?
+		size_t size = txt->info.st_size;
+		txt->encoding = load_encoding(txt, fd, encoding);
+		if (txt->encoding != TEXT_ENCODING_UTF8) {
+			if (!load_transcoded(txt, fd, size))
+				goto out;
+		} else if (size < BUFFER_MMAP_SIZE)
+			txt->buf = buffer_read(txt, size, fd);
+		else
+			txt->buf = buffer_mmap(txt, MIN(size, BUFFER_MAX), fd, 0);
+		if (!txt->buf)
+			goto out;
+		for (Buffer *buf = txt->buf; txt->encoding == TEXT_ENCODING_UTF8; ) {
+			if (!load_piece(txt, buf, 0, buf->len))
+				goto out;
+			if (buf->type != MMAP || txt->size >= size)
+				break;
+			/* files larger than BUFFER_MAX are mapped in multiple junks */
+			if (!(buf = buffer_mmap(txt, MIN(size - txt->size, BUFFER_MAX), fd, txt->size)))
+				goto out;
+		}
+	} else {
+		txt->encoding = load_encoding(txt, -1, encoding);
+	}
+	/* the properties of transcoded content are not determined */
+	if (txt->encoding == TEXT_ENCODING_UTF8)
+		txt->scan = scan_new(txt);
+	/* write an empty action */
+	change_alloc(txt, EPOS);
+	text_snapshot(txt);
+	txt->saved_action = txt->history;
+	txt->saved_hash = HASH_UNKNOWN;
+
+	if (fd != -1)
+		close(fd);
+	return txt;
+out:
+	if (fd != -1)
+		close(fd);
+	text_free(txt);
+	return NULL;
+}
+
+struct stat text_stat(Text *txt) {
+	return txt->info;
+}
+
+enum TextEncoding text_encoding(Text *txt) {
+	return txt->encoding;
+}
+
+bool text_load_info(Text *txt, TextLoadInfo *info) {
+	scan_adopt(txt, NULL);
+	Scan *s = txt->scan;
+	if (!s || !s->adopted || !s->complete)
+		return false;
+	*info = s->info;
+	return true;
+}
+
+bool text_lines_ready(Text *txt) {
+	Scan *s = txt->scan;
+	return !s || s->adopted || __atomic_load_n(&s->done, __ATOMIC_ACQUIRE);
+}
+
+/* count the new lines of data read by text_load_fd, its properties are
+ * added to those of the loaded content unless they are unknown */
+static size_t scan_append(Text *txt, const char *data, size_t len) {
+	Scan *s = txt->scan;
+	scan_adopt(txt, txt->buf);
+	if (!s || !s->adopted || !s->complete)
+		return lines_count(data, len);
+	size_t lines = scan_data(s, data, len);
+	s->info.lines += lines;
+	if (s->line > s->info.longest_line)
+		s->info.longest_line = s->line;
+	return lines;
+}
+
+/* link a new piece holding read data to the end of the text. since it becomes
+ * part of all states of the editing history, every piece which was ever last
+ * in the chain is made to precede it. those linked before already precede the
+ * previous such piece, hence besides the current last piece only the spans of
+ * the changes made since then have to be considered. */
+static void load_link(Text *txt, Piece *p) {
+	Piece *prev = txt->end.prev;
+	prev->next = p;
+	size_t count = txt->changes.count;
+	for (SlabChunk *chunk = txt->changes.chunks; chunk && count > txt->load_changes; chunk = chunk->next) {
+		Change *first = (Change*)(chunk + 1);
+		Change *c = first + (chunk == txt->changes.chunks ? txt->changes.used : chunk->size) / sizeof *c;
+		for (; c > first && count > txt->load_changes; count--) {
+			c--;
+			if (c->old.end && c->old.end->next == &txt->end)
+				c->old.end->next = p;
+			if (c->new.end && c->new.end->next == &txt->end)
+				c->new.end->next = p;
+		}
+	}
+	txt->end.prev = p;
+	tree_insert(txt, prev, p);
+}
+
+ssize_t text_load_fd(Text *txt, int fd, size_t size) {
+	size_t total = 0;
+	ssize_t len = 0;
+	while (total < size) {
+		Buffer *buf = txt->load;
+		if ((!buf || buf->len == buf->size) && !(buf = buffer_load(txt))) {
+			len = -1;
+			break;
+		}
+		/* the last piece is extended in place, as long as it is not part
+		 * of any change and thus of no span whose length would be off */
+		Piece *p = txt->load_piece;
+		bool extend = p && p->node && p == txt->end.prev && p->buf == buf->id &&
+		              p->off + p->len == buf->len && txt->changes.count == txt->load_changes;
+		if (!extend && (!(p = piece_alloc(txt)) || !node_reserve(txt, 1))) {
+			len = -1;
+			break;
+		}
+		char *data = buf->data + buf->len;
+		do
+			len = read(fd, data, MIN(size - total, buf->size - buf->len));
+		while (len == -1 && errno == EINTR);
+		if (len <= 0)
+			break;
+		buf->len += len;
+		size_t lines = scan_append(txt, data, len);
+		if (extend) {
+			p->len += len;
+			if (p->lines != LINES_UNKNOWN)
+				p->lines += lines;
+			p->hash = HASH_UNKNOWN;
+			for (Node *cur = p->node; cur; cur = cur->parent) {
+				cur->subtree_len += len;
+				if (cur->subtree_lines != EPOS)
+					cur->subtree_lines += lines;
+				cur->subtree_hash = HASH_UNKNOWN;
+			}
+		} else {
+			piece_init(p, txt->end.prev, &txt->end, buf->id, data - buf->data, len);
+			p->lines = lines;
+			load_link(txt, p);
+			txt->load_piece = p;
+		}
+		txt->load_changes = txt->changes.count;
+		if (txt->journal)
+			journal_append(txt->journal, txt->size, data, len);
+		txt->size += len;
+		txt->loaded += len;
+		total += len;
+	}
+	if (total)
+		snapshot_modify(txt, txt->size - total, 0, total);
+	/* an incomplete character at the end of the input is invalid */
+	if (len == 0 && txt->scan && txt->scan->adopted && txt->scan->need)
+		txt->scan->info.utf8 = false;
+	return total ? (ssize_t)total : len;
+}
+
+ssize_t text_follow(Text *txt, const char *filename) {
+	struct stat meta;
+	ssize_t len = -1;
+	/* positions within transcoded content do not correspond to file offsets */
+	if (txt->encoding != TEXT_ENCODING_UTF8) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	int fd = open(filename, O_RDONLY);
+	if (fd == -1)
+		return -1;
+	if (fstat(fd, &meta) == -1)
+		goto out;
+	/* a replaced or truncated file no longer starts with the known content */
+	off_t off = txt->info.st_size;
+	if (meta.st_dev != txt->info.st_dev || meta.st_ino != txt->info.st_ino || meta.st_size < off) {
+		errno = ESTALE;
+		goto out;
+	}
+	len = 0;
+	if (meta.st_size == off)
+		goto out;
+	if (lseek(fd, off, SEEK_SET) == -1) {
+		len = -1;
+		goto out;
+	}
+	bool saved = !text_modified(txt);
+	len = text_load_fd(txt, fd, meta.st_size - off);
+	if (len > 0) {
+		txt->info = meta;
+		txt->info.st_size = off + len;
+		/* the data is part of the file, hence not an unsaved modification */
+		if (saved) {
+			txt->loaded_saved = txt->loaded;
+			/* the saved content grew along with the text */
+			if (txt->saved_hash != HASH_UNKNOWN) {
+				txt->saved_hash = text_hash(txt);
+				txt->saved_size = txt->size;
+			}
+		}
+	}
+out:
+	close(fd);
+	return len;
+}
+
+TextAllocStats text_alloc_stats(Text *txt) {
+	size_t used = 0, decoded = 0;
+	for (Buffer *buf = txt->buffers; buf; buf = buf->next) {
+		if (buf->type == ANON || buf->type == PACKED)
+			used += buf->len;
+		for (size_t i = 0; i < buf->chunk_count; i++)
+			decoded += buf->chunks[i].decoded ? buf->chunks[i].len : 0;
+	}
+	return (TextAllocStats){
+		.pieces = txt->pieces.count,
+		.changes = txt->changes.count,
+		.actions = txt->actions.count,
+		.memory = txt->pieces.memory + txt->changes.memory + txt->actions.memory + txt->nodes.memory,
+		.buffers = txt->history_memory,
+		.used = used,
+		.spilled = txt->history_size,
+		.decoded = decoded,
+	};
+}
+
+TextPoolStats text_pool_stats(void) {
+	pthread_mutex_lock(&pool.lock);
+	TextPoolStats stats = {
+		.committed = pool.committed,
+		.pooled = pool.pooled,
+		.compressed = pool.compressed,
+		.packed = pool.packed,
+		.unpacks = pool.unpacks,
+		.unpack_time = pool.unpack_time,
+		.unpack_max = pool.unpack_max,
+	};
+	pthread_mutex_unlock(&pool.lock);
+	return stats;
+}
+
+void text_history_limit(Text *txt, size_t size) {
+	txt->history_limit = size;
+	buffer_spill_all(txt);
+}
+
+bool text_compress(Text *txt) {
+	/* the writer thread accesses the buffers */
+	if (txt->save)
+		return true;
+	bool pending = false;
+	for (Buffer *buf = txt->buffers; buf; buf = buf->next) {
+		if (buf->type != ANON || buf == txt->buffers || buf == txt->load ||
+		    buf->dense || buf->len < BUFFER_PACK_MIN)
+			continue;
+		if (!__atomic_exchange_n(&buf->cold, true, __ATOMIC_RELAXED))
+			pending = true;
+		else if (!buffer_pack(buf) && !buf->dense)
+			pending = true;
+	}
+	return pending;
+}
+
+/* The undo file preserves the editing history across sessions. It starts with
+ * a header followed by records which are only ever appended. Each write adds
+ * the buffer data, pieces and actions not yet stored by a previous one and is
+ * completed by a state record identifying the saved file content. Records
+ * following the last state record stem from an interrupted write and are
+ * ignored. Buffer data is stored page aligned such that it can be mapped when
+ * the history is restored.
+ *
+ * Pieces are identified by their allocation order (following the ids of the
+ * two sentinels), actions by their sequence number. For each change the pieces
+ * of the new span are stored together with their links at the time the change
+ * was performed. Restoring these links and redoing all actions leading to the
+ * saved state reproduces the piece chain exactly as it was left.
+ *
+ * The content of mapped file buffers is mostly part of the saved file, where
+ * the pieces referring to it are found once the history is restored. Hence
+ * only the pages used by other pieces are stored, while each write lists the
+ * ranges of these buffers forming the saved file. Pieces within them are then
+ * redirected to the buffers of the loaded file, but are still stored as the
+ * restored buffer range, such that the same content is only stored once.
+ */
+
+#define UNDO_MAGIC "VISUNDO1"
+#define UNDO_ORDER 0x01020304  /* detects files written with a different byte order */
+#define UNDO_BEGIN 0           /* piece id of the begin sentinel */
+#define UNDO_END   1           /* piece id of the end sentinel */
+#define UNDO_NONE  UINT32_MAX  /* piece id of a NULL pointer */
+
+enum {
+	UNDO_DATA = 1,          /* buffer content */
+	UNDO_PIECES,            /* pieces in order of their allocation */
+	UNDO_ROOT,              /* ids of the pieces forming the text of the first action */
+	UNDO_ACTION,            /* an action and its changes */
+	UNDO_STATE,             /* the saved text state, completes a write */
+	UNDO_FILE,              /* buffer ranges part of the saved file, valid for one write */
+};
+
+typedef struct {
+	char magic[8];          /* UNDO_MAGIC */
+	uint32_t order;         /* UNDO_ORDER */
+	uint32_t page;          /* page size to which buffer data is aligned */
+} UndoHeader;
+
+typedef struct {
+	uint32_t type;          /* one of the record types above */
+	uint32_t count;         /* number of pieces or changes following */
+	uint64_t size;          /* of the whole record in bytes, a multiple of 8 */
+} UndoRecord;
+
+typedef struct {
+	uint64_t buf;           /* buffer id */
+	uint64_t off;           /* page aligned offset into the buffer */
+	uint64_t len;           /* number of bytes stored */
+	uint64_t data;          /* page aligned file offset at which they are stored */
+} UndoData;
+
+typedef struct {
+	uint32_t buf, off, len; /* as in struct Piece */
+} UndoPiece;
+
+typedef struct {
+	uint32_t buf, off, len; /* buffer range, ordered by buffer and offset */
+	uint32_t unused;
+	uint64_t pos;           /* at which it is found in the saved file */
+} UndoFile;
+
+typedef struct {
+	uint64_t seq;           /* sequence number, actions are stored in this order */
+	uint64_t prev;          /* sequence number of the parent action, UINT64_MAX for the first */
+	int64_t time;           /* when the action was created */
+} UndoAction;
+
+typedef struct {
+	uint64_t pos;           /* position of the change */
+	uint64_t old_len;       /* length of the old span */
+	uint32_t old_start;     /* piece ids of the old span */
+	uint32_t old_end;
+	uint32_t new_prev;      /* piece ids of the neighbours of the new span */
+	uint32_t new_next;
+	uint32_t new_count;     /* number of piece ids of the new span following */
+	uint32_t unused;
+} UndoChange;
+
+typedef struct {
+	uint64_t saved;         /* sequence number of the saved action */
+	uint64_t buffers;       /* number of buffers */
+	uint64_t size;          /* of the saved content, followed by the file information */
+	uint64_t dev;
+	uint64_t ino;
+	int64_t mtime;
+	uint64_t hash;          /* of the saved file content */
+} UndoState;
+
+typedef struct {
+	const char *start;      /* first piece of a slab chunk */
+	size_t count;           /* number of pieces allocated from it */
+	size_t id;              /* id of its first piece */
+} UndoChunk;
+
+typedef struct {
+	Text *txt;
+	int fd;                 /* undo file being written */
+	size_t off;             /* current offset into it */
+	char *data;             /* record being assembled */
+	size_t len, size;       /* used/allocated bytes of data */
+	UndoChunk *chunks;      /* piece slab chunks in allocation order */
+	UndoChunk *sorted;      /* the same sorted by address */
+	size_t chunk_count;
+	UndoFile *files;        /* ranges of mapped buffers forming the saved file */
+	size_t file_count, file_size;
+} UndoWriter;
+
+static size_t undo_align(size_t size, size_t align) {
+	return (size + align - 1) / align * align;
+}
+
+typedef struct {
+	uint64_t hash;          /* state of the FNV-1a based hash over 8 byte words */
+	unsigned char tail[8];  /* bytes not yet forming a complete word */
+	size_t len;             /* number of bytes hashed */
+} Hash;
+
+static void hash_init(Hash *h) {
+	h->hash = 14695981039346656037ULL;
+	h->len = 0;
+}
+
+/* the result only depends on the concatenation of all data hashed */
+static void hash_update(Hash *h, const char *data, size_t len) {
+	uint64_t word;
+	size_t n = h->len % sizeof word;
+	h->len += len;
+	while (len > 0) {
+		if (n == 0 && len >= sizeof word) {
+			memcpy(&word, data, sizeof word);
+			data += sizeof word;
+			len -= sizeof word;
+		} else {
+			h->tail[n++] = *data++;
+			len--;
+			if (n < sizeof word)
+				continue;
+			memcpy(&word, h->tail, sizeof word);
+			n = 0;
+		}
+		h->hash = (h->hash ^ word) * 1099511628211ULL;
+		h->hash ^= h->hash >> 32;
+	}
+}
+
+static uint64_t hash_final(Hash *h) {
+	uint64_t word, hash;
+	size_t n = h->len % sizeof word;
+	memset(h->tail + n, 0, sizeof word - n);
+	memcpy(&word, h->tail, sizeof word);
+	hash = (h->hash ^ word) * 1099511628211ULL;
+	hash = (hash ^ h->len) * 1099511628211ULL;
+	return hash ^ (hash >> 32);
+}
+
+static void *undo_reserve(UndoWriter *w, size_t len) {
+	if (w->size - w->len < len) {
+		size_t size = MAX(2 * w->size, w->len + len);
+		char *data = realloc(w->data, size);
+		if (!data)
+			return NULL;
+		w->data = data;
+		w->size = size;
+	}
+	void *ptr = memset(w->data + w->len, 0, len);
+	w->len += len;
+	return ptr;
+}
+
+/* start assembling a new record, the returned pointer is only valid until the next reservation */
+static void *undo_record(UndoWriter *w, size_t len) {
+	w->len = 0;
+	UndoRecord *r = undo_reserve(w, sizeof *r + len);
+	return r ? r + 1 : NULL;
+}
+
+static bool undo_flush(UndoWriter *w, uint32_t type, uint32_t count) {
+	if (!undo_reserve(w, undo_align(w->len, 8) - w->len))
+		return false;
+	UndoRecord *r = (UndoRecord*)w->data;
+	r->type = type;
+	r->count = count;
+	r->size = w->len;
+	if (write_all(w->fd, w->data, w->len) != (ssize_t)w->len)
+		return false;
+	w->off += w->len;
+	return true;
+}
+
+static int undo_chunk_cmp(const void *a, const void *b) {
+	const char *s1 = ((const UndoChunk*)a)->start, *s2 = ((const UndoChunk*)b)->start;
+	return s1 < s2 ? -1 : s1 > s2;
+}
+
+/* determine the allocation order of all pieces */
+static bool undo_chunks(UndoWriter *w) {
+	Slab *slab = &w->txt->pieces;
+	size_t count = 0, id = UNDO_END + 1;
+	for (SlabChunk *chunk = slab->chunks; chunk; chunk = chunk->next)
+		count++;
+	if (!(w->chunks = calloc(count, sizeof *w->chunks)) ||
+	    !(w->sorted = calloc(count, sizeof *w->sorted)))
+		return false;
+	w->chunk_count = count;
+	for (SlabChunk *chunk = slab->chunks; chunk; chunk = chunk->next) {
+		UndoChunk *c = &w->chunks[--count];
+		c->start = (const char*)(chunk + 1);
+		c->count = (chunk == slab->chunks ? slab->used : chunk->size) / slab->size;
+	}
+	for (size_t i = 0; i < w->chunk_count; i++) {
+		w->chunks[i].id = id;
+		id += w->chunks[i].count;
+	}
+	memcpy(w->sorted, w->chunks, w->chunk_count * sizeof *w->sorted);
+	qsort(w->sorted, w->chunk_count, sizeof *w->sorted, undo_chunk_cmp);
+	return true;
+}
+
+static uint32_t undo_piece_id(UndoWriter *w, const Piece *p) {
+	if (!p)
+		return UNDO_NONE;
+	if (p == &w->txt->begin)
+		return UNDO_BEGIN;
+	if (p == &w->txt->end)
+		return UNDO_END;
+	size_t lo = 0, hi = w->chunk_count;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if ((const char*)p < w->sorted[mid].start)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	const UndoChunk *c = &w->sorted[lo - 1];
+	return c->id + ((const char*)p - c->start) / sizeof *p;
+}
+
+/* store buffer data starting at the page aligned offset `off' */
+static bool undo_data(UndoWriter *w, Buffer *buf, size_t off, size_t len, size_t page) {
+	size_t data = undo_align(w->off + sizeof(UndoRecord) + sizeof(UndoData), page);
+	size_t end = undo_align(data + len, 8);
+	/* restored file content is only copied for the range needed */
+	if (buf->type == DECODED)
+		buffer_decode(buf, off, len);
+	const char *content = buf->type == DECODED ? buf->data : buffer_data(buf);
+	UndoData *d = undo_record(w, sizeof *d);
+	if (!d || !content)
+		return false;
+	*d = (UndoData){ .buf = buf->id, .off = off, .len = len, .data = data };
+	UndoRecord *r = (UndoRecord*)w->data;
+	*r = (UndoRecord){ .type = UNDO_DATA, .size = end - w->off };
+	static const char zero[8];
+	if (write_all(w->fd, w->data, w->len) != (ssize_t)w->len ||
+	    lseek(w->fd, data, SEEK_SET) == -1 ||
+	    write_all(w->fd, content + off, len) != (ssize_t)len ||
+	    write_all(w->fd, zero, end - data - len) != (ssize_t)(end - data - len))
+		return false;
+	w->off = end;
+	return true;
+}
+
+/* whether the buffer holds file content, whose parts forming the saved file
+ * are not stored but referred to by position. besides mapped files these are
+ * the buffers restored from such references by a previous session */
+static bool undo_mapped(Text *txt, Buffer *buf) {
+	return txt->encoding == TEXT_ENCODING_UTF8 && ((buf->type == MMAP && buf->fd != -1) ||
+	       (buf->type == DECODED && buf->encoding == TEXT_ENCODING_UTF8));
+}
+
+/* mark the pages holding the given buffer range as stored */
+static bool undo_pages_mark(Buffer *buf, size_t off, size_t len, size_t page) {
+	size_t pages = (buf->size + page - 1) / page;
+	if (!buf->undo_pages && !(buf->undo_pages = calloc((pages + 63) / 64, sizeof *buf->undo_pages)))
+		return false;
+	for (size_t i = off / page; i < (off + len + page - 1) / page; i++)
+		buf->undo_pages[i / 64] |= 1ULL << i % 64;
+	return true;
+}
+
+/* store the pages of a buffer holding the given range, unless done by a previous write */
+static bool undo_pages(UndoWriter *w, Buffer *buf, size_t off, size_t len, size_t page) {
+	if (!undo_pages_mark(buf, 0, 0, page))
+		return false;
+	uint64_t *map = buf->undo_pages;
+	for (size_t i = off / page, last = (off + len - 1) / page, j; i <= last; i = j) {
+		for (j = i; j <= last && !(map[j / 64] & (1ULL << j % 64)); j++);
+		if (j == i) {
+			j++;
+			continue;
+		}
+		size_t start = i * page, end = MIN(j * page, buf->len);
+		if (!undo_data(w, buf, start, end - start, page) || !undo_pages_mark(buf, start, end - start, page))
+			return false;
+	}
+	return true;
+}
+
+static bool undo_file_add(UndoWriter *w, uint32_t buf, size_t off, size_t len, size_t pos) {
+	if (w->file_count == w->file_size) {
+		size_t size = w->file_size ? 2 * w->file_size : 64;
+		UndoFile *files = realloc(w->files, size * sizeof *files);
+		if (!files)
+			return false;
+		w->files = files;
+		w->file_size = size;
+	}
+	w->files[w->file_count++] = (UndoFile){ .buf = buf, .off = off, .len = len, .pos = pos };
+	return true;
+}
+
+static int undo_file_cmp(const void *a, const void *b) {
+	const UndoFile *f1 = a, *f2 = b;
+	if (f1->buf != f2->buf)
+		return f1->buf < f2->buf ? -1 : 1;
+	return f1->off < f2->off ? -1 : f1->off > f2->off;
+}
+
+/* sort the ranges and drop the parts listed more than once */
+static void undo_files_sort(UndoWriter *w) {
+	size_t count = 0;
+	if (w->file_count)
+		qsort(w->files, w->file_count, sizeof *w->files, undo_file_cmp);
+	for (size_t i = 0; i < w->file_count; i++) {
+		UndoFile f = w->files[i];
+		if (count && w->files[count-1].buf == f.buf) {
+			size_t end = (size_t)w->files[count-1].off + w->files[count-1].len;
+			if (f.off + f.len <= end)
+				continue;
+			if (f.off < end) {
+				f.pos += end - f.off;
+				f.len -= end - f.off;
+				f.off = end;
+			}
+		}
+		w->files[count++] = f;
+	}
+	w->file_count = count;
+}
+
+/* index of the first range following the given buffer offset */
+static size_t undo_file_next(const UndoFile *files, size_t count, uint32_t buf, size_t off) {
+	size_t lo = 0, hi = count;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (files[mid].buf < buf || (files[mid].buf == buf && files[mid].off <= off))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* find the range of the saved file holding the given buffer data, if any */
+static const UndoFile *undo_file_find(const UndoFile *files, size_t count, uint32_t buf, size_t off, size_t len) {
+	size_t i = undo_file_next(files, count, buf, off);
+	if (i == 0)
+		return NULL;
+	const UndoFile *f = &files[i-1];
+	if (f->buf != buf || off + len > (size_t)f->off + f->len)
+		return NULL;
+	return f;
+}
+
+/* the buffer range a piece is stored as, ranges of the loaded file are
+ * stored as the restored buffer range they were taken from */
+static Buffer *undo_piece_range(Text *txt, const Piece *p, size_t *off) {
+	size_t lo = 0, hi = txt->undo_move_count;
+	*off = p->off;
+	if (!p->buf)
+		return NULL;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		const UndoMove *m = &txt->undo_moves[mid];
+		if (m->buf < p->buf || (m->buf == p->buf && m->off <= p->off))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	const UndoMove *m = lo ? &txt->undo_moves[lo-1] : NULL;
+	if (!m || m->buf != p->buf || p->off + p->len > (size_t)m->off + m->len)
+		return txt->buffer_table[p->buf];
+	*off = m->orig_off + (p->off - m->off);
+	return txt->buffer_table[m->orig];
+}
+
+/* store the parts of the buffer range which are not part of the saved file */
+static bool undo_cover(UndoWriter *w, Buffer *buf, size_t off, size_t len, size_t page) {
+	size_t end = off + len, i = undo_file_next(w->files, w->file_count, buf->id, off);
+	if (i && w->files[i-1].buf == buf->id)
+		i--;
+	for (; off < end; i++) {
+		const UndoFile *f = i < w->file_count && w->files[i].buf == buf->id ? &w->files[i] : NULL;
+		size_t next = f ? MIN((size_t)f->off, end) : end;
+		if (off < next && !undo_pages(w, buf, off, next - off, page))
+			return false;
+		if (!f)
+			break;
+		off = MAX(off, MIN((size_t)f->off + f->len, end));
+	}
+	return true;
+}
+
+/* list the ranges of mapped buffers forming the text, which has to be in the
+ * saved state, and store the pages used by any other pieces */
+static bool undo_files(UndoWriter *w, size_t page) {
+	Text *txt = w->txt;
+	size_t pos = 0;
+	for (Piece *p = txt->begin.next; p != &txt->end; pos += p->len, p = p->next) {
+		size_t start;
+		Buffer *buf = p->len ? undo_piece_range(txt, p, &start) : NULL;
+		if (!buf || !undo_mapped(txt, buf))
+			continue;
+		/* files are loaded in chunks of BUFFER_MAX, which the ranges must not cross */
+		for (size_t off = 0, len; off < p->len; off += len) {
+			len = MIN(p->len - off, BUFFER_MAX - (pos + off) % BUFFER_MAX);
+			if (!undo_file_add(w, buf->id, start + off, len, pos + off))
+				return false;
+		}
+	}
+	undo_files_sort(w);
+	/* the remaining data of all pieces is stored */
+	for (size_t i = 0; i < w->chunk_count; i++) {
+		const UndoChunk *c = &w->chunks[i];
+		for (const Piece *p = (const Piece*)c->start; p < (const Piece*)c->start + c->count; p++) {
+			size_t off;
+			Buffer *buf = p->len ? undo_piece_range(txt, p, &off) : NULL;
+			if (buf && undo_mapped(txt, buf) && !undo_cover(w, buf, off, p->len, page))
+				return false;
+		}
+	}
+	UndoFile *f = undo_record(w, w->file_count * sizeof *f);
+	if (!f)
+		return false;
+	if (w->file_count)
+		memcpy(f, w->files, w->file_count * sizeof *f);
+	return undo_flush(w, UNDO_FILE, w->file_count);
+}
+
+/* store all pieces allocated since the last write */
+static bool undo_pieces(UndoWriter *w) {
+	size_t id = w->txt->undo_pieces + UNDO_END + 1;
+	for (size_t i = 0; i < w->chunk_count; i++) {
+		const UndoChunk *c = &w->chunks[i];
+		if (id >= c->id + c->count)
+			continue;
+		size_t first = id - c->id, count = c->count - first;
+		UndoPiece *u = undo_record(w, count * sizeof *u);
+		if (!u)
+			return false;
+		for (const Piece *p = (const Piece*)c->start + first; p < (const Piece*)c->start + c->count; p++, u++) {
+			size_t off;
+			Buffer *buf = undo_piece_range(w->txt, p, &off);
+			*u = (UndoPiece){ .buf = buf ? buf->id : 0, .off = off, .len = p->len };
+		}
+		if (!undo_flush(w, UNDO_PIECES, count))
+			return false;
+		id += count;
+	}
+	return true;
+}
+
+/* store the pieces of the current text, which is in the state of the first action */
+static bool undo_root(UndoWriter *w) {
+	Text *txt = w->txt;
+	uint32_t count = 0;
+	if (!undo_record(w, 0))
+		return false;
+	for (Piece *p = txt->begin.next; p != &txt->end; p = p->next, count++) {
+		uint32_t *id = undo_reserve(w, sizeof *id);
+		if (!id)
+			return false;
+		*id = undo_piece_id(w, p);
+	}
+	return undo_flush(w, UNDO_ROOT, count);
+}
+
+/* add a change to the action record, the text has to be in the state right after it */
+static bool undo_change(UndoWriter *w, Change *c) {
+	uint32_t count = 0;
+	for (Piece *p = c->new.start; p; p = p->next) {
+		count++;
+		if (p == c->new.end)
+			break;
+	}
+	UndoChange *u = undo_reserve(w, sizeof *u + undo_align(count * sizeof(uint32_t), 8));
+	if (!u)
+		return false;
+	u->pos = c->pos;
+	u->old_len = c->old.len;
+	u->old_start = undo_piece_id(w, c->old.start);
+	u->old_end = undo_piece_id(w, c->old.end);
+	u->new_prev = undo_piece_id(w, c->new.start ? c->new.start->prev : NULL);
+	u->new_next = undo_piece_id(w, c->new.end ? c->new.end->next : NULL);
+	u->new_count = count;
+	uint32_t *id = (uint32_t*)(u + 1);
+	for (Piece *p = c->new.start; p; p = p->next) {
+		*id++ = undo_piece_id(w, p);
+		if (p == c->new.end)
+			break;
+	}
+	return true;
+}
+
+/* store an action by redoing its changes one after another starting from the
+ * state of its parent, thereby recording the links of the new spans */
+static bool undo_action(UndoWriter *w, Action *a) {
+	Text *txt = w->txt;
+	UndoAction *u = undo_record(w, sizeof *u);
+	if (!u)
+		return false;
+	u->seq = a->seq;
+	u->prev = a->prev ? a->prev->seq : UINT64_MAX;
+	u->time = a->time;
+	if (a->prev) {
+		if (txt->history != a->prev)
+			history_traverse_to(txt, a->prev);
+		a->prev->next = a;
+	}
+	uint32_t count = 0;
+	bool success = true;
+	Change *first = change_reverse(a->change);
+	for (Change *c = first; c; c = c->next, count++) {
+		if (a->prev)
+			span_swap(txt, &c->old, &c->new);
+		success = success && undo_change(w, c);
+	}
+	a->change = change_reverse(first);
+	if (a->prev)
+		txt->history = a;
+	return success && undo_flush(w, UNDO_ACTION, count);
+}
+
+bool text_history_save(Text *txt, const char *filename) {
+	UndoWriter w = { .txt = txt, .fd = -1 };
+	Action **next = NULL, *history;
+	size_t count = 0, page = sysconf(_SC_PAGESIZE);
+	struct stat info;
+	int saved_errno;
+	bool success = false;
+
+	text_snapshot(txt);
+	history = txt->history;
+	/* an unmodified text has no history worth keeping */
+	if (txt->last_action->seq == 0 && !txt->undo_size)
+		return true;
+	if (txt->pieces.count >= UNDO_NONE - UNDO_END - 1) {
+		errno = EOVERFLOW;
+		return false;
+	}
+	/* the history is traversed back to the current state, there is nothing to journal */
+	Journal *journal = txt->journal;
+	txt->journal = NULL;
+	if ((w.fd = open(filename, O_RDWR|O_CREAT, S_IRUSR|S_IWUSR)) == -1)
+		goto err;
+	if (fstat(w.fd, &info) == -1)
+		goto err;
+	if (!txt->undo_size || (size_t)info.st_size < txt->undo_size ||
+	    info.st_dev != txt->undo_info.st_dev || info.st_ino != txt->undo_info.st_ino) {
+		/* start over with a new file, the old one is not truncated since
+		 * a restored history might still map its buffers from it */
+		close(w.fd);
+		if ((unlink(filename) == -1 && errno != ENOENT) ||
+		    (w.fd = open(filename, O_RDWR|O_CREAT|O_EXCL, S_IRUSR|S_IWUSR)) == -1)
+			goto err;
+		txt->undo_pieces = txt->undo_actions = 0;
+		for (size_t id = 1; id < txt->buffer_count; id++) {
+			Buffer *buf = txt->buffer_table[id];
+			buf->undo_len = 0;
+			free(buf->undo_pages);
+			buf->undo_pages = NULL;
+		}
+		UndoHeader header = { .magic = UNDO_MAGIC, .order = UNDO_ORDER, .page = page };
+		if (write_all(w.fd, (const char*)&header, sizeof header) != sizeof header)
+			goto err;
+		w.off = sizeof header;
+	} else {
+		/* drop the remains of an interrupted write */
+		if (ftruncate(w.fd, txt->undo_size) == -1 ||
+		    lseek(w.fd, txt->undo_size, SEEK_SET) == -1)
+			goto err;
+		w.off = txt->undo_size;
+	}
+	/* should anything fail from here on, the next write starts over */
+	txt->undo_size = 0;
+
+	for (size_t id = 1; id < txt->buffer_count; id++) {
+		Buffer *buf = txt->buffer_table[id];
+		/* the mapped source of transcoded content is not referred to by pieces */
+		if ((buf == txt->buf && txt->encoding != TEXT_ENCODING_UTF8) ||
+		    undo_mapped(txt, buf) || buf->undo_len >= buf->len)
+			continue;
+		/* starting from the page holding the first new byte */
+		size_t off = buf->undo_len / page * page;
+		if (!undo_data(&w, buf, off, buf->len - off, page))
+			goto err;
+		buf->undo_len = buf->len;
+	}
+	if (!undo_chunks(&w) || !undo_pieces(&w))
+		goto err;
+
+	/* traversing the history changes the branches taken by redo, remember them */
+	count = txt->actions.count;
+	if (!(next = calloc(count, sizeof *next)))
+		goto err;
+	for (size_t seq = 0; seq < count; seq++)
+		next[seq] = txt->action_table[seq]->next;
+	for (size_t seq = txt->undo_actions; seq < count; seq++) {
+		Action *a = txt->action_table[seq];
+		if (!a->prev) {
+			history_traverse_to(txt, a);
+			if (!undo_root(&w))
+				goto err;
+		}
+		if (!undo_action(&w, a))
+			goto err;
+	}
+
+	history_traverse_to(txt, txt->saved_action);
+	if (!undo_files(&w, page))
+		goto err;
+	UndoState *state = undo_record(&w, sizeof *state);
+	if (!state)
+		goto err;
+	*state = (UndoState){
+		.saved = txt->saved_action->seq,
+		.buffers = txt->buffer_count - 1,
+		.size = txt->size,
+		.dev = txt->info.st_dev,
+		.ino = txt->info.st_ino,
+		.mtime = txt->info.st_mtime,
+		.hash = text_hash(txt),
+	};
+	if (!undo_flush(&w, UNDO_STATE, 0) || fsync(w.fd) == -1 || fstat(w.fd, &txt->undo_info) == -1)
+		goto err;
+
+	txt->undo_size = w.off;
+	txt->undo_pieces = txt->pieces.count;
+	txt->undo_actions = count;
+	success = true;
+err:
+	saved_errno = errno;
+	if (next) {
+		history_traverse_to(txt, history);
+		for (size_t seq = 0; seq < count; seq++)
+			txt->action_table[seq]->next = next[seq];
+	}
+	txt->journal = journal;
+	if (w.fd != -1)
+		close(w.fd);
+	free(next);
+	free(w.data);
+	free(w.chunks);
+	free(w.sorted);
+	free(w.files);
+	errno = saved_errno;
+	return success;
+}
+
+static bool undo_piece_get(Piece **pieces, size_t count, uint32_t id, Piece **p) {
+	if (id == UNDO_NONE)
+		*p = NULL;
+	else if (id < count)
+		*p = pieces[id];
+	else
+		return false;
+	return true;
+}
+
+/* link the pieces of a new span as they were when the change was performed */
+static bool undo_span(const UndoChange *u, Piece **pieces, size_t count, Span *span) {
+	const uint32_t *id = (const uint32_t*)(u + 1);
+	Piece *prev, *next, *p = NULL;
+	*span = (Span){ 0 };
+	if (u->new_count == 0)
+		return true;
+	if (!undo_piece_get(pieces, count, u->new_prev, &prev) || !prev ||
+	    !undo_piece_get(pieces, count, u->new_next, &next) || !next)
+		return false;
+	for (uint32_t i = 0; i < u->new_count; i++, prev = p) {
+		if (id[i] <= UNDO_END || id[i] >= count)
+			return false;
+		p = pieces[id[i]];
+		p->prev = prev;
+		if (i > 0)
+			prev->next = p;
+		span->len += p->len;
+	}
+	p->next = next;
+	span->start = pieces[id[0]];
+	span->end = p;
+	return true;
+}
+
+/* refer to a buffer of the loaded file from the text being restored, which
+ * only takes it over once the history was restored successfully */
+static bool undo_buffer_take(Text *new, Buffer *buf, uint32_t *id) {
+	size_t count = new->buffer_count ? new->buffer_count : 1;
+	Buffer **table = realloc(new->buffer_table, (count + 1) * sizeof *table);
+	if (!table)
+		return false;
+	table[0] = NULL;
+	table[count] = buf;
+	new->buffer_table = table;
+	new->buffer_count = count + 1;
+	*id = count;
+	return true;
+}
+
+static bool undo_move_add(Text *new, size_t *size, uint32_t buf, size_t off, size_t len, uint32_t orig, size_t orig_off) {
+	UndoMove *m = new->undo_move_count ? &new->undo_moves[new->undo_move_count-1] : NULL;
+	if (m && m->buf == buf && m->off + m->len == off && m->orig == orig && m->orig_off + m->len == orig_off) {
+		m->len += len;
+		return true;
+	}
+	if (new->undo_move_count == *size) {
+		size_t new_size = *size ? 2 * *size : 64;
+		UndoMove *moves = realloc(new->undo_moves, new_size * sizeof *moves);
+		if (!moves)
+			return false;
+		new->undo_moves = moves;
+		*size = new_size;
+	}
+	new->undo_moves[new->undo_move_count++] = (UndoMove){
+		.buf = buf, .off = off, .len = len, .orig = orig, .orig_off = orig_off,
+	};
+	return true;
+}
+
+static int undo_move_cmp(const void *a, const void *b) {
+	const UndoMove *m1 = a, *m2 = b;
+	if (m1->buf != m2->buf)
+		return m1->buf < m2->buf ? -1 : 1;
+	return m1->off < m2->off ? -1 : m1->off > m2->off;
+}
+
+/* restore the buffer ranges found in the loaded file by copying them from
+ * there once needed, the buffers of the loaded file thus referred to are
+ * marked in `moved' and the ranges taken from them are recorded, such that
+ * pieces referring to them are later stored as part of the restored buffer */
+static bool undo_file_chunks(Text *txt, Text *new, size_t *moves, Buffer *buf, uint32_t id,
+                             const UndoFile *files, size_t count, uint32_t *moved) {
+	DecodeChunk *chunks = NULL;
+	size_t chunk_count = 0, size = 0;
+	for (const UndoFile *f = files; f < files + count; f++) {
+		for (size_t off = 0, len; off < f->len; off += len) {
+			Location loc = piece_get_extern(txt, f->pos + off);
+			const char *data = loc.piece ? piece_data(txt, loc.piece) : NULL;
+			if (!data)
+				goto err;
+			len = MIN(MIN(f->len - off, loc.piece->len - loc.off), DECODE_CHUNK);
+			if (chunk_count == size) {
+				size = size ? 2 * size : 16;
+				DecodeChunk *new_chunks = realloc(chunks, size * sizeof *chunks);
+				if (!new_chunks)
+					goto err;
+				chunks = new_chunks;
+			}
+			chunks[chunk_count++] = (DecodeChunk){
+				.src = data + loc.off, .src_len = len,
+				.off = f->off + off, .len = len,
+			};
+			if (!moved[loc.piece->buf])
+				moved[loc.piece->buf] = UINT32_MAX;
+			if (!undo_move_add(new, moves, loc.piece->buf, loc.piece->off + loc.off, len, id, f->off + off))
+				goto err;
+		}
+	}
+	buf->chunks = chunks;
+	buf->chunk_count = chunk_count;
+	return true;
+err:
+	free(chunks);
+	return false;
+}
+
+bool text_history_load(Text *txt, const char *filename) {
+	Text *new = NULL;
+	Piece **pieces = NULL;
+	size_t *lens = NULL;
+	uint32_t *moved = NULL;
+	const UndoFile *files = NULL;
+	size_t file_count = 0, moves = 0;
+	char *map = MAP_FAILED;
+	int fd = -1, zero = -1, saved_errno;
+	size_t size = 0, begin = 0, end = 0, page = sysconf(_SC_PAGESIZE);
+	size_t buffer_count, piece_count = UNDO_END + 1, action_count = 0;
+	const UndoState *state = NULL;
+	const UndoRecord *root = NULL;
+	struct stat info;
+	bool success = false;
+
+	/* the history has to start from the file content as loaded and the
+	 * buffers are replaced, hence they must not be referenced elsewhere */
+	snapshot_invalidate(txt);
+	if (txt->current_action || txt->last_action->seq != 0 ||
+	    __atomic_load_n(&txt->refs, __ATOMIC_ACQUIRE) != 1) {
+		errno = EBUSY;
+		return false;
+	}
+	if ((fd = open(filename, O_RDONLY)) == -1 || fstat(fd, &info) == -1)
+		goto out;
+	size = info.st_size;
+	if (size < sizeof(UndoHeader))
+		goto invalid;
+	if ((map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+		goto out;
+	const UndoHeader *header = (const UndoHeader*)map;
+	if (memcmp(header->magic, UNDO_MAGIC, sizeof header->magic) ||
+	    header->order != UNDO_ORDER || header->page != page)
+		goto invalid;
+
+	/* find the start and end of the last complete write */
+	for (size_t off = sizeof *header, start = off; size - off >= sizeof(UndoRecord); ) {
+		const UndoRecord *r = (const UndoRecord*)(map + off);
+		if (r->size < sizeof *r || r->size % 8 || r->size > size - off)
+			break;
+		off += r->size;
+		if (r->type == UNDO_STATE && r->size >= sizeof *r + sizeof *state) {
+			state = (const UndoState*)(r + 1);
+			begin = start;
+			end = start = off;
+		}
+	}
+	if (!state || state->buffers >= UINT32_MAX)
+		goto invalid;
+	/* the history is only valid for the file content it was saved with */
+	if (state->size != txt->size)
+		goto invalid;
+	if ((state->dev != (uint64_t)txt->info.st_dev || state->ino != (uint64_t)txt->info.st_ino ||
+	     state->mtime != txt->info.st_mtime) && state->hash != text_hash(txt))
+		goto invalid;
+
+	buffer_count = state->buffers;
+	if (!(lens = calloc(buffer_count + 1, sizeof *lens)))
+		goto out;
+	for (size_t off = sizeof *header; off < end; ) {
+		const UndoRecord *r = (const UndoRecord*)(map + off);
+		size_t payload = r->size - sizeof *r;
+		switch (r->type) {
+		case UNDO_DATA: {
+			const UndoData *d = (const UndoData*)(r + 1);
+			if (payload < sizeof *d || d->buf == 0 || d->buf > buffer_count ||
+			    d->off % page || d->off > BUFFER_MAX || d->len > BUFFER_MAX ||
+			    d->data % page || d->data < off || d->data > off + r->size ||
+			    d->len > off + r->size - d->data)
+				goto invalid;
+			lens[d->buf] = MAX(lens[d->buf], d->off + d->len);
+			break;
+		}
+		case UNDO_PIECES:
+			if (payload / sizeof(UndoPiece) < r->count)
+				goto invalid;
+			piece_count += r->count;
+			break;
+		case UNDO_ROOT:
+			if (payload / sizeof(uint32_t) < r->count)
+				goto invalid;
+			root = r;
+			break;
+		case UNDO_ACTION:
+			if (payload < sizeof(UndoAction))
+				goto invalid;
+			action_count++;
+			break;
+		case UNDO_FILE:
+			if (payload / sizeof(UndoFile) < r->count)
+				goto invalid;
+			/* the ranges of previous writes refer to other file content */
+			if (off < begin)
+				break;
+			files = (const UndoFile*)(r + 1);
+			file_count = r->count;
+			for (const UndoFile *f = files, *prev = NULL; f < files + file_count; prev = f++) {
+				if (f->buf == 0 || f->buf > buffer_count || f->len == 0 ||
+				    f->off > BUFFER_MAX || f->len > BUFFER_MAX - f->off ||
+				    f->pos > txt->size || f->len > txt->size - f->pos ||
+				    txt->encoding != TEXT_ENCODING_UTF8 || (prev && (prev->buf > f->buf ||
+				    (prev->buf == f->buf && (size_t)prev->off + prev->len > f->off))))
+					goto invalid;
+				lens[f->buf] = MAX(lens[f->buf], (size_t)f->off + f->len);
+			}
+			break;
+		}
+		off += r->size;
+	}
+	if (!root || action_count == 0 || state->saved >= action_count || piece_count >= UNDO_NONE)
+		goto invalid;
+
+	/* restore the history into a new text instance */
+	if (!(new = calloc(1, sizeof *new)))
+		goto out;
+	slab_init(&new->pieces, sizeof(Piece));
+	slab_init(&new->changes, sizeof(Change));
+	slab_init(&new->actions, sizeof(Action));
+	slab_init(&new->nodes, sizeof(Node));
+	new->seed = txt->seed;
+	new->history_fd = -1;
+	new->refs = 1;
+	piece_init(&new->begin, NULL, &new->end, 0, 0, 0);
+	piece_init(&new->end, &new->begin, NULL, 0, 0, 0);
+	if (!(pieces = calloc(piece_count, sizeof *pieces)) ||
+	    !(moved = calloc(txt->buffer_count, sizeof *moved)))
+		goto out;
+	pieces[UNDO_BEGIN] = &new->begin;
+	pieces[UNDO_END] = &new->end;
+	piece_count = UNDO_END + 1;
+
+	/* reserve the address range of each buffer, its data is then mapped into it.
+	 * buffers referring to the loaded file copy the data from there on demand */
+	if ((zero = open("/dev/zero", O_RDONLY)) == -1)
+		goto out;
+	for (size_t id = 1, i = 0; id <= buffer_count; id++) {
+		size_t first = i;
+		while (i < file_count && files[i].buf == id)
+			i++;
+		Buffer *buf = calloc(1, sizeof *buf);
+		if (!buf)
+			goto out;
+		buf->type = i > first ? DECODED : MMAP;
+		buf->encoding = TEXT_ENCODING_UTF8;
+		buf->fd = -1;
+		buf->len = buf->undo_len = lens[id];
+		buf->size = undo_align(buf->len, page);
+		int prot = buf->type == DECODED ? PROT_READ|PROT_WRITE : PROT_READ;
+		if (buf->size && (buf->data = mmap(NULL, buf->size, prot, MAP_PRIVATE, zero, 0)) == MAP_FAILED) {
+			free(buf);
+			goto out;
+		}
+		if ((i > first && !undo_file_chunks(txt, new, &moves, buf, id, files + first, i - first, moved)) ||
+		    !buffer_register(new, buf)) {
+			buffer_free(buf);
+			goto out;
+		}
+	}
+	for (size_t id = 1; id < txt->buffer_count; id++) {
+		if (moved[id] && !undo_buffer_take(new, txt->buffer_table[id], &moved[id]))
+			goto out;
+	}
+	for (UndoMove *m = new->undo_moves; m < new->undo_moves + new->undo_move_count; m++)
+		m->buf = moved[m->buf];
+	if (new->undo_move_count)
+		qsort(new->undo_moves, new->undo_move_count, sizeof *new->undo_moves, undo_move_cmp);
+
+	for (size_t off = sizeof *header; off < end; off += ((const UndoRecord*)(map + off))->size) {
+		const UndoRecord *r = (const UndoRecord*)(map + off);
+		switch (r->type) {
+		case UNDO_DATA: {
+			const UndoData *d = (const UndoData*)(r + 1);
+			Buffer *buf = new->buffer_table[d->buf];
+			/* a restored buffer is also copied into, the data is the same */
+			bool restored = buf->type == DECODED;
+			if (d->len && mmap(buf->data + d->off, d->len, restored ? PROT_READ|PROT_WRITE : PROT_READ,
+			                   (restored ? MAP_PRIVATE : MAP_SHARED)|MAP_FIXED, fd, d->data) == MAP_FAILED)
+				goto out;
+			/* which need not be stored again */
+			if (restored && !undo_pages_mark(buf, d->off, d->len, page))
+				goto out;
+			break;
+		}
+		case UNDO_PIECES: {
+			const UndoPiece *u = (const UndoPiece*)(r + 1);
+			for (uint32_t i = 0; i < r->count; i++, u++) {
+				Piece *p = piece_alloc(new);
+				if (!p)
+					goto out;
+				pieces[piece_count++] = p;
+				/* data which is part of the loaded file is referred to directly */
+				const UndoFile *f = u->len ? undo_file_find(files, file_count, u->buf, u->off, u->len) : NULL;
+				Location loc = { 0 };
+				if (f)
+					loc = piece_get_extern(txt, f->pos + (u->off - f->off));
+				if (loc.piece && loc.piece->len - loc.off >= u->len) {
+					uint32_t id = loc.piece->buf;
+					if (!moved[id] && !undo_buffer_take(new, txt->buffer_table[id], &moved[id]))
+						goto out;
+					piece_init(p, NULL, NULL, moved[id], loc.piece->off + loc.off, u->len);
+					continue;
+				}
+				if (u->buf > buffer_count || (u->buf == 0 && u->len) ||
+				    (u->len && (u->off > lens[u->buf] || u->len > lens[u->buf] - u->off)))
+					goto invalid;
+				piece_init(p, NULL, NULL, u->buf, u->off, u->len);
+			}
+			break;
+		}
+		case UNDO_ACTION: {
+			const UndoAction *u = (const UndoAction*)(r + 1);
+			size_t seq = new->actions.count;
+			if (u->seq != seq || (seq == 0) != (u->prev == UINT64_MAX) || (seq && u->prev >= seq))
+				goto invalid;
+			Action *a;
+			if (!action_reserve(new) || !(a = slab_alloc(&new->actions)))
+				goto out;
+			a->seq = seq;
+			a->time = u->time;
+			if (seq) {
+				a->prev = new->action_table[u->prev];
+				a->prev->next = a;
+			}
+			new->action_table[seq] = a;
+			const char *cur = (const char*)(u + 1), *stop = (const char*)r + r->size;
+			for (uint32_t i = 0; i < r->count; i++) {
+				const UndoChange *uc = (const UndoChange*)cur;
+				if ((size_t)(stop - cur) < sizeof *uc ||
+				    uc->new_count > (stop - cur - sizeof *uc) / sizeof(uint32_t))
+					goto invalid;
+				cur += sizeof *uc + undo_align(uc->new_count * sizeof(uint32_t), 8);
+				Change *c = slab_alloc(&new->changes);
+				if (!c)
+					goto out;
+				c->pos = uc->pos;
+				c->old.len = uc->old_len;
+				if (!undo_piece_get(pieces, piece_count, uc->old_start, &c->old.start) ||
+				    !undo_piece_get(pieces, piece_count, uc->old_end, &c->old.end) ||
+				    (uc->old_start <= UNDO_END || uc->old_end <= UNDO_END) ||
+				    (!c->old.start != !c->old.end) || (!c->old.start && c->old.len) ||
+				    !undo_span(uc, pieces, piece_count, &c->new))
+					goto invalid;
+				c->next = a->change;
+				a->change = c;
+			}
+			break;
+		}
+		}
+	}
+
+	/* link the pieces of the first action and redo all actions leading to the saved one */
+	const uint32_t *id = (const uint32_t*)(root + 1);
+	if (!node_reserve(new, root->count))
+		goto out;
+	for (uint32_t i = 0; i < root->count; i++) {
+		Piece *prev = new->end.prev, *p;
+		if (id[i] <= UNDO_END || id[i] >= piece_count || (p = pieces[id[i]])->node)
+			goto invalid;
+		piece_init(p, prev, &new->end, p->buf, p->off, p->len);
+		prev->next = p;
+		new->end.prev = p;
+		tree_insert(new, prev, p);
+		new->size += p->len;
+	}
+	Action *saved = new->action_table[state->saved];
+	new->history = new->action_table[0];
+	new->last_action = new->action_table[action_count-1];
+	for (Action *a = saved; a->prev; a = a->prev)
+		a->prev->next = a;
+	while (new->history != saved) {
+		Action *a = new->history->next;
+		size_t nodes = 0;
+		for (Change *c = a->change; c; c = c->next) {
+			for (Piece *p = c->new.start; p && nodes < piece_count; p = p->next) {
+				nodes++;
+				if (p == c->new.end)
+					break;
+			}
+		}
+		if (!node_reserve(new, nodes))
+			goto out;
+		action_redo(new, a);
+		new->history = a;
+	}
+	new->saved_action = saved;
+	if (new->size != txt->size)
+		goto invalid;
+
+	/* take over the restored history, the pieces refer to the sentinels of the new instance */
+	for (SlabChunk *chunk = new->pieces.chunks; chunk; chunk = chunk->next) {
+		Piece *p = (Piece*)(chunk + 1);
+		Piece *last = p + (chunk == new->pieces.chunks ? new->pieces.used : chunk->size) / sizeof *p;
+		for (; p < last; p++) {
+			if (p->prev == &new->begin)
+				p->prev = &txt->begin;
+			if (p->next == &new->end)
+				p->next = &txt->end;
+		}
+	}
+	scan_adopt(txt, NULL);
+	/* the hashes of the old buffers are of no use for the restored ones */
+	scan_finish(txt->scan);
+	if (txt->scan)
+		txt->scan->hashes_adopted = true;
+	/* the buffers of the loaded file holding parts of the history are moved */
+	for (Buffer **prev = &txt->buffers, *buf; (buf = *prev); ) {
+		if (!moved[buf->id]) {
+			prev = &buf->next;
+			continue;
+		}
+		*prev = buf->next;
+		buf->id = moved[buf->id];
+		buf->next = new->buffers;
+		new->buffers = buf;
+	}
+	Text old = *txt;
+	*txt = *new;
+	if (txt->begin.next == &new->end)
+		txt->begin.next = &txt->end;
+	if (txt->end.prev == &new->begin)
+		txt->end.prev = &txt->begin;
+	txt->buf = NULL;
+	txt->info = old.info;
+	txt->encoding = old.encoding;
+	txt->bom = old.bom;
+	txt->history_limit = old.history_limit;
+	txt->undo_size = end;
+	txt->undo_pieces = piece_count - UNDO_END - 1;
+	txt->undo_actions = action_count;
+	txt->undo_info = info;
+	txt->journal = old.journal;
+	txt->saved_hash = old.saved_hash;
+	txt->saved_size = old.saved_size;
+	/* the properties of a completed scan remain valid for the same content,
+	 * a pending one is aborted along with the old buffers */
+	if (old.scan && old.scan->adopted)
+		txt->scan = old.scan;
+	*new = old;
+	new->journal = NULL;
+	if (txt->scan)
+		new->scan = NULL;
+	success = true;
+	goto out;
+invalid:
+	errno = EINVAL;
+out:
+	saved_errno = errno;
+	if (map != MAP_FAILED)
+		munmap(map, size);
+	if (fd != -1)
+		close(fd);
+	if (zero != -1)
+		close(zero);
+	free(lens);
+	free(pieces);
+	free(moved);
+	text_free(new);
+	errno = saved_errno;
+	return success;
+}
+
+/* The journal allows to recover the modifications of a text after a crash.
+ * It starts with a header identifying the file content they apply to, by
+ * its size and modification time, followed by a record for every change
+ * in the order they were performed. Each record states a position, the
+ * number of bytes deleted there and the data inserted in their place. It
+ * is protected by a hash, such that a partially written record at the end
+ * of the journal is detected and ignored. Records are gathered in memory
+ * and written upon text_journal_flush or once enough accumulated. Until
+ * then a record can be extended by subsequent adjacent modifications,
+ * typing thus results in one record per flush rather than per character.
+ *
+ * Modifications are recorded where spans are swapped, which covers undo and
+ * redo. The spans are compared piece by piece: data referenced by both is
+ * unchanged, everything else was deleted from the old or inserted by the new
+ * one. Hence a split piece does not cause its whole content to be recorded.
+ */
+
+#define JOURNAL_MAGIC "VISJRNL1"
+
+typedef struct {
+	char magic[8];          /* JOURNAL_MAGIC */
+	uint32_t order;         /* UNDO_ORDER */
+	uint32_t unused;
+	uint64_t size;          /* file information of the content modified by the records */
+	int64_t mtime;
+} JournalHeader;
+
+typedef struct {
+	uint64_t pos;           /* position of the modification */
+	uint64_t deleted;       /* number of bytes deleted at pos */
+	uint64_t inserted;      /* number of bytes inserted at pos, following the record */
+	uint64_t hash;          /* of the fields above and the inserted data */
+} JournalRecord;
+
+struct Journal {
+	int fd;                 /* journal file, written at its end */
+	char *filename;
+	size_t size;            /* number of bytes written to it */
+	char *data;             /* records not yet written, JOURNAL_BUFFER bytes */
+	size_t len;             /* number of bytes used */
+	size_t last;            /* offset of the last record in data, EPOS if there is none */
+	JournalRecord rec;      /* last record, stored at `last' once it can no longer grow */
+	struct iovec *iov;      /* inserted data of the record being assembled */
+	size_t iov_count, iov_size;
+	bool pending;           /* whether records were added since the last fsync(2) */
+	bool failed;            /* whether a write failed, no further records are added */
+};
+
+static uint64_t journal_hash(const JournalRecord *r, const struct iovec *iov, size_t count) {
+	Hash h;
+	hash_init(&h);
+	hash_update(&h, (const char*)r, offsetof(JournalRecord, hash));
+	for (size_t i = 0; i < count; i++)
+		hash_update(&h, iov[i].iov_base, iov[i].iov_len);
+	return hash_final(&h);
+}
+
+/* complete the last record, only now its hash is computed */
+static void journal_seal(Journal *j) {
+	if (j->last == EPOS)
+		return;
+	struct iovec iov = { .iov_base = j->data + j->last + sizeof j->rec, .iov_len = j->rec.inserted };
+	j->rec.hash = journal_hash(&j->rec, &iov, 1);
+	memcpy(j->data + j->last, &j->rec, sizeof j->rec);
+	j->last = EPOS;
+}
+
+static bool journal_write(Journal *j) {
+	journal_seal(j);
+	if (j->len == 0)
+		return true;
+	ssize_t written = write_all(j->fd, j->data, j->len);
+	if (written == -1 || (size_t)written != j->len)
+		return false;
+	j->size += j->len;
+	j->len = 0;
+	return true;
+}
+
+/* merge a record into the last one if that is still held in memory, as is the
+ * case for consecutively typed or deleted characters */
+static bool journal_merge(Journal *j, const JournalRecord *r, const struct iovec *iov, size_t count) {
+	JournalRecord *last = &j->rec;
+	if (j->last == EPOS)
+		return false;
+	if (r->deleted == 0 && r->pos == last->pos + last->inserted) {
+		/* insertion following the last one */
+		if (JOURNAL_BUFFER - j->len < r->inserted)
+			return false;
+		for (size_t i = 0; i < count; i++) {
+			memcpy(j->data + j->len, iov[i].iov_base, iov[i].iov_len);
+			j->len += iov[i].iov_len;
+		}
+		last->inserted += r->inserted;
+	} else if (r->inserted == 0 && r->pos >= last->pos && r->pos + r->deleted == last->pos + last->inserted) {
+		/* deletion of data inserted by the last one */
+		last->inserted -= r->deleted;
+		j->len -= r->deleted;
+	} else if (r->inserted == 0 && last->inserted == 0 && (r->pos == last->pos || r->pos + r->deleted == last->pos)) {
+		/* deletion adjacent to the last one */
+		last->pos = r->pos;
+		last->deleted += r->deleted;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+/* offset in the journal file following all records added so far, they
+ * are no longer extended such that later ones start there */
+static size_t journal_offset(Journal *j) {
+	journal_seal(j);
+	return j->size + j->len;
+}
+
+static void journal_free(Journal *j) {
+	if (!j)
+		return;
+	if (!j->failed)
+		journal_write(j);
+	close(j->fd);
+	free(j->filename);
+	free(j->data);
+	free(j->iov);
+	free(j);
+}
+
+static void journal_record(Journal *j, size_t pos, size_t deleted, const struct iovec *iov, size_t count) {
+	if (!j || j->failed)
+		return;
+	JournalRecord r = { .pos = pos, .deleted = deleted };
+	for (size_t i = 0; i < count; i++)
+		r.inserted += iov[i].iov_len;
+	j->pending = true;
+	if (journal_merge(j, &r, iov, count))
+		return;
+	size_t size = sizeof r + r.inserted;
+	if (JOURNAL_BUFFER - j->len < size && !journal_write(j))
+		goto err;
+	if (size > JOURNAL_BUFFER) {
+		/* large insertions are written directly */
+		r.hash = journal_hash(&r, iov, count);
+		if (write_all(j->fd, (const char*)&r, sizeof r) != sizeof r)
+			goto err;
+		for (size_t i = 0; i < count; i++) {
+			if (write_all(j->fd, iov[i].iov_base, iov[i].iov_len) != (ssize_t)iov[i].iov_len)
+				goto err;
+		}
+		j->size += size;
+		return;
+	}
+	journal_seal(j);
+	j->last = j->len;
+	j->rec = r;
+	j->len += sizeof r;
+	for (size_t i = 0; i < count; i++) {
+		memcpy(j->data + j->len, iov[i].iov_base, iov[i].iov_len);
+		j->len += iov[i].iov_len;
+	}
+	return;
+err:
+	j->failed = true;
+}
+
+/* record an insertion, typically of a character typed after the last one */
+static void journal_append(Journal *j, size_t pos, const char *data, size_t len) {
+	if (j->last != EPOS && !j->failed && pos == j->rec.pos + j->rec.inserted && JOURNAL_BUFFER - j->len >= len) {
+		memcpy(j->data + j->len, data, len);
+		j->len += len;
+		j->rec.inserted += len;
+		j->pending = true;
+		return;
+	}
+	journal_record(j, pos, 0, &(struct iovec){ .iov_base = (char*)data, .iov_len = len }, 1);
+}
+
+static void journal_insert(Journal *j, const char *data, size_t len) {
+	if (j->iov_count == j->iov_size) {
+		size_t size = j->iov_size ? 2 * j->iov_size : 16;
+		struct iovec *iov = realloc(j->iov, size * sizeof *iov);
+		if (!iov) {
+			j->failed = true;
+			return;
+		}
+		j->iov = iov;
+		j->iov_size = size;
+	}
+	j->iov[j->iov_count++] = (struct iovec){ .iov_base = (char*)data, .iov_len = len };
+}
+
+/* advance past exhausted and empty pieces, NULL at the end of the span */
+static Piece *journal_next(Span *span, Piece *p, size_t *off) {
+	while (p && *off == p->len) {
+		p = p == span->end ? NULL : p->next;
+		*off = 0;
+	}
+	return p;
+}
+
+/* has to be called before the spans are swapped */
+static void journal_swap(Text *txt, Span *old, Span *new) {
+	Journal *j = txt->journal;
+	if (j->failed)
+		return;
+	Piece *o = old->len ? old->start : NULL, *n = new->len ? new->start : NULL;
+	size_t ooff = 0, noff = 0, pos, deleted = 0, inserted = 0;
+	if (o) {
+		pos = tree_pos(o->node);
+	} else {
+		Piece *prev = n->prev;
+		pos = prev->node ? tree_pos(prev->node) + prev->len : 0;
+	}
+	j->iov_count = 0;
+	for (;;) {
+		o = journal_next(old, o, &ooff);
+		n = journal_next(new, n, &noff);
+		if (!o && !n)
+			break;
+		const char *od = o ? piece_data(txt, o) + ooff : NULL;
+		const char *nd = n ? piece_data(txt, n) + noff : NULL;
+		size_t olen = o ? o->len - ooff : 0, nlen = n ? n->len - noff : 0;
+		if (o && n && od == nd) {
+			/* unchanged data referenced by both spans */
+			size_t len = MIN(olen, nlen);
+			if (deleted || inserted)
+				journal_record(j, pos, deleted, j->iov, j->iov_count);
+			pos += inserted + len;
+			deleted = inserted = 0;
+			j->iov_count = 0;
+			ooff += len;
+			noff += len;
+		} else if (o && n && od > nd && od < nd + nlen) {
+			/* inserted data preceding the remaining old one */
+			journal_insert(j, nd, od - nd);
+			inserted += od - nd;
+			noff += od - nd;
+		} else if (o && n && nd > od && nd < od + olen) {
+			/* deleted data preceding the remaining new one */
+			deleted += nd - od;
+			ooff += nd - od;
+		} else if (o && (!n || olen <= nlen)) {
+			deleted += olen;
+			ooff += olen;
+		} else {
+			journal_insert(j, nd, nlen);
+			inserted += nlen;
+			noff += nlen;
+		}
+	}
+	if (deleted || inserted)
+		journal_record(j, pos, deleted, j->iov, j->iov_count);
+}
+
+/* create a journal holding the given records, it replaces `filename' atomically */
+static Journal *journal_new(Text *txt, const char *filename, const char *records, size_t len) {
+	Journal *j = calloc(1, sizeof *j);
+	size_t namelen = strlen(filename) + 1 /* ~ */ + 1 /* \0 */;
+	char *tmpname = malloc(namelen);
+	int saved_errno;
+	if (!j || !tmpname)
+		goto err;
+	j->fd = -1;
+	j->last = EPOS;
+	if (!(j->filename = strdup(filename)) || !(j->data = malloc(JOURNAL_BUFFER)))
+		goto err;
+	snprintf(tmpname, namelen, "%s~", filename);
+	if ((j->fd = open(tmpname, O_RDWR|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR)) == -1)
+		goto err;
+	JournalHeader header = {
+		.magic = JOURNAL_MAGIC,
+		.order = UNDO_ORDER,
+		.size = txt->info.st_size,
+		.mtime = txt->info.st_mtime,
+	};
+	if (write_all(j->fd, (const char*)&header, sizeof header) != sizeof header ||
+	    (len && write_all(j->fd, records, len) != (ssize_t)len) ||
+	    fsync(j->fd) == -1 || rename(tmpname, filename) == -1)
+		goto err;
+	j->size = sizeof header + len;
+	free(tmpname);
+	return j;
+err:
+	saved_errno = errno;
+	if (j && j->fd != -1) {
+		unlink(tmpname);
+		j->failed = true;
+	}
+	free(tmpname);
+	journal_free(j);
+	errno = saved_errno;
+	return NULL;
+}
+
+/* start over with the records following offset `keep', the ones before it
+ * are part of the content which was just saved */
+static void journal_restart(Text *txt, size_t keep) {
+	Journal *j = txt->journal, *new = NULL;
+	char *records = NULL;
+	size_t len = 0;
+	if (!j || j->failed || !journal_write(j))
+		goto out;
+	keep = MAX(keep, sizeof(JournalHeader));
+	if (keep < j->size) {
+		len = j->size - keep;
+		if (!(records = malloc(len)) || pread(j->fd, records, len, keep) != (ssize_t)len)
+			goto out;
+	}
+	new = journal_new(txt, j->filename, records, len);
+out:
+	free(records);
+	if (new) {
+		journal_free(j);
+		txt->journal = new;
+	} else if (j) {
+		j->failed = true;
+	}
+}
+
+bool text_journal_open(Text *txt, const char *filename) {
+	if (txt->journal) {
+		errno = EBUSY;
+		return false;
+	}
+	txt->journal = journal_new(txt, filename, NULL, 0);
+	return txt->journal != NULL;
+}
+
+bool text_journal_recover(Text *txt, const char *filename) {
+	struct stat info;
+	char *map = MAP_FAILED;
+	size_t size = 0, off = sizeof(JournalHeader);
+	int fd = -1, saved_errno;
+	bool success = false;
+
+	if (txt->journal || text_modified(txt)) {
+		errno = EBUSY;
+		return false;
+	}
+	if ((fd = open(filename, O_RDWR)) == -1 || fstat(fd, &info) == -1)
+		goto out;
+	size = info.st_size;
+	if (size < sizeof(JournalHeader))
+		goto invalid;
+	if ((map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+		goto out;
+	JournalHeader header;
+	memcpy(&header, map, sizeof header);
+	if (memcmp(header.magic, JOURNAL_MAGIC, sizeof header.magic) || header.order != UNDO_ORDER)
+		goto invalid;
+	/* the journal only applies to the content it was started with */
+	if (header.size != (uint64_t)txt->info.st_size || header.mtime != txt->info.st_mtime ||
+	    (txt->encoding == TEXT_ENCODING_UTF8 && header.size != txt->size))
+		goto invalid;
+
+	for (JournalRecord r; size - off >= sizeof r; off += sizeof r + r.inserted) {
+		memcpy(&r, map + off, sizeof r);
+		if (r.inserted > size - off - sizeof r)
+			break;
+		struct iovec data = { .iov_base = map + off + sizeof r, .iov_len = r.inserted };
+		if (journal_hash(&r, &data, 1) != r.hash)
+			break;
+		if (r.pos > txt->size || r.deleted > txt->size - r.pos)
+			goto invalid;
+		if (!text_delete(txt, r.pos, r.deleted) || !text_insert(txt, r.pos, data.iov_base, r.inserted))
+			goto out;
+	}
+	text_snapshot(txt);
+
+	/* further records are appended, a partially written one is dropped */
+	if (ftruncate(fd, off) == -1 || lseek(fd, off, SEEK_SET) == -1)
+		goto out;
+	Journal *j = calloc(1, sizeof *j);
+	if (!j)
+		goto out;
+	j->fd = fd;
+	j->size = off;
+	j->last = EPOS;
+	if (!(j->filename = strdup(filename)) || !(j->data = malloc(JOURNAL_BUFFER))) {
+		free(j->filename);
+		free(j);
+		goto out;
+	}
+	txt->journal = j;
+	fd = -1;
+	success = true;
+	goto out;
+invalid:
+	errno = EINVAL;
+out:
+	saved_errno = errno;
+	if (map != MAP_FAILED)
+		munmap(map, size);
+	if (fd != -1)
+		close(fd);
+	errno = saved_errno;
+	return success;
+}
+
+bool text_journal_flush(Text *txt, bool sync) {
+	Journal *j = txt->journal;
+	if (!j)
+		return true;
+	if (!j->failed && !journal_write(j))
+		j->failed = true;
+	if (!j->failed && sync && j->pending) {
+		if (fsync(j->fd) == -1)
+			j->failed = true;
+		else
+			j->pending = false;
+	}
+	if (j->failed) {
+		journal_free(j);
+		txt->journal = NULL;
+		return false;
+	}
+	return true;
+}
+
+bool text_journal_pending(Text *txt) {
+	return txt->journal && txt->journal->pending;
+}
+
+void text_journal_close(Text *txt) {
+	Journal *j = txt->journal;
+	if (!j)
+		return;
+	unlink(j->filename);
+	j->failed = true;
+	journal_free(j);
+	txt->journal = NULL;
+}
+
+/* The new line and hash checkpoints of large files are optionally kept in an
+ * index file, such that the file need not be scanned again when it is opened
+ * next time. The index is identified by the file information of the indexed
+ * content and written by the scanner thread: the header and the new line
+ * checkpoints of all chunks as soon as these are complete, followed by the
+ * hash checkpoints if these are completed as well. It is then renamed into
+ * place. Its checkpoints are relative to the chunks, which are split at the
+ * same offsets whenever the same file is loaded.
+ */
+#define INDEX_MAGIC "VISLINE2"
+
+typedef struct {
+	char magic[8];          /* INDEX_MAGIC */
+	uint32_t order;         /* UNDO_ORDER */
+	uint32_t block;         /* BUFFER_LINES_BLOCK */
+	uint64_t dev, ino;      /* file information of the indexed content */
+	uint64_t size;
+	int64_t mtime, mtime_nsec; /* modification time, a rewrite within the same second changes the latter */
+	uint64_t count;         /* number of checkpoints of all chunks */
+	uint64_t lines;         /* properties as in TextLoadInfo */
+	uint64_t longest_line;
+	uint8_t crlf, binary, utf8;
+	uint8_t newline;        /* scan state at the end of the content, see Scan */
+	uint8_t need, lo, hi, last;
+	uint64_t line;
+	uint32_t hashed;        /* whether the hash checkpoints follow the new line ones */
+	uint32_t unused;
+} IndexHeader;
+
+static size_t index_count(Scan *s) {
+	size_t count = 0;
+	for (size_t i = 0; i < s->count; i++)
+		count += s->chunks[i].len / BUFFER_LINES_BLOCK + 1;
+	return count;
+}
+
+static char *index_tmpname(const char *filename) {
+	size_t namelen = strlen(filename) + 1 /* ~ */ + 1 /* \0 */;
+	char *tmpname = malloc(namelen);
+	if (tmpname)
+		snprintf(tmpname, namelen, "%s~", filename);
+	return tmpname;
+}
+
+/* write the properties and new line checkpoints of a completed scan to a
+ * temporary index file if one was requested, returns its descriptor */
+static int index_begin(Scan *s) {
+	const char *filename = __atomic_load_n(&s->index, __ATOMIC_ACQUIRE);
+	char *tmpname = filename ? index_tmpname(filename) : NULL;
+	int fd = -1;
+	if (!tmpname || (fd = open(tmpname, O_RDWR|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR)) == -1)
+		goto out;
+	IndexHeader header = {
+		.magic = INDEX_MAGIC,
+		.order = UNDO_ORDER,
+		.block = BUFFER_LINES_BLOCK,
+		.dev = s->index_info.st_dev,
+		.ino = s->index_info.st_ino,
+		.size = s->index_info.st_size,
+		.mtime = s->index_info.st_mtim.tv_sec,
+		.mtime_nsec = s->index_info.st_mtim.tv_nsec,
+		.count = index_count(s),
+		.lines = s->info.lines,
+		.longest_line = s->info.longest_line,
+		.crlf = s->info.crlf,
+		.binary = s->info.binary,
+		.utf8 = s->info.utf8,
+		.newline = s->newline,
+		.need = s->need,
+		.lo = s->lo,
+		.hi = s->hi,
+		.last = s->last,
+		.line = s->line,
+	};
+	if (write_all(fd, (const char*)&header, sizeof header) != sizeof header)
+		goto err;
+	for (size_t i = 0; i < s->count; i++) {
+		ScanChunk *c = &s->chunks[i];
+		uint64_t lines[1024];
+		size_t blocks = c->len / BUFFER_LINES_BLOCK + 1;
+		for (size_t j = 0; j < blocks; ) {
+			size_t n = MIN(blocks - j, sizeof lines / sizeof *lines);
+			for (size_t k = 0; k < n; k++)
+				lines[k] = c->lines[j+k];
+			if (write_all(fd, (const char*)lines, n * sizeof *lines) != (ssize_t)(n * sizeof *lines))
+				goto err;
+			j += n;
+		}
+	}
+	goto out;
+err:
+	unlink(tmpname);
+	close(fd);
+	fd = -1;
+out:
+	free(tmpname);
+	return fd;
+}
+
+/* append the hash checkpoints if they were computed, move the index into place */
+static void index_finish(Scan *s, int fd) {
+	if (fd == -1)
+		return;
+	char *tmpname = index_tmpname(s->index);
+	uint32_t hashed = s->hashed;
+	for (size_t i = 0; hashed && i < s->count; i++) {
+		ScanChunk *c = &s->chunks[i];
+		size_t len = (c->len / BUFFER_LINES_BLOCK + 1) * sizeof *c->hashes;
+		if (write_all(fd, (const char*)c->hashes, len) != (ssize_t)len)
+			goto err;
+	}
+	if (hashed && pwrite(fd, &hashed, sizeof hashed, offsetof(IndexHeader, hashed)) != sizeof hashed)
+		goto err;
+	if (!tmpname || fsync(fd) == -1 || close(fd) == -1 || rename(tmpname, s->index) == -1) {
+		fd = -1;
+		goto err;
+	}
+	free(tmpname);
+	return;
+err:
+	if (tmpname)
+		unlink(tmpname);
+	if (fd != -1)
+		close(fd);
+	free(tmpname);
+}
+
+/* take over the checkpoints and properties from the index file, they replace
+ * those of the pending scan which is aborted */
+static bool index_load(Text *txt, int fd) {
+	Scan *s = txt->scan;
+	struct stat info;
+	char *map = MAP_FAILED;
+	size_t size = 0;
+	bool success = false;
+	if (fstat(fd, &info) == -1)
+		goto out;
+	size = info.st_size;
+	if (size < sizeof(IndexHeader))
+		goto invalid;
+	if ((map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+		goto out;
+	const IndexHeader *header = (const IndexHeader*)map;
+	size_t count = index_count(s);
+	if (memcmp(header->magic, INDEX_MAGIC, sizeof header->magic) ||
+	    header->order != UNDO_ORDER || header->block != BUFFER_LINES_BLOCK ||
+	    header->dev != (uint64_t)txt->info.st_dev || header->ino != (uint64_t)txt->info.st_ino ||
+	    header->size != (uint64_t)txt->info.st_size || header->mtime != txt->info.st_mtim.tv_sec ||
+	    header->mtime_nsec != txt->info.st_mtim.tv_nsec ||
+	    header->count != count || (size - sizeof *header) / sizeof(uint64_t) / (header->hashed ? 2 : 1) < count)
+		goto invalid;
+
+	__atomic_store_n(&s->stop, true, __ATOMIC_RELAXED);
+	scan_finish(s);
+	const uint64_t *lines = (const uint64_t*)(header + 1), *hashes = lines + count;
+	bool hashed = header->hashed;
+	for (size_t i = 0; i < s->count; i++) {
+		ScanChunk *c = &s->chunks[i];
+		size_t blocks = c->len / BUFFER_LINES_BLOCK + 1;
+		free(c->lines);
+		free(c->hashes);
+		c->hashes = NULL;
+		if (!(c->lines = malloc(blocks * sizeof *c->lines)))
+			goto out;
+		for (size_t j = 0; j < blocks; j++)
+			c->lines[j] = lines[j];
+		if (hashed && !(c->hashes = malloc(blocks * sizeof *c->hashes)))
+			hashed = false;
+		else if (hashed)
+			memcpy(c->hashes, hashes, blocks * sizeof *c->hashes);
+		lines += blocks;
+		hashes += blocks;
+	}
+	s->info = (TextLoadInfo){
+		.lines = header->lines,
+		.longest_line = header->longest_line,
+		.crlf = header->crlf,
+		.binary = header->binary,
+		.utf8 = header->utf8,
+	};
+	s->newline = header->newline;
+	s->need = header->need;
+	s->lo = header->lo;
+	s->hi = header->hi;
+	s->last = header->last;
+	s->line = header->line;
+	s->complete = true;
+	s->hashed = hashed;
+	scan_adopt(txt, NULL);
+	success = true;
+	goto out;
+invalid:
+	errno = EINVAL;
+out:
+	if (map != MAP_FAILED)
+		munmap(map, size);
+	return success;
+}
+
+bool text_lines_index(Text *txt, const char *filename) {
+	Scan *s = txt->scan;
+	if (!s || !s->threaded || s->adopted || s->index || txt->info.st_size < INDEX_MIN) {
+		errno = ENOTSUP;
+		return false;
+	}
+	int fd = open(filename, O_RDONLY);
+	if (fd != -1) {
+		bool loaded = index_load(txt, fd);
+		close(fd);
+		if (loaded)
+			return true;
+		/* the aborted scan can not be resumed */
+		if (__atomic_load_n(&s->stop, __ATOMIC_RELAXED))
+			return false;
+	}
+	char *index = strdup(filename);
+	if (!index)
+		return false;
+	s->index_info = txt->info;
+	__atomic_store_n(&s->index, index, __ATOMIC_RELEASE);
+	return true;
+}
+
+/* A delete operation can either start/stop midway through a piece or at
+ * a boundry. In the former case a new piece is created to represent the
+ * remaining text before/after the modification point.
+ *
+ *      /-+ --> +---------+ --> +-----+ --> +-----+ --> +-\
+ *      | |     | existing|     |demo |     |text |     | |
+ *      \-+ <-- +---------+ <-- +-----+ <-- +-----+ <-- +-/
+ *                   ^                         ^
+ *                   |------ delete range -----|
+ *
+ *      /-+ --> +----+ --> +--+ --> +-\
  *      | |     | exi|     |t |     | |
  *      \-+ <-- +----+ <-- +--+ <-- +-/
  */
@@ -1101,16 +5209,18 @@ bool text_delete(Text *txt, size_t pos, size_t len) {
 		return true;
 	if (pos + len > txt->size)
 		return false;
-	if (pos < txt->lines.pos)
-		lineno_cache_invalidate(&txt->lines);
 
 	Location loc = piece_get_intern(txt, pos);
 	Piece *p = loc.piece;
 	if (!p)
 		return false;
 	size_t off = loc.off;
-	if (cache_delete(txt, p, off, len))
+	if (cache_delete(txt, p, off, len)) {
+		journal_record(txt->journal, pos, len, NULL, 0);
 		return true;
+	}
+	if (!node_reserve(txt, 2))
+		return false;
 	Change *c = change_alloc(txt, pos);
 	if (!c)
 		return false;
@@ -1152,12 +5262,12 @@ bool text_delete(Text *txt, size_t pos, size_t len) {
 		after = piece_alloc(txt);
 		if (!after)
 			return false;
-		piece_init(after, before, p->next, p->data + p->len - (cur - len), cur - len);
+		piece_init(after, before, p->next, p->buf, p->off + p->len - (cur - len), cur - len);
 	}
 
 	if (midway_start) {
 		/* we finally know which piece follows our newly allocated before piece */
-		piece_init(before, start->prev, after, start->data, off);
+		piece_init(before, start->prev, after, start->buf, start->off, off);
 	}
 
 	Piece *new_start = NULL, *new_end = NULL;
@@ -1184,6 +5294,222 @@ bool text_delete_range(Text *txt, Filerange *r) {
 	return text_delete(txt, r->start, text_range_size(r));
 }
 
+/* Batched edits are only recorded by text_edit_apply and performed upon
+ * commit. After sorting them by position, all edits falling into a run of
+ * adjacent pieces are applied by swapping in a single new span:
+ *
+ *      /-+ --> +-------------------------+ --> +-\
+ *      | |     |one\ntwo\nthree\n        |     | |
+ *      \-+ <-- +-------------------------+ <-- +-/
+ *               ^     ^    ^
+ *               insertion points for "\t"
+ *
+ *      /-+ --> +--+ --> +----+ --> +--+ --> +----+ --> +--+ --> +------+ --> +-\
+ *      | |     |\t|     |one\n|     |\t|     |two\n|     |\t|     |three\n|     | |
+ *      \-+ <-- +--+ <-- +----+ <-- +--+ <-- +----+ <-- +--+ <-- +------+ <-- +-/
+ *
+ * Hence every piece is looked up and replaced at most once, no matter how
+ * many edits it is affected by.
+ */
+void text_edit_begin(Text *txt) {
+	txt->edits_count = 0;
+}
+
+bool text_edit_apply(Text *txt, size_t pos, size_t len, const char *data, size_t data_len) {
+	if (len == 0 && data_len == 0)
+		return true;
+	if (pos > txt->size || len > txt->size - pos)
+		return false;
+	if (data_len > BUFFER_MAX) {
+		/* pieces can not hold more than BUFFER_MAX bytes */
+		return text_edit_apply(txt, pos, len, data, BUFFER_MAX) &&
+		       text_edit_apply(txt, pos + len, 0, data + BUFFER_MAX, data_len - BUFFER_MAX);
+	}
+	if (txt->edits_count == txt->edits_size) {
+		size_t size = txt->edits_size ? 2 * txt->edits_size : 64;
+		Edit *edits = realloc(txt->edits, size * sizeof(Edit));
+		if (!edits)
+			return false;
+		txt->edits = edits;
+		txt->edits_size = size;
+	}
+	Edit *e = &txt->edits[txt->edits_count];
+	*e = (Edit){ .pos = pos, .len = len, .data_len = data_len, .seq = txt->edits_count };
+	if (data_len) {
+		Buffer *buf = buffer_store(txt, data, data_len);
+		if (!buf)
+			return false;
+		e->buf = buf->id;
+		e->off = buf->len - data_len;
+	}
+	txt->edits_count++;
+	return true;
+}
+
+void text_edit_abort(Text *txt) {
+	/* the data stored for them is released unless something followed it */
+	for (size_t i = txt->edits_count; i-- > 0; ) {
+		Edit *e = &txt->edits[i];
+		Buffer *buf = e->data_len ? txt->buffer_table[e->buf] : NULL;
+		if (buf && buf->type == ANON && e->off + e->data_len == buf->len && buf->undo_len <= e->off)
+			buffer_delete(buf, e->off, e->data_len);
+	}
+	txt->edits_count = 0;
+}
+
+static int edit_cmp(const void *a, const void *b) {
+	const Edit *e1 = a, *e2 = b;
+	if (e1->pos != e2->pos)
+		return e1->pos < e2->pos ? -1 : 1;
+	return e1->seq < e2->seq ? -1 : e1->seq > e2->seq;
+}
+
+/* all pieces, nodes and changes are allocated before any of them is swapped
+ * in, such that a failed commit leaves the text unchanged */
+bool text_edit_commit(Text *txt) {
+	Edit *edits = txt->edits;
+	size_t count = 0;
+	if (!edits)
+		return true;
+	qsort(edits, txt->edits_count, sizeof(Edit), edit_cmp);
+	/* drop edits overlapping a preceding one */
+	for (size_t i = 0, end = 0; i < txt->edits_count; i++) {
+		if (edits[i].pos < end)
+			continue;
+		end = edits[i].pos + edits[i].len;
+		edits[count++] = edits[i];
+	}
+	txt->edits_count = count;
+	txt->cache = NULL;
+
+	/* changes in order of their position, linked through their next pointer */
+	Change *changes = NULL, **tail = &changes;
+	size_t inserted = 0, deleted = 0, pieces = 0;
+	for (Edit *e = edits, *last = edits + count; e < last; ) {
+		Location loc = piece_get_intern(txt, e->pos);
+		Piece *q = loc.piece;     /* piece currently being processed */
+		Piece *before;            /* unmodified piece preceding the new span */
+		size_t at = e->pos;       /* unmodified position of q at offset qoff */
+		size_t qoff = 0;          /* offset into q up to which it was processed */
+		if (!q)
+			return false;
+		if (loc.off == q->len) {
+			before = q;
+			q = q->next;
+		} else {
+			before = q->prev;
+			at -= loc.off;
+		}
+		Change *c = slab_alloc(&txt->changes);
+		if (!c)
+			return false;
+		c->pos = e->pos + inserted - deleted;
+
+		/* q is part of the old span, once data of it was copied or deleted */
+		Span old = { 0 }, new = { 0 };
+
+		for (; e < last; e++) {
+			while (qoff == q->len && q->next) {
+				if (!old.start)
+					before = q;
+				q = q->next;
+				qoff = 0;
+			}
+			size_t gap = e->pos - at;
+			if (q == old.end ? gap > q->len - qoff : gap && gap >= q->len)
+				break;
+			if (gap) {
+				if (!old.start)
+					old.start = q;
+				old.end = q;
+				if (!span_append(txt, &new, q->buf, q->off + qoff, gap))
+					return false;
+				qoff += gap;
+			}
+			e->newpos = e->pos + inserted - deleted;
+			if (!span_append(txt, &new, e->buf, e->off, e->data_len))
+				return false;
+			for (size_t rem = e->len; rem > 0; ) {
+				if (qoff == q->len) {
+					if (!old.start)
+						before = q;
+					q = q->next;
+					qoff = 0;
+					continue;
+				}
+				if (!old.start)
+					old.start = q;
+				old.end = q;
+				size_t len = MIN(rem, q->len - qoff);
+				qoff += len;
+				rem -= len;
+			}
+			at = e->pos + e->len;
+			inserted += e->data_len;
+			deleted += e->len;
+		}
+
+		/* keep the remaining data of a split piece */
+		if (q == old.end && !span_append(txt, &new, q->buf, q->off + qoff, q->len - qoff))
+			return false;
+
+		for (Piece *p = new.start; p; p = p->next) {
+			pieces++;
+			if (p == new.end)
+				break;
+		}
+		/* the neighbours are only linked upon swapping, those of the old span
+		 * might be part of the preceding change by then */
+		if (new.start)
+			new.start->prev = before;
+		c->new = new;
+		span_init(&c->old, old.start, old.end);
+		*tail = c;
+		tail = &c->next;
+	}
+	*tail = NULL;
+
+	if (!node_reserve(txt, pieces))
+		return false;
+	if (changes && !txt->current_action) {
+		saved_hash_capture(txt);
+		if (!action_alloc(txt))
+			return false;
+	}
+	for (Change *c = changes, *next; c; c = next) {
+		next = c->next;
+		if (c->new.start) {
+			if (c->old.start)
+				c->new.start->prev = c->old.start->prev;
+			c->new.end->next = c->old.start ? c->old.end->next : c->new.start->prev->next;
+		}
+		c->next = txt->current_action->change;
+		txt->current_action->change = c;
+		span_swap(txt, &c->old, &c->new);
+	}
+	return true;
+}
+
+size_t text_edit_pos(Text *txt, size_t pos) {
+	if (pos == EPOS)
+		return EPOS;
+	/* find the last edit at or before pos */
+	size_t lo = 0, hi = txt->edits_count;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (txt->edits[mid].pos <= pos)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == 0)
+		return pos;
+	Edit *e = &txt->edits[lo-1];
+	if (pos < e->pos + e->len)
+		return e->newpos;
+	return e->newpos + e->data_len + (pos - e->pos - e->len);
+}
+
 /* preserve the current text content such that it can be restored by
  * means of undo/redo operations */
 void text_snapshot(Text *txt) {
@@ -1194,56 +5520,166 @@ void text_snapshot(Text *txt) {
 }
 
 
-void text_free(Text *txt) {
-	if (!txt)
-		return;
-
-	// free history
-	Action *hist = txt->history;
-	while (hist && hist->prev)
-		hist = hist->prev;
-	while (hist) {
-		Action *later = hist->later;
-		action_free(hist);
-		hist = later;
+void text_free(Text *txt) {
+	if (!txt)
+		return;
+
+	slab_release(&txt->actions);
+	slab_release(&txt->changes);
+	slab_release(&txt->pieces);
+	slab_release(&txt->nodes);
+
+	free(txt->action_table);
+	free(txt->edits);
+	free(txt->undo_moves);
+	if (txt->history_fd != -1)
+		close(txt->history_fd);
+	journal_free(txt->journal);
+	scan_free(txt->scan);
+
+	/* a pending save completes without marking the text as saved */
+	if (txt->save)
+		txt->save->txt = NULL;
+	/* the buffers remain valid as long as snapshots refer to them */
+	snapshot_invalidate(txt);
+	text_release(txt);
+}
+
+/* drop a reference to the buffers, the last one frees them along with the text */
+static void text_release(Text *txt) {
+	if (__atomic_sub_fetch(&txt->refs, 1, __ATOMIC_ACQ_REL))
+		return;
+	for (Buffer *next, *buf = txt->buffers; buf; buf = next) {
+		next = buf->next;
+		buffer_free(buf);
+	}
+	free(txt->buffer_table);
+	free(txt);
+}
+
+/* content reverted to the saved state is not considered modified */
+bool text_modified(Text *txt) {
+	if (txt->saved_action == txt->history && txt->loaded == txt->loaded_saved) {
+		saved_hash_capture(txt);
+		return false;
+	}
+	return txt->saved_hash == HASH_UNKNOWN || txt->size != txt->saved_size ||
+	       text_hash(txt) != txt->saved_hash;
+}
+
+bool text_sigbus(Text *txt, const char *addr) {
+	for (Buffer *buf = txt->buffers; buf; buf = buf->next) {
+		if ((buf->type == MMAP || buf->type == SPILL) && buf->data <= addr && addr < buf->data + buf->size)
+			return true;
+	}
+	return false;
+}
+
+/* replace the page of a file mapping holding `addr' with zero bytes */
+static bool buffer_sigbus_recover(Buffer *buf, const char *addr) {
+	if (!buf || buf->type != MMAP || addr < buf->data || addr >= buf->data + buf->size)
+		return false;
+	size_t page = sysconf(_SC_PAGESIZE);
+	char *start = buf->data + (addr - buf->data) / page * page;
+	return pool.zero != -1 &&
+	       mmap(start, page, PROT_READ, MAP_PRIVATE|MAP_FIXED, pool.zero, 0) != MAP_FAILED;
+}
+
+bool text_sigbus_abort(const char *addr) {
+	if (sigbus_recover)
+		siglongjmp(*sigbus_recover, 1);
+	for (size_t i = 0; sigbus_scan && i < sigbus_scan->count; i++) {
+		if (buffer_sigbus_recover(sigbus_scan->chunks[i].buf, addr))
+			return true;
 	}
-
-	for (Piece *next, *p = txt->pieces; p; p = next) {
-		next = p->global_next;
-		piece_free(p);
+	for (size_t i = 0; sigbus_snap && i < sigbus_snap->view.buffer_count; i++) {
+		if (buffer_sigbus_recover(sigbus_snap->view.buffer_table[i], addr))
+			return true;
 	}
+	return false;
+}
 
-	for (Buffer *next, *buf = txt->buffers; buf; buf = next) {
-		next = buf->next;
-		buffer_free(buf);
+bool text_sigbus_recover(Text *txt, const char *addr) {
+	for (Buffer *buf = txt->buffers; buf; buf = buf->next) {
+		if (buf->type == MMAP && buf->data <= addr && addr < buf->data + buf->size)
+			return buffer_sigbus_recover(buf, addr);
 	}
-
-	free(txt);
+	return false;
 }
 
-bool text_modified(Text *txt) {
-	return txt->saved_action != txt->history;
+/* whether the buffer maps the file currently associated with the text, whose
+ * status is stored in `meta'. other mappings, e.g. of files replaced by an
+ * atomic save, are not affected by modifications of the file */
+static bool buffer_shared(Text *txt, Buffer *buf, struct stat *meta) {
+	return buf->type == MMAP && buf->fd != -1 && buf->size && fstat(buf->fd, meta) == 0 &&
+	       meta->st_dev == txt->info.st_dev && meta->st_ino == txt->info.st_ino;
 }
 
-bool text_sigbus(Text *txt, const char *addr) {
+bool text_mapped(Text *txt) {
+	struct stat meta;
 	for (Buffer *buf = txt->buffers; buf; buf = buf->next) {
-		if (buf->type == MMAP && buf->data <= addr && addr < buf->data + buf->size)
+		if (buffer_shared(txt, buf, &meta))
 			return true;
 	}
 	return false;
 }
 
+bool text_private(Text *txt, size_t *lost) {
+	size_t page = sysconf(_SC_PAGESIZE);
+	int zero = pool_zero();
+	*lost = 0;
+	if (zero == -1)
+		return false;
+	/* so does the writer thread of a background save, as well as the
+	 * file descriptors used to copy unmodified file content */
+	if (txt->save) {
+		errno = EBUSY;
+		return false;
+	}
+	/* the scanner thread reads the mappings being replaced */
+	scan_finish(txt->scan);
+	for (Buffer *buf = txt->buffers; buf; buf = buf->next) {
+		struct stat meta;
+		if (!buffer_shared(txt, buf, &meta))
+			continue;
+		/* data beyond the end of file can no longer be read, while the
+		 * remainder of its last page reads as zero */
+		size_t avail = meta.st_size > buf->offset ? MIN((size_t)(meta.st_size - buf->offset), buf->len) : 0;
+		size_t readable = MIN((avail + page - 1) / page * page, buf->size);
+		char *copy = mmap(NULL, buf->size, PROT_READ|PROT_WRITE, MAP_PRIVATE, zero, 0);
+		if (copy == MAP_FAILED)
+			return false;
+		memcpy(copy, buf->data, readable);
+		if (mmap(buf->data, buf->size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_FIXED, zero, 0) == MAP_FAILED) {
+			munmap(copy, buf->size);
+			return false;
+		}
+		memcpy(buf->data, copy, readable);
+		munmap(copy, buf->size);
+		mprotect(buf->data, buf->size, PROT_READ);
+		/* the data no longer corresponds to the file */
+		close(buf->fd);
+		buf->fd = -1;
+		*lost += buf->len - avail;
+	}
+	return true;
+}
+
 enum TextNewLine text_newline_type(Text *txt){
 	if (!txt->newlines) {
 		txt->newlines = TEXT_NEWLINE_NL; /* default to UNIX style \n new lines */
-		const char *start = txt->buf ? txt->buf->data : NULL;
-		if (start) {
+		const char *start = txt->buf && txt->encoding == TEXT_ENCODING_UTF8 ? buffer_data(txt->buf) : NULL;
+		TextLoadInfo info;
+		if (start && text_load_info(txt, &info)) {
+			if (info.crlf)
+				txt->newlines = TEXT_NEWLINE_CRNL;
+		} else if (start) {
 			const char *nl = memchr(start, '\n', txt->buf->len);
 			if (nl > start && nl[-1] == '\r')
 				txt->newlines = TEXT_NEWLINE_CRNL;
 		} else {
 			char c;
-			size_t nl = lines_skip_forward(txt, 0, 1, NULL);
+			size_t nl = text_pos_by_lineno(txt, 2);
 			if (nl > 1 && text_byte_get(txt, nl-2, &c) && c == '\r')
 				txt->newlines = TEXT_NEWLINE_CRNL;
 		}
@@ -1252,13 +5688,15 @@ enum TextNewLine text_newline_type(Text *txt){
 	return txt->newlines;
 }
 
-static bool text_iterator_init(Iterator *it, size_t pos, Piece *p, size_t off) {
+static bool text_iterator_init(Iterator *it, const Text *txt, size_t pos, Piece *p, size_t off) {
+	const char *data = p ? piece_data(txt, p) : NULL;
 	*it = (Iterator){
 		.pos = pos,
 		.piece = p,
-		.start = p ? p->data : NULL,
-		.end = p ? p->data + p->len : NULL,
-		.text = p ? p->data + off : NULL,
+		.txt = txt,
+		.start = data,
+		.end = data ? data + p->len : NULL,
+		.text = data ? data + off : NULL,
 	};
 	return text_iterator_valid(it);
 }
@@ -1266,7 +5704,7 @@ static bool text_iterator_init(Iterator *it, size_t pos, Piece *p, size_t off) {
 Iterator text_iterator_get(Text *txt, size_t pos) {
 	Iterator it;
 	Location loc = piece_get_extern(txt, pos);
-	text_iterator_init(&it, pos, loc.piece, loc.off);
+	text_iterator_init(&it, txt, pos, loc.piece, loc.off);
 	return it;
 }
 
@@ -1275,7 +5713,7 @@ bool text_iterator_byte_get(Iterator *it, char *b) {
 		if (it->start <= it->text && it->text < it->end) {
 			*b = *it->text;
 			return true;
-		} else if (it->pos == it->piece->text->size) { /* EOF */
+		} else if (it->pos == it->txt->size) { /* EOF */
 			*b = '\0';
 			return true;
 		}
@@ -1284,16 +5722,16 @@ bool text_iterator_byte_get(Iterator *it, char *b) {
 }
 
 bool text_iterator_next(Iterator *it) {
-	return text_iterator_init(it, it->pos, it->piece ? it->piece->next : NULL, 0);
+	return text_iterator_init(it, it->txt, it->pos, it->piece ? iterator_piece(it->txt, it->piece->next) : NULL, 0);
 }
 
 bool text_iterator_prev(Iterator *it) {
-	return text_iterator_init(it, it->pos, it->piece ? it->piece->prev : NULL, 0);
+	return text_iterator_init(it, it->txt, it->pos, it->piece ? iterator_piece(it->txt, it->piece->prev) : NULL, 0);
 }
 
 bool text_iterator_valid(const Iterator *it) {
-	/* filter out sentinel nodes */
-	return it->piece && it->piece->text;
+	/* filter out sentinel nodes, they are not associated with a buffer */
+	return it->piece && it->piece->buf;
 }
 
 bool text_iterator_byte_next(Iterator *it, char *b) {
@@ -1301,7 +5739,7 @@ bool text_iterator_byte_next(Iterator *it, char *b) {
 		return false;
 	it->text++;
 	/* special case for advancement to EOF */
-	if (it->text == it->end && !it->piece->next->text) {
+	if (it->text == it->end && !iterator_piece(it->txt, it->piece->next)->buf) {
 		it->pos++;
 		if (b)
 			*b = '\0';
@@ -1359,12 +5797,12 @@ bool text_byte_get(Text *txt, size_t pos, char *buf) {
 	return text_bytes_get(txt, pos, 1, buf);
 }
 
-size_t text_bytes_get(Text *txt, size_t pos, size_t len, char *buf) {
+static size_t iterator_bytes_get(Iterator it, size_t len, char *buf) {
 	if (!buf)
 		return 0;
 	char *cur = buf;
 	size_t rem = len;
-	text_iterate(txt, it, pos) {
+	for (; text_iterator_valid(&it); text_iterator_next(&it)) {
 		if (rem == 0)
 			break;
 		size_t piece_len = it.end - it.text;
@@ -1377,100 +5815,746 @@ size_t text_bytes_get(Text *txt, size_t pos, size_t len, char *buf) {
 	return len - rem;
 }
 
+size_t text_bytes_get(Text *txt, size_t pos, size_t len, char *buf) {
+	return iterator_bytes_get(text_iterator_get(txt, pos), len, buf);
+}
+
+static size_t iterator_chunks_get(Iterator it, Filerange *r, struct iovec *iov, size_t count) {
+	size_t n = 0;
+	for (; n < count && r->start < r->end && text_iterator_valid(&it); text_iterator_next(&it)) {
+		size_t len = MIN((size_t)(it.end - it.text), r->end - r->start);
+		if (len == 0)
+			continue;
+		iov[n].iov_base = (char*)it.text;
+		iov[n].iov_len = len;
+		r->start += len;
+		n++;
+	}
+	return n;
+}
+
+size_t text_chunks_get(Text *txt, Filerange *r, struct iovec *iov, size_t count) {
+	if (r->start >= r->end)
+		return 0;
+	return iterator_chunks_get(text_iterator_get(txt, r->start), r, iov, count);
+}
+
 size_t text_size(Text *txt) {
 	return txt->size;
 }
 
-/* count the number of new lines '\n' in range [pos, pos+len) */
-static size_t lines_count(Text *txt, size_t pos, size_t len) {
-	size_t lines = 0;
-	text_iterate(txt, it, pos) {
-		const char *start = it.text;
-		while (len > 0 && start < it.end) {
-			size_t n = MIN(len, (size_t)(it.end - start));
-			const char *end = memchr(start, '\n', n);
-			if (!end) {
-				len -= n;
-				break;
-			}
-			lines++;
-			len -= end - start + 1;
-			start = end + 1;
-		}
+static void block_unref(SnapshotBlock *block) {
+	if (!__atomic_sub_fetch(&block->refs, 1, __ATOMIC_ACQ_REL))
+		free(block);
+}
+
+/* append a block to the snapshot, its content follows that of the previous ones */
+static bool snapshot_push(TextSnapshot *snap, size_t *size, SnapshotBlock *block) {
+	if (snap->block_count == *size) {
+		size_t new_size = *size ? 2 * *size : 16;
+		SnapshotBlock **blocks = realloc(snap->blocks, new_size * sizeof *blocks);
+		if (!blocks)
+			return false;
+		snap->blocks = blocks;
+		size_t *pos = realloc(snap->pos, new_size * sizeof *pos);
+		if (!pos)
+			return false;
+		snap->pos = pos;
+		*size = new_size;
+	}
+	snap->blocks[snap->block_count] = block;
+	snap->pos[snap->block_count++] = snap->view.size;
+	snap->view.size += block->len;
+	return true;
+}
+
+/* complete a block by linking its pieces to each other and its sentinels */
+static SnapshotBlock *block_finish(SnapshotBlock *block) {
+	if (block->count < SNAPSHOT_BLOCK) {
+		SnapshotBlock *shrunk = realloc(block, sizeof *block + block->count * sizeof *block->pieces);
+		if (shrunk)
+			block = shrunk;
+	}
+	Piece *prev = &block->head;
+	for (size_t i = 0; i < block->count; i++) {
+		Piece *p = &block->pieces[i].piece;
+		p->prev = prev;
+		prev->next = p;
+		prev = p;
+	}
+	block->tail.prev = prev;
+	prev->next = &block->tail;
+	return block;
+}
 
+/* copy the pieces covering [start, end) into new blocks, the first and last one are clipped */
+static bool snapshot_copy(TextSnapshot *snap, size_t *size, Text *txt, size_t start, size_t end) {
+	Location loc = start < end ? piece_get_extern(txt, start) : (Location){ 0 };
+	SnapshotBlock *block = NULL;
+	size_t pos = start, off = loc.off;
+	for (Piece *p = loc.piece; p && p != &txt->end && pos < end; p = p->next, off = 0) {
+		size_t len = MIN(p->len - off, end - pos);
 		if (len == 0)
-			break;
+			continue;
+		if (block && block->count == SNAPSHOT_BLOCK) {
+			if (!snapshot_push(snap, size, block = block_finish(block)))
+				goto err;
+			block = NULL;
+		}
+		if (!block) {
+			if (!(block = calloc(1, sizeof *block + SNAPSHOT_BLOCK * sizeof *block->pieces)))
+				return false;
+			block->refs = 1;
+		}
+		SnapshotPiece *copy = &block->pieces[block->count++];
+		piece_init(&copy->piece, NULL, NULL, p->buf, p->off + off, len);
+		copy->pos = block->len;
+		block->len += len;
+		pos += len;
 	}
-	return lines;
+	if (block && !snapshot_push(snap, size, block = block_finish(block)))
+		goto err;
+	return true;
+err:
+	free(block);
+	return false;
 }
 
-/* skip n lines forward and return position afterwards */
-static size_t lines_skip_forward(Text *txt, size_t pos, size_t lines, size_t *lines_skipped) {
-	size_t lines_old = lines;
-	text_iterate(txt, it, pos) {
-		const char *start = it.text;
-		while (lines > 0 && start < it.end) {
-			size_t n = it.end - start;
-			const char *end = memchr(start, '\n', n);
-			if (!end) {
-				pos += n;
-				break;
-			}
-			pos += end - start + 1;
-			start = end + 1;
-			lines--;
+/* free a snapshot which does not yet refer to the text */
+static void snapshot_free(TextSnapshot *snap) {
+	for (size_t i = 0; i < snap->block_count; i++)
+		block_unref(snap->blocks[i]);
+	free(snap->blocks);
+	free(snap->pos);
+	free(snap->view.buffer_table);
+	free(snap);
+}
+
+/* share the block of another snapshot */
+static bool snapshot_share(TextSnapshot *snap, size_t *size, SnapshotBlock *block) {
+	if (!snapshot_push(snap, size, block))
+		return false;
+	__atomic_add_fetch(&block->refs, 1, __ATOMIC_RELAXED);
+	return true;
+}
+
+/* copy the pieces covering [start, end). the unmodified blocks of `base', a
+ * previous snapshot of the whole text, are shared instead of being copied */
+static TextSnapshot *snapshot_new(Text *txt, size_t start, size_t end, TextSnapshot *base) {
+	TextSnapshot *snap = calloc(1, sizeof *snap);
+	if (!snap)
+		return NULL;
+	snap->refs = 1;
+	snap->view.buffer_table = calloc(txt->buffer_count, sizeof *txt->buffer_table);
+	if (txt->buffer_count && !snap->view.buffer_table) {
+		free(snap);
+		return NULL;
+	}
+	if (txt->buffer_count)
+		memcpy(snap->view.buffer_table, txt->buffer_table, txt->buffer_count * sizeof *txt->buffer_table);
+	snap->view.buffer_count = txt->buffer_count;
+	snap->view.encoding = txt->encoding;
+	snap->view.bom = txt->bom;
+
+	/* the blocks preceding [first, last) are followed by the modified range,
+	 * small ones adjacent to it are merged with the copied pieces */
+	size_t first = 0, last = 0, copy_start = start, copy_end = end, size = 0;
+	if (base) {
+		size_t mod_start = txt->snapshot_start;
+		size_t mod_end = txt->snapshot_end + base->view.size - txt->size;
+		while (first < base->block_count && base->pos[first] + base->blocks[first]->len <= mod_start)
+			first++;
+		for (last = first; last < base->block_count && base->pos[last] < mod_end; last++);
+		if (first > 0 && base->blocks[first-1]->count < SNAPSHOT_BLOCK / 2)
+			first--;
+		if (last < base->block_count && base->blocks[last]->count < SNAPSHOT_BLOCK / 2)
+			last++;
+		copy_start = first ? base->pos[first-1] + base->blocks[first-1]->len : 0;
+		copy_end = last < base->block_count ? base->pos[last] + txt->size - base->view.size : txt->size;
+	}
+	uint64_t lo = first ? base->blocks[first-1]->label : 0;
+	uint64_t hi = base && last < base->block_count ? base->blocks[last]->label : UINT64_MAX;
+	for (size_t i = 0; i < first; i++) {
+		if (!snapshot_share(snap, &size, base->blocks[i]))
+			goto err;
+	}
+	size_t copied = snap->block_count;
+	if (!snapshot_copy(snap, &size, txt, copy_start, copy_end))
+		goto err;
+	/* the copied blocks are labeled in between the shared ones */
+	size_t count = snap->block_count - copied;
+	uint64_t step = (hi - lo) / (count + 1);
+	if (count && step == 0) {
+		/* the labels are exhausted, start over without sharing any block */
+		snapshot_free(snap);
+		return snapshot_new(txt, start, end, NULL);
+	}
+	for (size_t i = 0; i < count; i++)
+		snap->blocks[copied + i]->label = lo + (i + 1) * step;
+	for (size_t i = last; base && i < base->block_count; i++) {
+		if (!snapshot_share(snap, &size, base->blocks[i]))
+			goto err;
+	}
+
+	if (snap->block_count) {
+		SnapshotBlock *block = snap->blocks[snap->block_count-1];
+		piece_init(&snap->view.begin, NULL, &snap->blocks[0]->pieces[0].piece, 0, 0, 0);
+		piece_init(&snap->view.end, &block->pieces[block->count-1].piece, NULL, 0, 0, 0);
+	} else {
+		piece_init(&snap->view.begin, NULL, &snap->view.end, 0, 0, 0);
+		piece_init(&snap->view.end, &snap->view.begin, NULL, 0, 0, 0);
+	}
+
+	/* the data of the most recently modified piece is changed in place,
+	 * further modifications thus have to be stored in a new one */
+	txt->cache = NULL;
+	__atomic_add_fetch(&txt->refs, 1, __ATOMIC_RELAXED);
+	snap->txt = txt;
+	return snap;
+err:
+	snapshot_free(snap);
+	return NULL;
+}
+TextSnapshot *text_snapshot_ref(Text *txt) {
+	TextSnapshot *snap = txt->snapshot;
+	if (snap && !txt->snapshot_modified) {
+		__atomic_add_fetch(&snap->refs, 1, __ATOMIC_RELAXED);
+		return snap;
+	}
+	if (!(snap = snapshot_new(txt, 0, txt->size, snap)))
+		return NULL;
+	/* keep one reference such that it can be reused until the text changes */
+	snap->refs++;
+	snapshot_invalidate(txt);
+	txt->snapshot = snap;
+	return snap;
+}
+
+TextSnapshot *text_snapshot_range(Text *txt, Filerange *r) {
+	if (r->start > r->end || r->end > txt->size)
+		return NULL;
+	if (r->start == 0 && r->end == txt->size)
+		return text_snapshot_ref(txt);
+	return snapshot_new(txt, r->start, r->end, NULL);
+}
+
+void text_snapshot_unref(TextSnapshot *snap) {
+	if (!snap || __atomic_sub_fetch(&snap->refs, 1, __ATOMIC_ACQ_REL))
+		return;
+	Text *txt = snap->txt;
+	snapshot_free(snap);
+	text_release(txt);
+}
+
+/* drop the reference kept to the snapshot of the current state */
+static void snapshot_invalidate(Text *txt) {
+	txt->snapshot_modified = false;
+	if (!txt->snapshot)
+		return;
+	text_snapshot_unref(txt->snapshot);
+	txt->snapshot = NULL;
+}
+
+/* record that [pos, pos+old_len) was replaced by new_len bytes, the blocks
+ * of the current snapshot outside the modified range remain shareable */
+static void snapshot_modify(Text *txt, size_t pos, size_t old_len, size_t new_len) {
+	if (!txt->snapshot)
+		return;
+	if (!txt->snapshot_modified) {
+		txt->snapshot_modified = true;
+		txt->snapshot_start = pos;
+		txt->snapshot_end = pos + new_len;
+		return;
+	}
+	size_t end = pos + old_len;
+	txt->snapshot_start = MIN(txt->snapshot_start, pos);
+	if (txt->snapshot_end >= end)
+		txt->snapshot_end = txt->snapshot_end - old_len + new_len;
+	else
+		txt->snapshot_end = pos + new_len;
+}
+
+/* same as above for a change at the given offset of an active piece */
+static void snapshot_piece_modify(Text *txt, Piece *p, size_t off, size_t old_len, size_t new_len) {
+	if (!txt->snapshot)
+		return;
+	if (p->node)
+		snapshot_modify(txt, tree_pos(p->node) + off, old_len, new_len);
+	else
+		snapshot_invalidate(txt);
+}
+
+/* resolve a block sentinel to the adjacent piece of the snapshot it is iterated in */
+static Piece *snapshot_link(const Text *view, Piece *p) {
+	TextSnapshot *snap = (TextSnapshot*)((char*)view - offsetof(TextSnapshot, view));
+	bool tail = p->prev != NULL;
+	SnapshotBlock *block = (SnapshotBlock*)((char*)p - (tail ? offsetof(SnapshotBlock, tail) : offsetof(SnapshotBlock, head)));
+	size_t lo = 0, hi = snap->block_count;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (snap->blocks[mid]->label < block->label)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (tail) {
+		if (lo + 1 < snap->block_count)
+			return &snap->blocks[lo+1]->pieces[0].piece;
+		return &snap->view.end;
+	}
+	if (lo > 0) {
+		SnapshotBlock *prev = snap->blocks[lo-1];
+		return &prev->pieces[prev->count-1].piece;
+	}
+	return &snap->view.begin;
+}
+
+/* the piece to iterate over, sentinels of snapshot blocks are skipped */
+static Piece *iterator_piece(const Text *txt, Piece *p) {
+	if (p && !p->buf && p != &txt->begin && p != &txt->end)
+		return snapshot_link(txt, p);
+	return p;
+}
+
+size_t text_snapshot_size(TextSnapshot *snap) {
+	return snap->view.size;
+}
+
+bool text_snapshot_of(TextSnapshot *snap, Text *txt) {
+	return snap->txt == txt;
+}
+
+Iterator text_snapshot_iterator_get(TextSnapshot *snap, size_t pos) {
+	Iterator it;
+	Piece *p = NULL;
+	size_t off = 0;
+	if (pos > 0 && pos == snap->view.size) {
+		SnapshotBlock *block = snap->blocks[snap->block_count - 1];
+		p = &block->pieces[block->count - 1].piece;
+		off = p->len;
+	} else if (pos < snap->view.size) {
+		/* find the last block and within it the last piece starting at or before pos */
+		size_t lo = 0, hi = snap->block_count;
+		while (hi - lo > 1) {
+			size_t mid = lo + (hi - lo) / 2;
+			if (snap->pos[mid] <= pos)
+				lo = mid;
+			else
+				hi = mid;
+		}
+		SnapshotBlock *block = snap->blocks[lo];
+		size_t rel = pos - snap->pos[lo];
+		lo = 0, hi = block->count;
+		while (hi - lo > 1) {
+			size_t mid = lo + (hi - lo) / 2;
+			if (block->pieces[mid].pos <= rel)
+				lo = mid;
+			else
+				hi = mid;
 		}
+		p = &block->pieces[lo].piece;
+		off = rel - block->pieces[lo].pos;
+	}
+	text_iterator_init(&it, &snap->view, pos, p, off);
+	return it;
+}
+
+size_t text_snapshot_bytes_get(TextSnapshot *snap, size_t pos, size_t len, char *buf) {
+	return iterator_bytes_get(text_snapshot_iterator_get(snap, pos), len, buf);
+}
+
+size_t text_snapshot_chunks_get(TextSnapshot *snap, Filerange *r, struct iovec *iov, size_t count) {
+	if (r->start >= r->end)
+		return 0;
+	return iterator_chunks_get(text_snapshot_iterator_get(snap, r->start), r, iov, count);
+}
+
+/* the data is copied rather than referred to, even if the snapshot is one of
+ * the same text. pieces sharing buffer data would break the address index
+ * and thus the resolution of marks. the copy is staged through a local buffer
+ * since inserting might spill the buffers the snapshotted data resides in */
+bool text_insert_snapshot(Text *txt, size_t pos, TextSnapshot *snap) {
+	if (pos > txt->size)
+		return false;
+	char data[1 << 16];
+	for (size_t off = 0, size = snap->view.size; off < size; ) {
+		size_t len = text_snapshot_bytes_get(snap, off, MIN(size - off, sizeof data), data);
+		if (len == 0 || !text_insert(txt, pos, data, len))
+			return false;
+		off += len;
+		pos += len;
+	}
+	return true;
+}
 
-		if (lines == 0)
+/* count the number of new lines '\n' in the given memory range */
+static size_t lines_count(const char *data, size_t len) {
+	size_t lines = 0;
+	for (const char *end = data + len; data < end; data++) {
+		if (!(data = memchr(data, '\n', end - data)))
 			break;
+		lines++;
 	}
-	if (lines_skipped)
-		*lines_skipped = lines_old - lines;
-	return pos;
+	return lines;
+}
+
+/* returns the number of bytes up to and including the n-th new line or len if
+ * there are fewer. n is decremented by the number of skipped lines. */
+static size_t lines_skip(const char *data, size_t len, size_t *lines) {
+	const char *start = data, *end = data + len;
+	while (*lines > 0 && data < end) {
+		if (!(data = memchr(data, '\n', end - data)))
+			return len;
+		data++;
+		(*lines)--;
+	}
+	return data - start;
+}
+
+/* Every piece caches the number of new lines it contains, the position index
+ * aggregates them per subtree. Both are computed lazily, LINES_UNKNOWN and
+ * EPOS respectively denote a not yet known count. A subtree count is only
+ * known if all its pieces are. Counting the lines of (split) pieces is cheap
+ * because every buffer keeps checkpoints of its new line count at regular
+ * intervals.
+ */
+
+/* returns the number of new lines in the first len bytes of the piece */
+static size_t piece_lines_count(Text *txt, Piece *p, size_t len) {
+	if (len == p->len && p->lines != LINES_UNKNOWN)
+		return p->lines;
+	Buffer *buf = txt->buffer_table[p->buf];
+	const char *data = piece_data(txt, p);
+	/* pieces of transcoded content do not span chunks, which are counted directly */
+	if (len < BUFFER_LINES_BLOCK || buf->type == DECODED)
+		return lines_count(data, len);
+	scan_adopt(txt, buf);
+	return buffer_lines(buf, p->off + len) - buffer_lines(buf, p->off);
+}
+
+static size_t piece_lines(Text *txt, Piece *p) {
+	if (p->lines == LINES_UNKNOWN)
+		p->lines = piece_lines_count(txt, p, p->len);
+	return p->lines;
+}
+
+/* returns the offset following the n-th new line within the piece or its
+ * length if there are fewer. n is decremented by the number of skipped lines. */
+static size_t piece_lines_skip(Text *txt, Piece *p, size_t *lines) {
+	Buffer *buf = txt->buffer_table[p->buf];
+	const char *data = piece_data(txt, p);
+	if (p->len < BUFFER_LINES_BLOCK || buf->type == DECODED)
+		return lines_skip(data, p->len, lines);
+	scan_adopt(txt, buf);
+	return buffer_lines_skip(buf, p->off, p->off + p->len, lines) - p->off;
+}
+
+/* returns the number of new lines in the subtree, counts unknown pieces */
+static size_t tree_lines_count(Text *txt, Node *node) {
+	if (!node)
+		return 0;
+	if (node->subtree_lines == EPOS) {
+		tree_lines_count(txt, node->left);
+		piece_lines(txt, node->piece);
+		tree_lines_count(txt, node->right);
+		tree_update(node);
+	}
+	return node->subtree_lines;
 }
 
-static void lineno_cache_invalidate(LineCache *cache) {
-	cache->pos = 0;
-	cache->lineno = 1;
+/* returns the offset relative to the start of the subtree following its n-th
+ * new line or the subtree length if there are fewer. n is decremented by the
+ * number of skipped lines. pieces are only counted as far as necessary. */
+static size_t tree_lines_skip(Text *txt, Node *node, size_t *lines) {
+	if (!node)
+		return 0;
+	if (node->subtree_lines != EPOS && node->subtree_lines < *lines) {
+		*lines -= node->subtree_lines;
+		return node->subtree_len;
+	}
+	size_t off = tree_lines_skip(txt, node->left, lines);
+	if (*lines == 0)
+		return off;
+	Piece *p = node->piece;
+	if (p->lines != LINES_UNKNOWN && p->lines < *lines) {
+		*lines -= p->lines;
+	} else {
+		size_t rem = *lines;
+		size_t skipped = piece_lines_skip(txt, p, lines);
+		if (*lines == 0)
+			return off + skipped;
+		p->lines = rem - *lines;
+	}
+	off += p->len;
+	off += tree_lines_skip(txt, node->right, lines);
+	if (*lines > 0)
+		tree_update(node);
+	return off;
 }
 
 size_t text_pos_by_lineno(Text *txt, size_t lineno) {
-	size_t lines_skipped;
-	LineCache *cache = &txt->lines;
 	if (lineno <= 1)
 		return 0;
-	if (lineno > cache->lineno) {
-		cache->pos = lines_skip_forward(txt, cache->pos, lineno - cache->lineno, &lines_skipped);
-		cache->lineno += lines_skipped;
-	} else if (lineno < cache->lineno) {
-	#if 0
-		// TODO does it make sense to scan memory backwards here?
-		size_t diff = cache->lineno - lineno;
-		if (diff < lineno) {
-			lines_skip_backward(txt, cache->pos, diff);
-		} else
-	#endif
-		cache->pos = lines_skip_forward(txt, 0, lineno - 1, &lines_skipped);
-		cache->lineno = lines_skipped + 1;
-	}
-	return cache->pos;
+	size_t lines = lineno - 1;
+	return tree_lines_skip(txt, txt->tree, &lines);
 }
 
 size_t text_lineno_by_pos(Text *txt, size_t pos) {
-	LineCache *cache = &txt->lines;
+	size_t cur = 0, lines = 0;
 	if (pos > txt->size)
 		pos = txt->size;
-	if (pos < cache->pos) {
-		size_t diff = cache->pos - pos;
-		if (diff < pos)
-			cache->lineno -= lines_count(txt, pos, diff);
-		else
-			cache->lineno = lines_count(txt, 0, pos) + 1;
-	} else if (pos > cache->pos) {
-		cache->lineno += lines_count(txt, cache->pos, pos - cache->pos);
+	for (Node *node = txt->tree; node; ) {
+		size_t left = tree_len(node->left);
+		if (pos < cur + left) {
+			node = node->left;
+			continue;
+		}
+		lines += tree_lines_count(txt, node->left);
+		cur += left;
+		Piece *p = node->piece;
+		if (pos < cur + p->len)
+			return lines + piece_lines_count(txt, p, pos - cur) + 1;
+		lines += piece_lines(txt, p);
+		cur += p->len;
+		node = node->right;
+	}
+	return lines + 1;
+}
+
+/* Content hashes are polynomials over the bytes, each offset by one such that
+ * leading NUL bytes are significant, evaluated at a fixed point modulo the
+ * prime 2^61-1. The hash of a concatenation is hash(a) * x^len(b) + hash(b),
+ * hence they compose along the position index just like the new line counts:
+ * every piece caches its hash and every node that of its subtree, computed
+ * lazily and HASH_UNKNOWN until then. The hash of a (split) piece is derived
+ * from the hash checkpoints of its buffer. Being independent of the piece
+ * boundaries and the process, the hashes of equal content are equal, whereas
+ * those of different content of length n collide with probability n/2^61.
+ */
+
+/* powers of the evaluation point x, hash_points[i] = x^i */
+static const uint64_t hash_points[] = {
+	UINT64_C(0x1), UINT64_C(0x16a09e667f3bcc9), UINT64_C(0x1ff76525aecdd5d0),
+	UINT64_C(0x169be6ca05cc79a4), UINT64_C(0xe12ee299d32cac), UINT64_C(0x7c6557e84d8c200),
+	UINT64_C(0x1df59bc28cbad3f0), UINT64_C(0x1885b90d426da605), UINT64_C(0x1fb4f9e3da987c12),
+};
+
+/* sum of x^0 ... x^7, the offsets of eight bytes */
+#define HASH_OFFSETS UINT64_C(0x17202f070a6274e2)
+
+static uint64_t hash_reduce(uint64_t h) {
+	h = (h & HASH_PRIME) + (h >> 61);
+	return h >= HASH_PRIME ? h - HASH_PRIME : h;
+}
+
+static uint64_t hash_add(uint64_t a, uint64_t b) {
+	return hash_reduce(a + b);
+}
+
+static uint64_t hash_sub(uint64_t a, uint64_t b) {
+	return a >= b ? a - b : a + HASH_PRIME - b;
+}
+
+#ifdef __SIZEOF_INT128__
+static uint64_t hash_reduce128(unsigned __int128 h) {
+	uint64_t lo = (uint64_t)h & HASH_PRIME, mid = (uint64_t)(h >> 61) & HASH_PRIME;
+	return hash_reduce(lo + mid + (uint64_t)(h >> 122));
+}
+#endif
+
+static uint64_t hash_mul(uint64_t a, uint64_t b) {
+#ifdef __SIZEOF_INT128__
+	return hash_reduce128((unsigned __int128)a * b);
+#else
+	/* 2^64 = 2^3 and 2^61 = 1 modulo the prime */
+	uint64_t a1 = a >> 32, a0 = a & 0xffffffff, b1 = b >> 32, b0 = b & 0xffffffff;
+	uint64_t mid = a1 * b0 + a0 * b1;
+	return hash_reduce((a1 * b1 << 3) + (mid >> 29) + ((mid & 0x1fffffff) << 32) + hash_reduce(a0 * b0));
+#endif
+}
+
+/* returns x^len */
+static uint64_t hash_pow(size_t len) {
+	uint64_t pow = 1, base = hash_points[1];
+	for (; len; len >>= 1) {
+		if (len & 1)
+			pow = hash_mul(pow, base);
+		base = hash_mul(base, base);
+	}
+	return pow;
+}
+
+/* returns the hash of the concatenation of the content hashed by `hash' and
+ * the given data. eight bytes are processed at a time if 128 bit arithmetic
+ * is available, reducing only once per word. */
+static uint64_t hash_bytes(uint64_t hash, const char *data, size_t len) {
+	const unsigned char *s = (const unsigned char*)data;
+#ifdef __SIZEOF_INT128__
+	for (; len >= 8; s += 8, len -= 8) {
+		unsigned __int128 h = (unsigned __int128)hash * hash_points[8] + HASH_OFFSETS;
+		for (int i = 0; i < 8; i++)
+			h += (unsigned __int128)s[i] * hash_points[7-i];
+		hash = hash_reduce128(h);
+	}
+#endif
+	for (; len > 0; s++, len--)
+		hash = hash_add(hash_mul(hash, hash_points[1]), *s + 1);
+	return hash;
+}
+
+/* returns the hash of the first len bytes of the piece */
+static uint64_t piece_hash_count(Text *txt, Piece *p, size_t len) {
+	Buffer *buf = txt->buffer_table[p->buf];
+	const char *data = piece_data(txt, p);
+	if (len < BUFFER_LINES_BLOCK || buf->type == DECODED)
+		return hash_bytes(0, data, len);
+	scan_adopt_hashes(txt);
+	uint64_t start = buffer_hash(buf, p->off), end = buffer_hash(buf, p->off + len);
+	return hash_sub(end, hash_mul(start, hash_pow(len)));
+}
+
+static uint64_t piece_hash(Text *txt, Piece *p) {
+	if (p->hash == HASH_UNKNOWN)
+		p->hash = piece_hash_count(txt, p, p->len);
+	return p->hash;
+}
+
+/* returns the hash of the subtree, pow is set to x^len of it */
+static uint64_t tree_hash(Text *txt, Node *node, uint64_t *pow) {
+	if (!node) {
+		*pow = 1;
+		return 0;
+	}
+	if (node->subtree_hash == HASH_UNKNOWN) {
+		uint64_t left_pow, right_pow, piece_pow = hash_pow(node->piece->len);
+		uint64_t left = tree_hash(txt, node->left, &left_pow);
+		uint64_t right = tree_hash(txt, node->right, &right_pow);
+		uint64_t hash = hash_add(hash_mul(left, piece_pow), piece_hash(txt, node->piece));
+		node->subtree_hash = hash_add(hash_mul(hash, right_pow), right);
+		node->subtree_pow = hash_mul(hash_mul(left_pow, piece_pow), right_pow);
+	}
+	*pow = node->subtree_pow;
+	return node->subtree_hash;
+}
+
+/* returns the hash of the first pos bytes of the text */
+static uint64_t tree_hash_prefix(Text *txt, size_t pos) {
+	uint64_t hash = 0, pow;
+	for (Node *node = txt->tree; node && pos > 0; ) {
+		size_t left = tree_len(node->left);
+		if (pos < left) {
+			node = node->left;
+			continue;
+		}
+		uint64_t left_hash = tree_hash(txt, node->left, &pow);
+		hash = hash_add(hash_mul(hash, pow), left_hash);
+		pos -= left;
+		if (pos == 0)
+			break;
+		Piece *p = node->piece;
+		if (pos < p->len)
+			return hash_add(hash_mul(hash, hash_pow(pos)), piece_hash_count(txt, p, pos));
+		hash = hash_add(hash_mul(hash, hash_pow(p->len)), piece_hash(txt, p));
+		pos -= p->len;
+		node = node->right;
+	}
+	return hash;
+}
+
+/* remember the hash of the saved content while the text is in its saved
+ * state, unless the hash checkpoints are still being computed by the
+ * scanner thread. transcoded content would have to be decoded entirely. */
+static void saved_hash_capture(Text *txt) {
+	if (txt->saved_hash != HASH_UNKNOWN || txt->saved_action != txt->history ||
+	    txt->loaded != txt->loaded_saved || txt->encoding != TEXT_ENCODING_UTF8 ||
+	    !scan_adopt_hashes(txt))
+		return;
+	txt->saved_hash = text_hash(txt);
+	txt->saved_size = txt->size;
+}
+
+uint64_t text_hash(Text *txt) {
+	uint64_t pow;
+	return tree_hash(txt, txt->tree, &pow);
+}
+
+uint64_t text_hash_range(Text *txt, const Filerange *r) {
+	size_t start = MIN(r->start, txt->size), end = MIN(r->end, txt->size);
+	if (start >= end)
+		return 0;
+	uint64_t prefix = tree_hash_prefix(txt, start);
+	return hash_sub(tree_hash_prefix(txt, end), hash_mul(prefix, hash_pow(end - start)));
+}
+
+/* compare the file content against the current text */
+static bool file_equal(Text *txt, const char *filename) {
+	struct stat meta;
+	char data[BUFFER_COPY_SIZE];
+	struct iovec iov[16];
+	bool equal = false;
+	int fd = open(filename, O_RDONLY);
+	if (fd == -1)
+		return false;
+	if (fstat(fd, &meta) == -1 || (size_t)meta.st_size != txt->size)
+		goto out;
+	for (size_t pos = 0; pos < txt->size; ) {
+		ssize_t len = read(fd, data, MIN(sizeof data, txt->size - pos));
+		if (len == -1 && errno == EINTR)
+			continue;
+		if (len <= 0)
+			goto out;
+		Filerange r = { pos, pos + len };
+		const char *cur = data;
+		for (size_t n; (n = text_chunks_get(txt, &r, iov, LENGTH(iov))); ) {
+			for (size_t i = 0; i < n; cur += iov[i].iov_len, i++) {
+				if (memcmp(cur, iov[i].iov_base, iov[i].iov_len))
+					goto out;
+			}
+		}
+		pos += len;
+	}
+	equal = true;
+out:
+	close(fd);
+	return equal;
+}
+
+bool text_file_current(Text *txt, const char *filename) {
+	if (txt->saved_action == txt->history && txt->loaded == txt->loaded_saved)
+		return true;
+	/* equal hashes do not imply equal content */
+	if (text_modified(txt))
+		return false;
+	return file_equal(txt, filename);
+}
+
+bool text_file_unchanged(Text *txt, const char *filename) {
+	struct stat meta;
+	char data[BUFFER_COPY_SIZE];
+	uint64_t hash = 0;
+	bool unchanged = false;
+	/* while the text is in the saved state, its content is compared */
+	if (txt->saved_action == txt->history && txt->loaded == txt->loaded_saved)
+		return file_equal(txt, filename);
+	saved_hash_capture(txt);
+	if (txt->saved_hash == HASH_UNKNOWN)
+		return false;
+	int fd = open(filename, O_RDONLY);
+	if (fd == -1)
+		return false;
+	if (fstat(fd, &meta) == -1 || (size_t)meta.st_size != txt->saved_size)
+		goto out;
+	for (ssize_t len; (len = read(fd, data, sizeof data)); ) {
+		if (len == -1 && errno == EINTR)
+			continue;
+		if (len == -1)
+			goto out;
+		hash = hash_bytes(hash, data, len);
 	}
-	cache->pos = pos;
-	return cache->lineno;
+	unchanged = hash == txt->saved_hash;
+out:
+	close(fd);
+	return unchanged;
 }
 
 Mark text_mark_set(Text *txt, size_t pos) {
@@ -1481,12 +6565,10 @@ Mark text_mark_set(Text *txt, size_t pos) {
 	Location loc = piece_get_extern(txt, pos);
 	if (!loc.piece)
 		return NULL;
-	return loc.piece->data + loc.off;
+	return piece_addr(txt, loc.piece) + loc.off;
 }
 
 size_t text_mark_get(Text *txt, Mark mark) {
-	size_t cur = 0;
-
 	if (!mark)
 		return EPOS;
 	if (mark == (Mark)&txt->begin)
@@ -1494,13 +6576,44 @@ size_t text_mark_get(Text *txt, Mark mark) {
 	if (mark == (Mark)&txt->end)
 		return txt->size;
 
-	for (Piece *p = txt->begin.next; p->next; p = p->next) {
-		if (p->data <= mark && mark < p->data + p->len)
-			return cur + (mark - p->data);
-		cur += p->len;
-	}
+	Piece *p = addr_lookup(txt, mark);
+	if (!p)
+		return EPOS;
+	return tree_pos(p->node) + (mark - piece_addr(txt, p));
+}
 
-	return EPOS;
+void text_marks_get(Text *txt, const Mark *marks, size_t *pos, size_t count) {
+	Piece *p = NULL;
+	const char *data = NULL;
+	size_t start = 0;
+	for (size_t i = 0; i < count; i++) {
+		Mark mark = marks[i];
+		if (!mark || mark == (Mark)&txt->begin || mark == (Mark)&txt->end) {
+			pos[i] = text_mark_get(txt, mark);
+			continue;
+		}
+		/* look at the piece of the previous mark and its direct successors
+		 * before falling back to the index */
+		bool found = false;
+		for (int n = 0; !found && p && p->next && n < 8; n++) {
+			data = piece_addr(txt, p);
+			if (data <= mark && mark < data + p->len) {
+				found = true;
+			} else {
+				start += p->len;
+				p = p->next;
+			}
+		}
+		if (!found) {
+			if (!(p = addr_lookup(txt, mark))) {
+				pos[i] = EPOS;
+				continue;
+			}
+			data = piece_addr(txt, p);
+			start = tree_pos(p->node);
+		}
+		pos[i] = start + (mark - data);
+	}
 }
 
 size_t text_history_get(Text *txt, size_t index) {
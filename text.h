@@ -2,11 +2,13 @@
 #define TEXT_H
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <time.h>
 #include <unistd.h>
 #include <stdarg.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 
 #define EPOS ((size_t)-1)         /* invalid position */
 
@@ -24,6 +26,7 @@ typedef struct {
 	const char *end;    /* pointer to the first byte after valid data i.e. [start, end) */
 	const char *text;   /* current position within piece: start <= text < end */
 	const Piece *piece; /* internal state do not touch! */
+	const Text *txt;    /* internal state do not touch! */
 	size_t pos;         /* global position in bytes from start of file */
 } Iterator;
 
@@ -35,8 +38,107 @@ typedef struct {
 /* create a text instance populated with the given file content, if `filename'
  * is NULL the text starts out empty */
 Text *text_load(const char *filename);
+
+enum TextEncoding {
+	TEXT_ENCODING_DETECT,  /* UTF-16 if the file starts with a byte order mark, UTF-8 otherwise */
+	TEXT_ENCODING_UTF8,
+	TEXT_ENCODING_LATIN1,  /* ISO-8859-1 */
+	TEXT_ENCODING_UTF16LE,
+	TEXT_ENCODING_UTF16BE,
+};
+
+/* like text_load but the file content is converted from the given encoding.
+ * the file remains mapped and is transcoded to UTF-8 in chunks as they are
+ * first accessed. saving converts the text back, a byte order mark is kept.
+ * invalid input is replaced by U+FFFD, saving characters not representable
+ * in Latin-1 fails with EILSEQ. */
+Text *text_load_encoding(const char *filename, enum TextEncoding);
+/* encoding in which the text is saved, never TEXT_ENCODING_DETECT */
+enum TextEncoding text_encoding(Text*);
 /* file information at time of load or last save */
 struct stat text_stat(Text*);
+/* append up to `size' bytes read from `fd' to the end of the text. the data is
+ * treated like loaded file content, i.e. it is part of all states of the editing
+ * history and can not be undone, but it is considered unsaved. returns the
+ * number of bytes read, 0 at end of file or -1 on error, e.g. EAGAIN if `fd'
+ * is non-blocking and no data is available. */
+ssize_t text_load_fd(Text*, int fd, size_t size);
+/* append the data by which the file `filename' grew since it was loaded, saved
+ * or last followed, i.e. the file is expected to be only ever appended to. the
+ * data is considered saved if the text was not modified otherwise. returns the
+ * number of bytes appended or -1 on error, errno is set to ESTALE if the file
+ * was replaced or truncated in the meantime, ENOTSUP if the file is transcoded. */
+ssize_t text_follow(Text*, const char *filename);
+
+typedef struct {
+	size_t lines;        /* number of new lines */
+	size_t longest_line; /* length in bytes of the longest line, without its \n */
+	bool crlf;           /* whether the first line is terminated by \r\n */
+	bool binary;         /* whether NUL bytes are contained */
+	bool utf8;           /* whether the content is valid UTF-8 */
+} TextLoadInfo;
+
+/* properties of the file content as loaded, they are determined by a single
+ * pass over it which also provides the new line index. large files are
+ * scanned in the background, false is returned until that is completed. */
+bool text_load_info(Text*, TextLoadInfo*);
+/* whether line numbers can be determined without waiting for the background
+ * scan, that is text_lineno_by_pos and friends do not block */
+bool text_lines_ready(Text*);
+
+typedef struct {
+	size_t pieces;  /* number of pieces allocated since load */
+	size_t changes; /* number of changes allocated since load */
+	size_t actions; /* number of actions allocated since load */
+	size_t memory;  /* bytes reserved for all of them */
+	size_t buffers; /* bytes of insertion buffers kept in memory, compressed or not */
+	size_t used;    /* bytes of data actually stored in them */
+	size_t spilled; /* bytes of insertion buffers moved to the history file */
+	size_t decoded; /* bytes of transcoded file content decoded so far */
+} TextAllocStats;
+
+/* statistics about the memory used to keep track of the editing history */
+TextAllocStats text_alloc_stats(Text*);
+
+typedef struct {
+	size_t committed;     /* bytes of buffer memory currently in use by all texts */
+	size_t pooled;        /* bytes of address space of released buffers kept for reuse */
+	size_t compressed;    /* bytes of buffer data held in compressed form */
+	size_t packed;        /* bytes of memory occupied by the compressed data */
+	size_t unpacks;       /* number of buffers decompressed because they were accessed */
+	uint64_t unpack_time; /* total time in nanoseconds spent doing so */
+	uint64_t unpack_max;  /* longest time taken by one of them */
+} TextPoolStats;
+
+/* statistics about the buffer memory shared by all texts of the process */
+TextPoolStats text_pool_stats(void);
+/* limit the memory used by insertion buffers to `size' bytes (0 means no
+ * limit). older buffers exceeding it are moved to an unlinked temporary file
+ * from which they are paged back in on demand, e.g. by undo. */
+void text_history_limit(Text*, size_t size);
+/* compress the insertion buffers which were not accessed since the previous
+ * call, their data is transparently decompressed once it is needed again.
+ * hence pointers to text data, as held by iterators or obtained by
+ * text_chunks_get, are invalidated. this must not be called while snapshots
+ * of the text are used by other threads, background saves are waited for.
+ * returns whether there are buffers which might be compressed by a later call. */
+bool text_compress(Text*);
+/* store the editing history in an undo file, appending only what was not yet
+ * written by a previous call. the history is associated with the state of the
+ * last save, hence this should be called after text_save. */
+bool text_history_save(Text*, const char *filename);
+/* restore the editing history from an undo file. this only succeeds for an
+ * unmodified text whose content is the one saved along with the history. the
+ * insertion buffers are then mapped from the undo file. */
+bool text_history_load(Text*, const char *filename);
+/* keep the new line index of a large file in an index file, such that the
+ * file need not be scanned again once it is reopened. if `filename' holds an
+ * index of the loaded file, as identified by its device, inode, size and
+ * modification time, it replaces the pending background scan. otherwise it
+ * is written there once the scan completes. this has to be called right after
+ * loading, before the line index is used. returns false and sets errno to
+ * ENOTSUP if the file is too small or not scanned in the background. */
+bool text_lines_index(Text*, const char *filename);
 bool text_appendf(Text*, const char *format, ...);
 bool text_printf(Text*, size_t pos, const char *format, ...);
 bool text_vprintf(Text*, size_t pos, const char *format, va_list ap);
@@ -46,6 +148,23 @@ bool text_insert(Text*, size_t pos, const char *data, size_t len);
 /* delete `len' bytes starting from `pos' */
 bool text_delete(Text*, size_t pos, size_t len);
 bool text_delete_range(Text*, Filerange*);
+/* batched modifications: the edits registered by text_edit_apply are only
+ * performed by text_edit_commit. until then the text remains unchanged and
+ * all positions refer to it. edits are applied in order of their position
+ * (those at the same position in the order they were registered), edits
+ * overlapping a preceding one are ignored. like individual insertions and
+ * deletions they become part of the current action. */
+void text_edit_begin(Text*);
+/* replace `len' bytes starting from `pos' with `data_len' bytes of `data' */
+bool text_edit_apply(Text*, size_t pos, size_t len, const char *data, size_t data_len);
+/* perform all registered edits. on failure none of them is, the text remains
+ * unchanged and the edits should be discarded with text_edit_abort */
+bool text_edit_commit(Text*);
+/* discard the registered edits, leaving the text unchanged */
+void text_edit_abort(Text*);
+/* map a position relative to the text before the last commit to the
+ * modified one, positions within a deleted range map to its replacement */
+size_t text_edit_pos(Text*, size_t pos);
 /* mark the current text state, such that it can be {un,re}done */
 void text_snapshot(Text*);
 /* undo/redo to the last snapshotted state. returns the position where
@@ -60,6 +179,28 @@ size_t text_restore(Text*, time_t);
 /* get creation time of current state */
 time_t text_state(Text*);
 
+typedef struct TextSnapshot TextSnapshot;
+/* get a read only view of the current text content. it remains unchanged and
+ * valid even if the text is modified or freed, until the last reference to it
+ * is dropped. as long as the text is not modified, the same snapshot is
+ * returned at no cost. the snapshot and iterators obtained from it can be used
+ * from other threads, while the text itself is further modified by its owner.
+ * only the reference counting of the snapshot is synchronized, hence handing
+ * it over to another thread has to be. */
+TextSnapshot *text_snapshot_ref(Text*);
+/* get a snapshot of the given range only, its content starts at position 0 */
+TextSnapshot *text_snapshot_range(Text*, Filerange*);
+void text_snapshot_unref(TextSnapshot*);
+size_t text_snapshot_size(TextSnapshot*);
+/* whether the snapshot refers to the buffers of the given text */
+bool text_snapshot_of(TextSnapshot*, Text*);
+size_t text_snapshot_bytes_get(TextSnapshot*, size_t pos, size_t len, char *buf);
+size_t text_snapshot_chunks_get(TextSnapshot*, Filerange*, struct iovec *iov, size_t count);
+/* insert a copy of the snapshot content at `pos' */
+bool text_insert_snapshot(Text*, size_t pos, TextSnapshot*);
+/* iterate over the snapshot with the usual text_iterator_* functions */
+Iterator text_snapshot_iterator_get(TextSnapshot*, size_t pos);
+
 size_t text_pos_by_lineno(Text*, size_t lineno);
 size_t text_lineno_by_pos(Text*, size_t pos);
 
@@ -70,6 +211,11 @@ bool text_byte_get(Text*, size_t pos, char *buf);
  * indicates how many bytes were copied into `buf'. WARNING buf will not be
  * NUL terminated. */
 size_t text_bytes_get(Text*, size_t pos, size_t len, char *buf);
+/* store pointers to at most `count' consecutive chunks of the text data in
+ * range `r' into `iov' without copying it. range start is advanced past the
+ * data they cover, hence repeated calls process the whole range. returns the
+ * number of chunks stored, they remain valid until the text is modified. */
+size_t text_chunks_get(Text*, Filerange *r, struct iovec *iov, size_t count);
 
 Iterator text_iterator_get(Text*, size_t pos);
 bool text_iterator_valid(const Iterator*);
@@ -97,16 +243,56 @@ Mark text_mark_set(Text*, size_t pos);
  * deleted. If the change is later restored the mark will once again be
  * valid. */
 size_t text_mark_get(Text*, Mark);
+/* resolve count marks at once, storing their positions (or EPOS) in pos.
+ * marks sorted by position are resolved without consulting the index
+ * as long as they are close to each other. */
+void text_marks_get(Text*, const Mark *marks, size_t *pos, size_t count);
 
 /* get position of change denoted by index, where 0 indicates the most recent */
 size_t text_history_get(Text*, size_t index);
 /* return the size in bytes of the whole text */
 size_t text_size(Text*);
-/* query whether the text contains any unsaved modifications */
+/* query whether the text contains any unsaved modifications. modifications
+ * which were reverted, e.g. by undo or by editing, are not counted as such
+ * as long as the content hash of the saved state is known, see text_hash. */
 bool text_modified(Text*);
+/* Content hashes, equal content yields equal hashes regardless of how it was
+ * edited. they are composed from hashes cached per piece, such that they are
+ * cheap to recompute after modifications. different content of length n has
+ * the same hash with probability n/2^61. the hashes remain the same across
+ * processes and can be stored. */
+uint64_t text_hash(Text*);
+uint64_t text_hash_range(Text*, const Filerange*);
+/* query whether the file content is (still) the one the text was last loaded
+ * from or saved to, by comparing its hash. useful if the file was touched, but
+ * not necessarily modified by another process. */
+bool text_file_unchanged(Text*, const char *filename);
+/* query whether the file, which still holds the content the text was last
+ * loaded from or saved to, equals the current text. unless the text is still
+ * in that state, the content is compared byte by byte. */
+bool text_file_current(Text*, const char *filename);
 /* query whether `addr` is part of a memory mapped region associated with
  * this text instance */
 bool text_sigbus(Text*, const char *addr);
+/* make the memory mapped page holding `addr' readable again, by replacing it
+ * with zero bytes. this is meant to be called from a SIGBUS handler for which
+ * text_sigbus returned true, such that the faulting access can be completed. */
+bool text_sigbus_recover(Text*, const char *addr);
+/* abort the file access of the calling thread which raised SIGBUS, if it is
+ * part of a load time scan or a save. this does not return unless the thread
+ * has no such access in progress. any other access of the scanner or writer
+ * thread to `addr' is recovered as by text_sigbus_recover, in which case true
+ * is returned, false if the address is not read by the calling thread. */
+bool text_sigbus_abort(const char *addr);
+/* query whether the text refers to memory mapped file content, which changes
+ * if the file is modified by another process */
+bool text_mapped(Text*);
+/* replace the memory mappings of the file content by private copies, such that
+ * modifications of the file by other processes no longer affect the text. the
+ * content is copied as currently found in the file, data beyond its end reads
+ * as zero bytes whose number is stored in `lost'. a pending background save
+ * has to be completed first, otherwise false is returned with errno EBUSY. */
+bool text_private(Text*, size_t *lost);
 
 /* which type of new lines does the text use? */
 enum TextNewLine {
@@ -125,6 +311,37 @@ bool text_save_range(Text*, Filerange*, const char *file);
  * number of bytes written or -1 in case there was an error. */
 ssize_t text_write(Text*, int fd);
 ssize_t text_write_range(Text*, Filerange*, int fd);
+
+typedef struct TextSave TextSave;
+/* save the range to `filename' in a separate thread, which writes a snapshot
+ * of the text as of now. the text can be further modified in the meantime,
+ * but not saved otherwise until it is finished. this only works if the file can be
+ * replaced atomically, otherwise NULL is returned and text_save_range has to
+ * be used instead. */
+TextSave *text_save_begin(Text*, Filerange*, const char *filename);
+/* number of bytes written so far, `total' is set to the number of bytes to write */
+size_t text_save_progress(TextSave*, size_t *total);
+/* query whether the save completed, such that text_save_finish does not block */
+bool text_save_done(TextSave*);
+/* wait for the save to complete and release it. if it was successful, the text
+ * state at the time of text_save_begin is considered saved. */
+bool text_save_finish(TextSave*);
+/* record all further modifications in an append-only journal `filename',
+ * which is created anew. after a crash they can be recovered by applying it
+ * to the file content it was started with. upon save the journal starts
+ * over with the saved content. */
+bool text_journal_open(Text*, const char *filename);
+/* apply the modifications recorded in the journal to the unmodified text,
+ * which has to be loaded from the same file content. further modifications
+ * are appended to the journal. */
+bool text_journal_recover(Text*, const char *filename);
+/* write the recorded modifications to the journal, if `sync' is true they
+ * are also made durable using fsync(2). journaling stops if this fails. */
+bool text_journal_flush(Text*, bool sync);
+/* query whether modifications were recorded since the last sync */
+bool text_journal_pending(Text*);
+/* stop journaling and remove the journal file */
+void text_journal_close(Text*);
 /* release all ressources associated with this text instance */
 void text_free(Text*);
 
@@ -640,15 +640,39 @@ static void ui_window_draw_status(UiWin *w) {
 	const char *filename = vis_file_name(win->file);
 	const char *status = vis_mode_status(vis);
 	CursorPos pos = view_cursor_getpos(win->view);
+	Text *txt = vis_file_text(win->file);
+	TextLoadInfo info;
+	const char *content = "";
+	if (text_load_info(txt, &info))
+		content = info.binary ? "[binary]" : !info.utf8 ? "[non UTF-8]" : "";
+	ssize_t loaded = vis_file_load_progress(win->file);
+	char loading[sizeof "[loading 18446744073709551615K]"] = "";
+	if (loaded >= 0) {
+		bool mb = loaded >= 1 << 20;
+		snprintf(loading, sizeof loading, "[loading %zd%c]", loaded >> (mb ? 20 : 10), mb ? 'M' : 'K');
+	}
+	int progress = vis_file_save_progress(win->file);
+	char saving[sizeof "[writing -2147483648%]"] = "";
+	if (progress >= 0)
+		snprintf(saving, sizeof saving, "[writing %d%%]", progress);
 	wattrset(win->winstatus, focused ? A_REVERSE|A_BOLD : A_REVERSE);
 	mvwhline(win->winstatus, 0, 0, ' ', win->width);
-	mvwprintw(win->winstatus, 0, 0, "%s %s %s %s",
+	mvwprintw(win->winstatus, 0, 0, "%s %s %s %s %s %s %s %s",
 	          focused && status ? status : "",
 	          filename ? filename : "[No Name]",
-	          text_modified(vis_file_text(win->file)) ? "[+]" : "",
+	          text_modified(txt) ? "[+]" : "",
+	          content,
+	          view_large_get(win->view) ? "[large]" : "",
+	          loading,
+	          saving,
 	          vis_macro_recording(vis) ? "recording": "");
 	char buf[win->width + 1];
-	int len = snprintf(buf, win->width, "%zd, %zd", pos.line, pos.col);
+	int len;
+	if (view_hex_get(win->view))
+		len = snprintf(buf, win->width, "0x%zx", view_cursor_get(win->view));
+	else
+		len = snprintf(buf, win->width, "%s%zd, %zd",
+		               view_lines_estimated(win->view) ? "~" : "", pos.line, pos.col);
 	if (len > 0) {
 		buf[len] = '\0';
 		mvwaddstr(win->winstatus, 0, win->width - len - 1, buf);
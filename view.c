@@ -88,6 +88,11 @@ struct View {
 	char *lexer_name;
 	bool need_update;   /* whether view has been redrawn */
 	int colorcolumn;
+	bool large;         /* whether the budgets of large file mode apply, see view_large_set */
+	bool estimated;     /* whether the displayed line numbers are estimates */
+	bool hex;           /* whether the content is displayed as rows of hex bytes */
+	size_t hex_bytes;   /* number of bytes per row in hex mode */
+	int hex_digits;     /* number of hex digits used to display the row offsets */
 };
 
 static const SyntaxSymbol symbols_none[] = {
@@ -121,6 +126,129 @@ void view_tabwidth_set(View *view, int tabwidth) {
 	view_draw(view);
 }
 
+/* estimate the line number of `pos' based on the new line density of the
+ * preceding bytes, exact if they are all considered */
+static size_t lineno_estimate(Text *txt, size_t pos) {
+	char sample[16384];
+	size_t start = pos > sizeof sample ? pos - sizeof sample : 0;
+	size_t len = text_bytes_get(txt, start, pos - start, sample);
+	size_t lines = 0;
+	for (const char *cur = sample, *end = sample + len; (cur = memchr(cur, '\n', end - cur)); cur++)
+		lines++;
+	if (start == 0 || len == 0)
+		return lines + 1;
+	return (size_t)((double)pos * lines / len) + 1;
+}
+
+/* In hex mode each screen line displays a fixed number of bytes as a row
+ *
+ *   00000040  7f 45 4c 46 02 01 01 00  .ELF....
+ *
+ * consisting of the offset of its first byte, a cell per byte holding its
+ * value in hex and the corresponding characters, non-printable ones as '.'.
+ * rows start at multiples of the row length, hence the screen coordinates of
+ * an offset are computed without looking at the content. */
+
+/* determine the row layout based on the window width and the file size */
+static void hex_layout(View *view) {
+	size_t size = text_size(view->text);
+	int digits = 8;
+	while (digits < 16 && (size >> (4 * digits)))
+		digits++;
+	/* offset and two spaces, per byte three columns and one character
+	 * and a space in front of the latter */
+	int avail = view->width - digits - 3;
+	size_t bytes = avail >= 4 ? avail / 4 : 1;
+	if (bytes > 8)
+		bytes -= bytes % 8;
+	view->hex_digits = digits;
+	view->hex_bytes = bytes;
+}
+
+/* column of the hex value of the i-th byte of a row */
+static int hex_col(View *view, size_t i) {
+	return view->hex_digits + 2 + 3 * i;
+}
+
+/* column of the character of the i-th byte of a row */
+static int hex_char_col(View *view, size_t i) {
+	return hex_col(view, view->hex_bytes) + 1 + i;
+}
+
+static const char hex_digits[] = "0123456789abcdef";
+
+/* clear a line and display the offset of the row starting at `pos' */
+static void hex_row(View *view, Line *line, size_t pos, size_t lineno) {
+	for (int x = 0; x < view->width; x++)
+		line->cells[x] = cell_blank;
+	for (int x = view->hex_digits - 1; x >= 0; x--, pos >>= 4) {
+		if (x < view->width) {
+			line->cells[x] = (Cell){ .data = { hex_digits[pos & 0xf] }, .width = 1 };
+			line->cells[x].attr = UI_STYLE_LINENUMBER;
+		}
+	}
+	line->lineno = lineno;
+	line->len = 0;
+	line->width = MIN(view->width, hex_col(view, 0));
+}
+
+/* append a byte to a row */
+static void hex_byte(View *view, Line *line, unsigned char c) {
+	size_t i = line->len++;
+	int col = hex_col(view, i);
+	if (col + 1 < view->width) {
+		line->cells[col] = (Cell){ .data = { hex_digits[c >> 4], hex_digits[c & 0xf] }, .len = 1, .width = 2 };
+		line->cells[col+1] = cell_unused;
+	}
+	col = hex_char_col(view, i);
+	if (col < view->width)
+		line->cells[col] = (Cell){ .data = { c < 128 && isprint(c) ? c : '.' }, .width = 1 };
+	line->width = MIN(view->width, col + 1);
+}
+
+/* fill the screen lines with rows of bytes taken directly from the chunks of
+ * the text, no multibyte decoding is done */
+static void hex_draw(View *view) {
+	size_t pos = view->start, lineno = view->topline->lineno;
+	Filerange r = { pos, pos + view->height * view->hex_bytes };
+	Line *line = view->topline;
+	hex_row(view, line, pos, lineno);
+	struct iovec iov[16];
+	for (size_t n; line && (n = text_chunks_get(view->text, &r, iov, LENGTH(iov))); ) {
+		for (size_t i = 0; i < n && line; i++) {
+			const unsigned char *data = iov[i].iov_base;
+			for (size_t j = 0; j < iov[i].iov_len; j++, pos++) {
+				if (line->len == view->hex_bytes) {
+					if (!(line = line->next))
+						break;
+					hex_row(view, line, pos, ++lineno);
+				}
+				hex_byte(view, line, data[j]);
+			}
+		}
+	}
+	/* the end of the file is displayed after the last byte, if that
+	 * completes a row the following one is used */
+	if (line && line->len == view->hex_bytes && pos == text_size(view->text) && line->next) {
+		line = line->next;
+		hex_row(view, line, pos, ++lineno);
+	}
+	view->end = pos;
+	view->lastline = line ? line : view->bottomline;
+	view->line = NULL;
+}
+
+/* whether the byte at `pos' is displayed, the end of the file is displayed
+ * in the row following the last one if that is complete */
+static bool hex_visible(View *view, size_t pos) {
+	if (pos < view->start || pos > view->end)
+		return false;
+	if (pos < view->end)
+		return true;
+	return pos == text_size(view->text) &&
+	       (pos - view->start) / view->hex_bytes < (size_t)view->height;
+}
+
 /* reset internal view data structures (cell matrix, line offsets etc.) */
 static void view_clear(View *view) {
 	if (view->start != view->start_last) {
@@ -130,9 +258,21 @@ static void view_clear(View *view) {
 		if (start != EPOS)
 			view->start = start;
 	}
+	if (view->hex) {
+		hex_layout(view);
+		view->start -= view->start % view->hex_bytes;
+	}
 	view->start_last = view->start;
 	view->topline = view->lines;
-	view->topline->lineno = text_lineno_by_pos(view->text, view->start);
+	/* in large file mode the line numbers are estimated rather than
+	 * waiting for the background scan of the file to complete */
+	view->estimated = view->large && !text_lines_ready(view->text) && !view->hex;
+	if (view->hex)
+		view->topline->lineno = view->start / view->hex_bytes + 1;
+	else if (view->estimated)
+		view->topline->lineno = lineno_estimate(view->text, view->start);
+	else
+		view->topline->lineno = text_lineno_by_pos(view->text, view->start);
 	view->lastline = view->topline;
 
 	/* reset all other lines */
@@ -258,6 +398,8 @@ static bool view_addch(View *view, Cell *cell) {
 CursorPos view_cursor_getpos(View *view) {
 	Cursor *cursor = view->cursor;
 	Line *line = cursor->line;
+	if (view->hex)
+		return (CursorPos){ .line = line->lineno, .col = cursor->pos % view->hex_bytes + 1 };
 	CursorPos pos = { .line = line->lineno, .col = cursor->col };
 	while (line->prev && line->prev->lineno == pos.line) {
 		line = line->prev;
@@ -267,6 +409,19 @@ CursorPos view_cursor_getpos(View *view) {
 	return pos;
 }
 
+/* in hex mode the cursor moves by bytes rather than characters */
+static size_t char_next(View *view, size_t pos) {
+	if (view->hex)
+		return pos < text_size(view->text) ? pos + 1 : pos;
+	return text_char_next(view->text, pos);
+}
+
+static size_t char_prev(View *view, size_t pos) {
+	if (view->hex)
+		return pos > 0 ? pos - 1 : pos;
+	return text_char_prev(view->text, pos);
+}
+
 static void cursor_to(Cursor *c, size_t pos) {
 	Text *txt = c->view->text;
 	c->mark = text_mark_set(txt, pos);
@@ -279,15 +434,15 @@ static void cursor_to(Cursor *c, size_t pos) {
 		/* do we have to change the orientation of the selection? */
 		if (pos < anchor && anchor < cursor) {
 			/* right extend -> left extend  */
-			anchor = text_char_next(txt, anchor);
+			anchor = char_next(c->view, anchor);
 			c->sel->anchor = text_mark_set(txt, anchor);
 		} else if (cursor < anchor && anchor <= pos) {
 			/* left extend  -> right extend */
-			anchor = text_char_prev(txt, anchor);
+			anchor = char_prev(c->view, anchor);
 			c->sel->anchor = text_mark_set(txt, anchor);
 		}
 		if (anchor <= pos)
-			pos = text_char_next(txt, pos);
+			pos = char_next(c->view, pos);
 		c->sel->cursor = text_mark_set(txt, pos);
 	}
 	if (!view_coord_get(c->view, pos, &c->line, &c->row, &c->col)) {
@@ -307,13 +462,24 @@ static bool view_coord_get(View *view, size_t pos, Line **retline, int *retrow,
 	size_t cur = view->start;
 	Line *line = view->topline;
 
-	if (pos < view->start || pos > view->end) {
+	if (pos < view->start || pos > view->end || (view->hex && !hex_visible(view, pos))) {
 		if (retline) *retline = NULL;
 		if (retrow) *retrow = -1;
 		if (retcol) *retcol = -1;
 		return false;
 	}
 
+	if (view->hex) {
+		row = (pos - view->start) / view->hex_bytes;
+		col = MIN(hex_col(view, pos % view->hex_bytes), view->width - 1);
+		size_t line_size = sizeof(Line) + view->width*sizeof(Cell);
+		line = (Line*)(((char*)view->topline) + row * line_size);
+		if (retline) *retline = line;
+		if (retrow) *retrow = row;
+		if (retcol) *retcol = col;
+		return true;
+	}
+
 	while (line && line != view->lastline && cur < pos) {
 		if (cur + line->len > pos)
 			break;
@@ -346,10 +512,9 @@ void view_cursor_to(View *view, size_t pos) {
 	view_cursors_to(view->cursor, pos);
 }
 
-/* redraw the complete with data starting from view->start bytes into the file.
- * stop once the screen is full, update view->end, view->lastline */
-void view_draw(View *view) {
-	view_clear(view);
+/* fill the screen lines with the text starting from view->start bytes into
+ * the file, stop once the screen is full */
+static void text_draw(View *view) {
 	/* read a screenful of text */
 	const size_t text_size = view->width * view->height;
 	/* current buffer to work with */
@@ -369,11 +534,14 @@ void view_draw(View *view) {
 
 		/* current 'parsed' character' */
 		wchar_t wchar;
+		size_t len;
 		Cell cell;
 		memset(&cell, 0, sizeof cell);
 
-		size_t len = mbrtowc(&wchar, cur, rem, &mbstate);
-		if (len == (size_t)-1 && errno == EILSEQ) {
+		if ((unsigned char)cur[0] < 0x80 && cur[0] && mbsinit(&mbstate)) {
+			/* ASCII characters need no conversion */
+			cell = (Cell){ .data = { cur[0] }, .len = 1, .width = 1, .istab = false };
+		} else if ((len = mbrtowc(&wchar, cur, rem, &mbstate)) == (size_t)-1 && errno == EILSEQ) {
 			/* ok, we encountered an invalid multibyte sequence,
 			 * replace it with the Unicode Replacement Character
 			 * (FFFD) and skip until the start of the next utf8 char */
@@ -424,23 +592,48 @@ void view_draw(View *view) {
 		for (int x = view->col; x < view->width; x++)
 			view->line->cells[x] = cell_blank;
 	}
+}
 
-	/* resync position of cursors within visible area */
-	for (Cursor *c = view->cursors; c; c = c->next) {
-		size_t pos = view_cursors_pos(c);
-		if (view_coord_get(view, pos, &c->line, &c->row, &c->col)) {
-			c->line->cells[c->col].cursor = true;
-			if (view->ui && !c->sel) {
-				Line *line_match; int col_match;
-				size_t pos_match = text_bracket_match_except(view->text, pos, "<>");
-				if (pos != pos_match && view_coord_get(view, pos_match, &line_match, NULL, &col_match)) {
-					line_match->cells[col_match].selected = true;
+/* redraw the complete with data starting from view->start bytes into the file.
+ * stop once the screen is full, update view->end, view->lastline */
+void view_draw(View *view) {
+	view_clear(view);
+	if (view->hex)
+		hex_draw(view);
+	else
+		text_draw(view);
+
+	/* resync position of cursors within visible area, their marks are
+	 * resolved in batches */
+	for (Cursor *c = view->cursors; c; ) {
+		Mark marks[64];
+		size_t positions[LENGTH(marks)];
+		size_t count = 0;
+		for (Cursor *cur = c; cur && count < LENGTH(marks); cur = cur->next)
+			marks[count++] = cur->mark;
+		text_marks_get(view->text, marks, positions, count);
+		for (size_t i = 0; i < count; i++, c = c->next) {
+			size_t pos = positions[i];
+			if (view_coord_get(view, pos, &c->line, &c->row, &c->col)) {
+				c->line->cells[c->col].cursor = true;
+				if (view->hex) {
+					int col = hex_char_col(view, pos % view->hex_bytes);
+					if (col < view->width)
+						c->line->cells[col].cursor = true;
+				} else if (view->ui && !c->sel) {
+					Line *line_match; int col_match;
+					/* a match outside the viewport is not shown */
+					Filerange viewport = { view->start, view->end };
+					size_t pos_match = text_bracket_match_range(view->text, pos, "<>", &viewport);
+					if (pos != pos_match && view_coord_get(view, pos_match, &line_match, NULL, &col_match)) {
+						line_match->cells[col_match].selected = true;
+					}
 				}
+			} else if (c == view->cursor) {
+				c->line = view->topline;
+				c->row = 0;
+				c->col = 0;
 			}
-		} else if (c == view->cursor) {
-			c->line = view->topline;
-			c->row = 0;
-			c->col = 0;
 		}
 	}
 
@@ -451,8 +644,8 @@ void view_update(View *view) {
 	if (!view->need_update)
 		return;
 	/* maximal number of bytes to consider for syntax highlighting before
-	 * the visible area */
-	const size_t lexer_before_max = 16384;
+	 * the visible area, in large file mode only the latter is lexed */
+	const size_t lexer_before_max = view->large ? 0 : 16384;
 	/* absolute position to start syntax highlighting */
 	const size_t lexer_start = view->start >= lexer_before_max ? view->start - lexer_before_max : 0;
 	/* number of bytes used for syntax highlighting before visible are */
@@ -467,7 +660,7 @@ void view_update(View *view) {
 	text[text_len] = '\0';
 
 	lua_State *L = view->lua;
-	if (L && view->lexer_name) {
+	if (L && view->lexer_name && !view->hex) {
 
 		lua_getglobal(L, "vis");
 		lua_getfield(L, -1, "lexers");
@@ -531,7 +724,7 @@ void view_update(View *view) {
 		lua_pop(L, 3); /* _TOKENSTYLES, language specific lexer, lexers global */
 	}
 
-	if (view->colorcolumn > 0 && view->colorcolumn <= view->width) {
+	if (view->colorcolumn > 0 && view->colorcolumn <= view->width && !view->hex) {
 		size_t lineno = 0;
 		for (Line *l = view->topline; l; l = l->next) {
 			if (l->lineno != lineno)
@@ -551,7 +744,24 @@ void view_update(View *view) {
 
 	for (Selection *s = view->selections; s; s = s->next) {
 		Filerange sel = view_selections_get(s);
-		if (text_range_valid(&sel)) {
+		if (text_range_valid(&sel) && view->hex) {
+			size_t start = MAX(sel.start, view->start);
+			size_t end = MIN(sel.end, view->end);
+			for (size_t pos = start; pos < end; pos++) {
+				Line *line;
+				int col;
+				if (!view_coord_get(view, pos, &line, NULL, &col))
+					continue;
+				line->cells[col].selected = true;
+				if (col + 1 < view->width)
+					line->cells[col+1].selected = true;
+				col = hex_char_col(view, pos % view->hex_bytes);
+				if (col < view->width)
+					line->cells[col].selected = true;
+			}
+			if (view->events && view->events->selection)
+				view->events->selection(view->events->data, &sel);
+		} else if (text_range_valid(&sel)) {
 			Line *start_line; int start_col;
 			Line *end_line; int end_col;
 			view_coord_get(view, sel.start, &start_line, NULL, &start_col);
@@ -711,6 +921,12 @@ bool view_viewport_up(View *view, int n) {
 	 */
 	if (view->start == 0)
 		return false;
+	if (view->hex) {
+		size_t len = n * view->hex_bytes;
+		view->start = view->start > len ? view->start - len : 0;
+		view_draw(view);
+		return true;
+	}
 	size_t max = view->width * view->height;
 	char c;
 	Iterator it = text_iterator_get(view->text, view->start - 1);
@@ -825,6 +1041,8 @@ size_t view_scroll_down(View *view, int lines) {
 }
 
 size_t view_line_up(Cursor *cursor) {
+	if (cursor->view->hex)
+		return view_screenline_up(cursor);
 	if (cursor->line && cursor->line->prev && cursor->line->prev->prev &&
 	    cursor->line->lineno != cursor->line->prev->lineno &&
 	    cursor->line->prev->lineno != cursor->line->prev->prev->lineno)
@@ -835,6 +1053,8 @@ size_t view_line_up(Cursor *cursor) {
 }
 
 size_t view_line_down(Cursor *cursor) {
+	if (cursor->view->hex)
+		return view_screenline_down(cursor);
 	if (cursor->line && (!cursor->line->next || cursor->line->next->lineno != cursor->line->lineno))
 		return view_screenline_down(cursor);
 	size_t pos = text_line_down(cursor->view->text, cursor->pos);
@@ -842,6 +1062,34 @@ size_t view_line_down(Cursor *cursor) {
 	return pos;
 }
 
+size_t view_char_next(Cursor *cursor) {
+	size_t pos = char_next(cursor->view, view_cursors_pos(cursor));
+	view_cursors_to(cursor, pos);
+	return pos;
+}
+
+size_t view_char_prev(Cursor *cursor) {
+	size_t pos = char_prev(cursor->view, view_cursors_pos(cursor));
+	view_cursors_to(cursor, pos);
+	return pos;
+}
+
+size_t view_line_char_next(Cursor *cursor) {
+	View *view = cursor->view;
+	size_t pos = view_cursors_pos(cursor);
+	pos = view->hex ? char_next(view, pos) : text_line_char_next(view->text, pos);
+	view_cursors_to(cursor, pos);
+	return pos;
+}
+
+size_t view_line_char_prev(Cursor *cursor) {
+	View *view = cursor->view;
+	size_t pos = view_cursors_pos(cursor);
+	pos = view->hex ? char_prev(view, pos) : text_line_char_prev(view->text, pos);
+	view_cursors_to(cursor, pos);
+	return pos;
+}
+
 size_t view_screenline_up(Cursor *cursor) {
 	int lastcol = cursor->lastcol;
 	if (!lastcol)
@@ -1007,6 +1255,36 @@ int view_colorcolumn_get(View *view) {
 	return view->colorcolumn;
 }
 
+void view_large_set(View *view, bool large) {
+	if (view->large == large)
+		return;
+	view->large = large;
+	view_draw(view);
+}
+
+bool view_large_get(View *view) {
+	return view->large;
+}
+
+bool view_lines_estimated(View *view) {
+	return view->estimated;
+}
+
+void view_hex_set(View *view, bool hex) {
+	if (view->hex == hex)
+		return;
+	size_t pos = view_cursor_get(view);
+	view->hex = hex;
+	if (!hex)
+		view->start = text_line_begin(view->text, view->start);
+	view_draw(view);
+	view_cursor_to(view, pos);
+}
+
+bool view_hex_get(View *view) {
+	return view->hex;
+}
+
 size_t view_screenline_goto(View *view, int n) {
 	size_t pos = view->start;
 	for (Line *line = view->topline; --n > 0 && line != view->lastline; line = line->next)
@@ -1100,7 +1378,17 @@ void view_cursors_to(Cursor *c, size_t pos) {
 		c->mark = text_mark_set(view->text, pos);
 
 		size_t max = text_size(view->text);
-		if (pos == max && view->end != max) {
+		if (view->hex) {
+			/* scroll such that the row containing pos becomes the
+			 * first or last one, depending on the direction */
+			size_t row = pos - pos % view->hex_bytes;
+			size_t rows = (view->height - 1) * view->hex_bytes;
+			if (pos < view->start)
+				view->start = row;
+			else if (!hex_visible(view, pos))
+				view->start = row > rows ? row - rows : 0;
+			view_draw(view);
+		} else if (pos == max && view->end != max) {
 			/* do not display an empty screen when shoviewg the end of the file */
 			view->start = pos;
 			view_viewport_up(view, view->height / 2);
@@ -63,6 +63,12 @@ void view_tabwidth_set(View*, int tabwidth);
  * they return new cursor postion */
 size_t view_line_down(Cursor*);
 size_t view_line_up(Cursor*);
+/* move to the next/previous character, in hex mode byte */
+size_t view_char_next(Cursor*);
+size_t view_char_prev(Cursor*);
+/* same as above but stop at the line boundaries unless in hex mode */
+size_t view_line_char_next(Cursor*);
+size_t view_line_char_prev(Cursor*);
 size_t view_screenline_down(Cursor*);
 size_t view_screenline_up(Cursor*);
 size_t view_screenline_begin(Cursor*);
@@ -100,6 +106,16 @@ void view_options_set(View*, enum UiOption options);
 enum UiOption view_options_get(View*);
 void view_colorcolumn_set(View*, int col);
 int view_colorcolumn_get(View*);
+/* large file mode bounds the work done per redraw: only the visible area is
+ * syntax highlighted and line numbers are estimated until they are known */
+void view_large_set(View*, bool large);
+bool view_large_get(View*);
+/* whether the line numbers of the last redraw are estimates */
+bool view_lines_estimated(View*);
+/* display the content as rows of bytes in hex along with their offset,
+ * cursors then move by bytes rather than characters */
+void view_hex_set(View*, bool hex);
+bool view_hex_get(View*);
 
 /* A view can manage multiple cursors, one of which (the main cursor) is always
  * placed within the visible viewport. All functions named view_cursor_* operate
@@ -3,6 +3,7 @@
 #include <strings.h>
 #include <stdio.h>
 #include <limits.h>
+#include <stdint.h>
 #include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -74,6 +75,9 @@ static bool cmd_saveas(Vis*, Filerange*, enum CmdOpt, const char *argv[]);
 static bool cmd_filter(Vis*, Filerange*, enum CmdOpt, const char *argv[]);
 /* switch to the previous/next saved state of the text, chronologically */
 static bool cmd_earlier_later(Vis*, Filerange*, enum CmdOpt, const char *argv[]);
+/* read data appended to the file as it grows, argv[1] optionally
+ * enables/disables it explicitly instead of toggling */
+static bool cmd_follow(Vis*, Filerange*, enum CmdOpt, const char *argv[]);
 /* dump current key bindings */
 static bool cmd_help(Vis*, Filerange*, enum CmdOpt, const char *argv[]);
 
@@ -85,6 +89,7 @@ static Command cmds[] = {
 	/* command name / optional alias, function,       options */
 	{ { "bdelete"                  }, cmd_bdelete,    CMD_OPT_FORCE },
 	{ { "edit"                     }, cmd_edit,       CMD_OPT_FORCE },
+	{ { "follow"                   }, cmd_follow,     CMD_OPT_NONE  },
 	{ { "help"                     }, cmd_help,       CMD_OPT_NONE  },
 	{ { "new"                      }, cmd_new,        CMD_OPT_NONE  },
 	{ { "open"                     }, cmd_open,       CMD_OPT_NONE  },
@@ -137,6 +142,31 @@ static bool parse_bool(const char *s, bool *outval) {
 	return false;
 }
 
+/* parse a size in bytes with an optional K, M or G suffix */
+static bool parse_size(const char *s, size_t *outval) {
+	char *end;
+	errno = 0;
+	unsigned long long size = strtoull(s, &end, 10);
+	if (errno || end == s)
+		return false;
+	int units = 0;
+	switch (*end) {
+	case 'G': case 'g': units++; /* fall through */
+	case 'M': case 'm': units++; /* fall through */
+	case 'K': case 'k': units++;
+		end++;
+	}
+	if (*end || size > SIZE_MAX)
+		return false;
+	while (units--) {
+		if (size > SIZE_MAX / 1024)
+			return false;
+		size *= 1024;
+	}
+	*outval = size;
+	return true;
+}
+
 static bool cmd_set(Vis *vis, Filerange *range, enum CmdOpt cmdopt, const char *argv[]) {
 
 	typedef struct {
@@ -161,6 +191,13 @@ static bool cmd_set(Vis *vis, Filerange *range, enum CmdOpt cmdopt, const char *
 		OPTION_CURSOR_LINE,
 		OPTION_THEME,
 		OPTION_COLOR_COLUMN,
+		OPTION_HISTORY_LIMIT,
+		OPTION_UNDOFILE,
+		OPTION_JOURNAL,
+		OPTION_ENCODING,
+		OPTION_LINEINDEX,
+		OPTION_LARGEFILE,
+		OPTION_HEX,
 	};
 
 	/* definitions have to be in the same order as the enum above */
@@ -175,6 +212,13 @@ static bool cmd_set(Vis *vis, Filerange *range, enum CmdOpt cmdopt, const char *
 		[OPTION_CURSOR_LINE]     = { { "cursorline", "cul"      }, OPTION_TYPE_BOOL   },
 		[OPTION_THEME]           = { { "theme"                  }, OPTION_TYPE_STRING },
 		[OPTION_COLOR_COLUMN]    = { { "colorcolumn", "cc"      }, OPTION_TYPE_NUMBER },
+		[OPTION_HISTORY_LIMIT]   = { { "history-limit"          }, OPTION_TYPE_STRING },
+		[OPTION_UNDOFILE]        = { { "undofile"               }, OPTION_TYPE_BOOL   },
+		[OPTION_JOURNAL]         = { { "journal"                }, OPTION_TYPE_BOOL   },
+		[OPTION_ENCODING]        = { { "encoding", "enc"        }, OPTION_TYPE_STRING, true },
+		[OPTION_LINEINDEX]       = { { "lineindex"              }, OPTION_TYPE_BOOL   },
+		[OPTION_LARGEFILE]       = { { "largefile"              }, OPTION_TYPE_STRING },
+		[OPTION_HEX]             = { { "hex"                    }, OPTION_TYPE_BOOL   },
 	};
 
 	if (!vis->options) {
@@ -338,6 +382,55 @@ static bool cmd_set(Vis *vis, Filerange *range, enum CmdOpt cmdopt, const char *
 	case OPTION_COLOR_COLUMN:
 		view_colorcolumn_set(vis->win->view, arg.i);
 		break;
+	case OPTION_HISTORY_LIMIT:
+		if (!parse_size(arg.s, &vis->history_limit)) {
+			vis_info_show(vis, "Expecting size e.g. 512M not: `%s'", arg.s);
+			return false;
+		}
+		for (File *file = vis->files; file; file = file->next)
+			text_history_limit(file->text, vis->history_limit);
+		break;
+	case OPTION_UNDOFILE:
+		vis->undofile = arg.b;
+		break;
+	case OPTION_JOURNAL:
+		vis->journal = arg.b;
+		break;
+	case OPTION_ENCODING: {
+		const char *names[] = {
+			[TEXT_ENCODING_DETECT]  = "auto",
+			[TEXT_ENCODING_UTF8]    = "utf-8",
+			[TEXT_ENCODING_LATIN1]  = "latin1",
+			[TEXT_ENCODING_UTF16LE] = "utf-16le",
+			[TEXT_ENCODING_UTF16BE] = "utf-16be",
+		};
+		if (!argv[2]) {
+			enum TextEncoding enc = text_encoding(vis->win->file->text);
+			vis_info_show(vis, "Encoding: %s, files are opened as: %s", names[enc], names[vis->encoding]);
+			return true;
+		}
+		for (int i = 0; i < LENGTH(names); i++) {
+			if (strcasecmp(argv[2], names[i]) == 0) {
+				vis->encoding = i;
+				return true;
+			}
+		}
+		vis_info_show(vis, "Expecting: auto, utf-8, latin1, utf-16le or utf-16be");
+		return false;
+	}
+	case OPTION_LINEINDEX:
+		vis->lineindex = arg.b;
+		break;
+	case OPTION_LARGEFILE:
+		if (!parse_size(arg.s, &vis->largefile)) {
+			vis_info_show(vis, "Expecting size e.g. 256M not: `%s'", arg.s);
+			return false;
+		}
+		break;
+	case OPTION_HEX:
+		vis->win->nibble = -1;
+		view_hex_set(vis->win->view, arg.b);
+		break;
 	}
 
 	return true;
@@ -409,6 +502,7 @@ static bool cmd_open(Vis *vis, Filerange *range, enum CmdOpt opt, const char *ar
 }
 
 static bool is_view_closeable(Win *win) {
+	file_save_finish(win->vis, win->file);
 	if (!text_modified(win->file->text))
 		return true;
 	return win->file->refcount > 1;
@@ -445,6 +539,7 @@ static bool cmd_quit(Vis *vis, Filerange *range, enum CmdOpt opt, const char *ar
 }
 
 static bool cmd_xit(Vis *vis, Filerange *range, enum CmdOpt opt, const char *argv[]) {
+	file_save_finish(vis, vis->win->file);
 	if (text_modified(vis->win->file->text) && !cmd_write(vis, range, opt, argv)) {
 		if (!(opt & CMD_OPT_FORCE))
 			return false;
@@ -454,6 +549,7 @@ static bool cmd_xit(Vis *vis, Filerange *range, enum CmdOpt opt, const char *arg
 
 static bool cmd_bdelete(Vis *vis, Filerange *range, enum CmdOpt opt, const char *argv[]) {
 	Text *txt = vis->win->file->text;
+	file_save_finish(vis, vis->win->file);
 	if (text_modified(txt) && !(opt & CMD_OPT_FORCE)) {
 		info_unsaved_changes(vis);
 		return false;
@@ -471,6 +567,7 @@ static bool cmd_bdelete(Vis *vis, Filerange *range, enum CmdOpt opt, const char
 static bool cmd_qall(Vis *vis, Filerange *range, enum CmdOpt opt, const char *argv[]) {
 	for (Win *next, *win = vis->windows; win; win = next) {
 		next = win->next;
+		file_save_finish(vis, win->file);
 		if (!text_modified(vis->win->file->text) || (opt & CMD_OPT_FORCE))
 			vis_window_close(win);
 	}
@@ -559,6 +656,12 @@ static bool cmd_write(Vis *vis, Filerange *range, enum CmdOpt opt, const char *a
 	if (!argv[1]) {
 		if (file->is_stdin) {
 			if (strchr(argv[0], 'q')) {
+				/* the whole input is written, not just what was read so far */
+				bool all = range->start == 0 && range->end == text_size(text);
+				if (!file_load_finish(vis, file))
+					return false;
+				if (all)
+					range->end = text_size(text);
 				ssize_t written = text_write_range(text, range, STDOUT_FILENO);
 				if (written == -1 || (size_t)written != text_range_size(range)) {
 					vis_info_show(vis, "Can not write to stdout");
@@ -576,21 +679,48 @@ static bool cmd_write(Vis *vis, Filerange *range, enum CmdOpt opt, const char *a
 	}
 	for (const char **name = &argv[1]; *name; name++) {
 		struct stat meta;
-		if (!(opt & CMD_OPT_FORCE) && file->stat.st_mtime && stat(*name, &meta) == 0 &&
-		    file->stat.st_mtime < meta.st_mtime) {
+		bool whole = file->name && strcmp(file->name, *name) == 0 &&
+		             range->start == 0 && range->end == text_size(text);
+		/* only one save can be pending, the file information has to be current */
+		file_save_finish(vis, file);
+		bool exists = stat(*name, &meta) == 0;
+		bool touched = exists && file->stat.st_mtime && file->stat.st_mtime < meta.st_mtime;
+		/* a file merely touched by someone else still holds the saved content */
+		if (touched && whole && text_file_unchanged(text, *name)) {
+			file->stat = meta;
+			touched = false;
+		}
+		if (!(opt & CMD_OPT_FORCE) && touched) {
 			vis_info_show(vis, "WARNING: file has been changed since reading it");
 			return false;
 		}
-		if (!text_save_range(text, range, *name)) {
-			vis_info_show(vis, "Can't write `%s'", *name);
+		/* writing the unmodified content to the file still holding it is
+		 * redundant, the text is merely marked as saved */
+		bool redundant = whole && exists && !touched &&
+		                 meta.st_dev == file->stat.st_dev && meta.st_ino == file->stat.st_ino &&
+		                 meta.st_size == file->stat.st_size && meta.st_mtime == file->stat.st_mtime &&
+		                 text_file_current(text, *name);
+		if (redundant) {
+			text_save_range(text, range, NULL);
+		} else if (whole && (file->save = text_save_begin(text, range, *name))) {
+			/* the whole file is written in the background, the remaining
+			 * steps are performed by file_save_finish once it completes */
+			continue;
+		} else if (!text_save_range(text, range, *name)) {
+			vis_info_show(vis, "Can't write `%s': %s", *name, strerror(errno));
 			return false;
 		}
 		if (!file->name) {
 			vis_window_name(vis->win, *name);
 			file->name = vis->win->file->name;
 		}
-		if (strcmp(file->name, *name) == 0)
-			file->stat = text_stat(text);
+		if (strcmp(file->name, *name) == 0) {
+			if (!redundant)
+				file->stat = text_stat(text);
+			if (vis->undofile && range->start == 0 && range->end == text_size(text) &&
+			    !file_history_save(file))
+				vis_info_show(vis, "Can't write undo history of `%s'", *name);
+		}
 	}
 	return true;
 }
@@ -673,27 +803,30 @@ static bool cmd_filter(Vis *vis, Filerange *range, enum CmdOpt opt, const char *
 	if (interactive)
 		*range = (Filerange){ .start = pos, .end = pos };
 
-	/* ranges which are written to the filter and read back in */
+	/* range which is written to the filter and replaced by its output */
 	Filerange rout = *range;
-	Filerange rin = (Filerange){ .start = range->end, .end = range->end };
 
 	/* The general idea is the following:
 	 *
 	 *  1) take a snapshot
 	 *  2) write [range.start, range.end] to exteneral command
-	 *  3) read the output of the external command and insert it after the range
+	 *  3) read the output of the external command and register it as
+	 *     an insertion after the range
 	 *  4) depending on the exit status of the external command
-	 *     - on success: delete original range
-	 *     - on failure: revert to previous snapshot
+	 *     - on success: delete original range and commit all changes
+	 *     - on failure: discard the registered insertions, as is done
+	 *       if they could not be stored
 	 *
 	 *  2) and 3) happend in small junks
 	 */
 
 	text_snapshot(text);
+	text_edit_begin(text);
 
 	fd_set rfds, wfds;
 	Buffer errmsg;
 	buffer_init(&errmsg);
+	bool stored = true;
 
 	do {
 		if (vis->cancel_filter) {
@@ -741,8 +874,8 @@ static bool cmd_filter(Vis *vis, Filerange *range, enum CmdOpt opt, const char *
 			char buf[BUFSIZ];
 			ssize_t len = read(pout[0], buf, sizeof buf);
 			if (len > 0) {
-				text_insert(text, rin.end, buf, len);
-				rin.end += len;
+				if (stored)
+					stored = text_edit_apply(text, rout.end, 0, buf, len);
 			} else if (len == 0) {
 				close(pout[0]);
 				pout[0] = -1;
@@ -777,19 +910,23 @@ static bool cmd_filter(Vis *vis, Filerange *range, enum CmdOpt opt, const char *
 	if (perr[0] != -1)
 		close(perr[0]);
 
-	if (waitpid(pid, &status, 0) == pid && status == 0) {
-		text_delete_range(text, &rout);
+	if (waitpid(pid, &status, 0) == pid && status == 0 && stored &&
+	    text_edit_apply(text, rout.start, text_range_size(&rout), NULL, 0) &&
+	    text_edit_commit(text)) {
 		text_snapshot(text);
 	} else {
-		/* make sure we have somehting to undo */
-		text_insert(text, pos, " ", 1);
-		text_undo(text);
+		/* a successful command whose output could not be applied */
+		if (status == 0)
+			stored = false;
+		text_edit_abort(text);
 	}
 
 	view_cursor_to(view, rout.start);
 
 	if (!vis->cancel_filter) {
-		if (status == 0)
+		if (!stored)
+			vis_info_show(vis, "Error storing filter output");
+		else if (status == 0)
 			vis_info_show(vis, "Command succeded");
 		else if (errmsg.len > 0)
 			vis_info_show(vis, "Command failed: %s", errmsg.data);
@@ -798,7 +935,26 @@ static bool cmd_filter(Vis *vis, Filerange *range, enum CmdOpt opt, const char *
 	}
 
 	vis->ui->terminal_restore(vis->ui);
-	return status == 0;
+	return status == 0 && stored;
+}
+
+static bool cmd_follow(Vis *vis, Filerange *range, enum CmdOpt opt, const char *argv[]) {
+	File *file = vis->win->file;
+	bool follow = !file->follow;
+	if (argv[1] && !parse_bool(argv[1], &follow)) {
+		vis_info_show(vis, "Expecting boolean option value not: `%s'", argv[1]);
+		return false;
+	}
+	if (follow && !file->name) {
+		vis_info_show(vis, "No file name to follow");
+		return false;
+	}
+	file->follow = follow;
+	/* the cursor sticks to the end of file, until it is moved elsewhere */
+	if (follow)
+		view_cursor_to(vis->win->view, text_size(file->text));
+	vis_info_show(vis, follow ? "Following `%s'" : "Stopped following `%s'", file->name ? file->name : "");
+	return true;
 }
 
 static bool cmd_earlier_later(Vis *vis, Filerange *range, enum CmdOpt opt, const char *argv[]) {
@@ -2,6 +2,7 @@
 #define VIS_CORE_H
 
 #include <setjmp.h>
+#include <pthread.h>
 #include "vis.h"
 #include "text.h"
 #include "text-regex.h"
@@ -48,6 +49,9 @@ typedef struct {
 	/* operator logic, returns new cursor position, if EPOS is
 	 * the cursor is disposed (except if it is the primary one) */
 	size_t (*func)(Vis*, Text*, OperatorContext*);
+	/* changes are only registered using text_edit_apply and committed
+	 * for all cursors at once, positions refer to the unmodified text */
+	bool batch;
 } Operator;
 
 typedef struct { /* Motion implementation, takes a cursor postion and returns a new one */
@@ -100,7 +104,12 @@ struct File { /* shared state among windows displaying the same file */
 	const char *name;                /* file name used when loading/saving */
 	volatile sig_atomic_t truncated; /* whether the underlying memory mapped region became invalid (SIGBUS) */
 	bool is_stdin;                   /* whether file content was read from stdin */
+	int load_fd;                     /* input from which the content is still being read, -1 once complete */
+	size_t loaded;                   /* number of bytes read from it so far */
+	bool follow;                     /* whether data appended to the file is read, see :follow */
+	int watch;                       /* inotify watch of the memory mapped file, -1 if none */
 	struct stat stat;                /* filesystem information when loaded/saved, used to detect changes outside the editor */
+	TextSave *save;                  /* pending background save to `name', NULL if none */
 	int refcount;                    /* how many windows are displaying this file? (always >= 1) */
 	Mark marks[VIS_MARK_INVALID];    /* marks which are shared across windows */
 	File *next, *prev;
@@ -120,6 +129,7 @@ struct Win {
 	ViewEvent events;
 	RingBuffer *jumplist;   /* LRU jump management */
 	ChangeList changelist;  /* state for iterating through least recently changes */
+	int nibble;             /* high nibble of the byte being entered in hex mode, -1 if none */
 	Win *prev, *next;       /* neighbouring windows */
 };
 
@@ -142,6 +152,13 @@ struct Vis {
 	int tabwidth;                        /* how many spaces should be used to display a tab */
 	bool expandtab;                      /* whether typed tabs should be converted to spaces */
 	bool autoindent;                     /* whether indentation should be copied from previous line on newline */
+	size_t history_limit;                /* memory in bytes each file may use for its undo history, 0 if unlimited */
+	bool undofile;                       /* whether the undo history is kept in a file alongside the edited one */
+	bool journal;                        /* whether unsaved modifications are journaled alongside the edited file */
+	bool journal_recover;                /* whether files are recovered from their journal upon load */
+	bool lineindex;                      /* whether the new line index of large files is kept alongside them */
+	size_t largefile;                    /* size in bytes from which files are displayed in large file mode, 0 if never */
+	enum TextEncoding encoding;          /* encoding of subsequently opened files, see :set encoding */
 	Map *cmds;                           /* ":"-commands, used for unique prefix queries */
 	Map *options;                        /* ":set"-options */
 	Buffer input_queue;                  /* holds pending input keys */
@@ -154,7 +171,9 @@ struct Vis {
 	int exit_status;                     /* exit status when terminating main loop */
 	volatile sig_atomic_t cancel_filter; /* abort external command/filter (SIGINT occured) */
 	volatile sig_atomic_t sigbus;        /* one of the memory mapped region became unavailable (SIGBUS) */
+	int inotify;                         /* instance watching memory mapped files for modifications, -1 if none */
 	sigjmp_buf sigbus_jmpbuf;            /* used to jump back to a known good state in the mainloop after (SIGBUS) */
+	pthread_t thread;                    /* main thread, the only one which may use the above */
 	Map *actions;                        /* registered editor actions / special keys commands */
 	lua_State *lua;                      /* lua context used for syntax highligthing */
 };
@@ -175,6 +194,14 @@ void macro_operator_record(Vis *vis);
 
 void action_reset(Action*);
 
+/* restore/store the undo history of a file from/to a hidden file in the same directory */
+bool file_history_load(File*);
+bool file_history_save(File*);
+/* wait for a pending background save to complete, report the outcome */
+bool file_save_finish(Vis*, File*);
+/* read the remaining input of a file still being loaded */
+bool file_load_finish(Vis*, File*);
+
 void mode_set(Vis *vis, Mode *new_mode);
 Mode *mode_get(Vis *vis, enum VisMode mode);
 
@@ -130,6 +130,7 @@ static void vis_mode_insert_enter(Vis *vis, Mode *old) {
 static void vis_mode_insert_leave(Vis *vis, Mode *new) {
 	/* make sure we can recover the current state after an editing operation */
 	text_snapshot(vis->win->file->text);
+	vis->win->nibble = -1;
 	if (new == mode_get(vis, VIS_MODE_NORMAL))
 		macro_operator_stop(vis);
 }
@@ -154,6 +155,7 @@ static void vis_mode_replace_enter(Vis *vis, Mode *old) {
 static void vis_mode_replace_leave(Vis *vis, Mode *new) {
 	/* make sure we can recover the current state after an editing operation */
 	text_snapshot(vis->win->file->text);
+	vis->win->nibble = -1;
 	if (new == mode_get(vis, VIS_MODE_NORMAL))
 		macro_operator_stop(vis);
 }
@@ -186,10 +186,10 @@ Movement moves[] = {
 	[VIS_MOVE_LINE_NEXT]           = { .txt = text_line_next,                                            },
 	[VIS_MOVE_LINE]                = { .vis = line,                     .type = LINEWISE|IDEMPOTENT|JUMP },
 	[VIS_MOVE_COLUMN]              = { .vis = column,                   .type = CHARWISE|IDEMPOTENT      },
-	[VIS_MOVE_CHAR_PREV]           = { .txt = text_char_prev,           .type = CHARWISE                 },
-	[VIS_MOVE_CHAR_NEXT]           = { .txt = text_char_next,           .type = CHARWISE                 },
-	[VIS_MOVE_LINE_CHAR_PREV]      = { .txt = text_line_char_prev,      .type = CHARWISE                 },
-	[VIS_MOVE_LINE_CHAR_NEXT]      = { .txt = text_line_char_next,      .type = CHARWISE                 },
+	[VIS_MOVE_CHAR_PREV]           = { .cur = view_char_prev,           .type = CHARWISE                 },
+	[VIS_MOVE_CHAR_NEXT]           = { .cur = view_char_next,           .type = CHARWISE                 },
+	[VIS_MOVE_LINE_CHAR_PREV]      = { .cur = view_line_char_prev,      .type = CHARWISE                 },
+	[VIS_MOVE_LINE_CHAR_NEXT]      = { .cur = view_line_char_next,      .type = CHARWISE                 },
 	[VIS_MOVE_WORD_START_PREV]     = { .txt = text_word_start_prev,     .type = CHARWISE                 },
 	[VIS_MOVE_WORD_START_NEXT]     = { .txt = text_word_start_next,     .type = CHARWISE                 },
 	[VIS_MOVE_WORD_END_PREV]       = { .txt = text_word_end_prev,       .type = CHARWISE|INCLUSIVE       },
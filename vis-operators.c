@@ -52,7 +52,7 @@ static size_t op_put(Vis *vis, Text *txt, OperatorContext *c) {
 	}
 
 	for (int i = 0; i < c->count; i++) {
-		text_insert(txt, pos, c->reg->data, c->reg->len);
+		register_insert(c->reg, txt, pos);
 		pos += c->reg->len;
 	}
 
@@ -92,11 +92,11 @@ static size_t op_shift_right(Vis *vis, Text *txt, OperatorContext *c) {
 
 	do {
 		prev_pos = pos = text_line_begin(txt, pos);
-		text_insert(txt, pos, tab, tablen);
+		text_edit_apply(txt, pos, 0, tab, tablen);
 		pos = text_line_prev(txt, pos);
 	}  while (pos >= c->range.start && pos != prev_pos);
 
-	return c->pos + tablen;
+	return c->pos;
 }
 
 static size_t op_shift_left(Vis *vis, Text *txt, OperatorContext *c) {
@@ -119,35 +119,49 @@ static size_t op_shift_left(Vis *vis, Text *txt, OperatorContext *c) {
 				text_iterator_byte_next(&it, NULL);
 		}
 		tablen = MIN(len, tabwidth);
-		text_delete(txt, pos, tablen);
+		text_edit_apply(txt, pos, tablen, NULL, 0);
 		pos = text_line_prev(txt, pos);
 	}  while (pos >= c->range.start && pos != prev_pos);
 
-	return c->pos - tablen;
+	return c->pos;
 }
 
 static size_t op_case_change(Vis *vis, Text *txt, OperatorContext *c) {
-	size_t len = text_range_size(&c->range);
-	char *buf = malloc(len);
-	if (!buf)
-		return c->pos;
-	len = text_bytes_get(txt, c->range.start, len, buf);
-	size_t rem = len;
-	for (char *cur = buf; rem > 0; cur++, rem--) {
-		int ch = (unsigned char)*cur;
-		if (isascii(ch)) {
-			if (c->arg->i == VIS_OP_CASE_SWAP)
-				*cur = islower(ch) ? toupper(ch) : tolower(ch);
-			else if (c->arg->i == VIS_OP_CASE_UPPER)
-				*cur = toupper(ch);
-			else
-				*cur = tolower(ch);
+	char buf[4096];
+	struct iovec iov[32];
+	Filerange r = c->range;
+	size_t pos = r.start, n;
+	/* the text data is read in place, blocks whose case changed are replaced */
+	text_edit_begin(txt);
+	while ((n = text_chunks_get(txt, &r, iov, LENGTH(iov)))) {
+		for (size_t i = 0; i < n; i++) {
+			const char *data = iov[i].iov_base;
+			for (size_t rem = iov[i].iov_len; rem > 0; ) {
+				size_t len = MIN(rem, sizeof buf);
+				bool changed = false;
+				for (size_t j = 0; j < len; j++) {
+					int ch = (unsigned char)data[j];
+					if (isascii(ch)) {
+						if (c->arg->i == VIS_OP_CASE_SWAP)
+							ch = islower(ch) ? toupper(ch) : tolower(ch);
+						else if (c->arg->i == VIS_OP_CASE_UPPER)
+							ch = toupper(ch);
+						else
+							ch = tolower(ch);
+					}
+					buf[j] = ch;
+					changed |= buf[j] != data[j];
+				}
+				if (changed)
+					text_edit_apply(txt, pos, len, buf, len);
+				data += len;
+				pos += len;
+				rem -= len;
+			}
 		}
 	}
-
-	text_delete(txt, c->range.start, len);
-	text_insert(txt, c->range.start, buf, len);
-	free(buf);
+	if (!text_edit_commit(txt))
+		text_edit_abort(txt);
 	return c->pos;
 }
 
@@ -184,8 +198,7 @@ static size_t op_join(Vis *vis, Text *txt, OperatorContext *c) {
 		size_t end = text_line_start(txt, pos);
 		pos = text_char_next(txt, text_line_finish(txt, text_line_prev(txt, end)));
 		if (pos >= c->range.start && end > pos) {
-			text_delete(txt, pos, end - pos);
-			text_insert(txt, pos, " ", 1);
+			text_edit_apply(txt, pos, end - pos, " ", 1);
 		} else {
 			break;
 		}
@@ -209,10 +222,10 @@ Operator ops[] = {
 	[VIS_OP_CHANGE]      = { op_change      },
 	[VIS_OP_YANK]        = { op_yank        },
 	[VIS_OP_PUT_AFTER]   = { op_put         },
-	[VIS_OP_SHIFT_RIGHT] = { op_shift_right },
-	[VIS_OP_SHIFT_LEFT]  = { op_shift_left  },
+	[VIS_OP_SHIFT_RIGHT] = { op_shift_right, true },
+	[VIS_OP_SHIFT_LEFT]  = { op_shift_left,  true },
 	[VIS_OP_CASE_SWAP]   = { op_case_change },
-	[VIS_OP_JOIN]        = { op_join        },
+	[VIS_OP_JOIN]        = { op_join,        true },
 	[VIS_OP_INSERT]      = { op_insert      },
 	[VIS_OP_REPLACE]     = { op_replace     },
 	[VIS_OP_CURSOR_SOL]  = { op_cursor      },
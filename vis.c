@@ -34,6 +34,9 @@
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <pwd.h>
+#ifdef HAVE_INOTIFY
+#include <sys/inotify.h>
+#endif
 #include <lauxlib.h>
 #include <lualib.h>
 #include <lua.h>
@@ -62,12 +65,97 @@ const char *expandtab(Vis *vis) {
 
 /** window / file handling */
 
+/* memory mapped files are watched for modifications by other processes, upon
+ * which the text switches to a private copy of their content */
+static void file_watch(Vis *vis, File *file) {
+#ifdef HAVE_INOTIFY
+	if (!file->name || !text_mapped(file->text))
+		return;
+	if (vis->inotify == -1)
+		vis->inotify = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+	if (vis->inotify != -1)
+		file->watch = inotify_add_watch(vis->inotify, file->name, IN_MODIFY);
+#endif
+}
+
+static void file_unwatch(Vis *vis, File *file) {
+#ifdef HAVE_INOTIFY
+	if (file->watch == -1)
+		return;
+	/* the watch is shared if the file was reloaded */
+	for (File *f = vis->files; f; f = f->next) {
+		if (f != file && f->watch == file->watch)
+			file->watch = -1;
+	}
+	if (file->watch != -1)
+		inotify_rm_watch(vis->inotify, file->watch);
+	file->watch = -1;
+#endif
+}
+
+/* switch to a private copy of the memory mapped file content, after the file
+ * was modified by another process. returns false if that failed */
+static bool file_private(Vis *vis, File *file) {
+	size_t lost;
+	/* a pending background save reads the mappings being replaced */
+	file_save_finish(vis, file);
+	if (!text_private(file->text, &lost))
+		return false;
+	file->truncated = false;
+	file_unwatch(vis, file);
+	if (lost)
+		vis_info_show(vis, "WARNING: file `%s' truncated, %zu bytes lost", file->name, lost);
+	else
+		vis_info_show(vis, "WARNING: file `%s' modified by another process", file->name);
+	return true;
+}
+
+/* whether the file merely grew beyond the known content, as is the case for
+ * appends to a log file. the mapped content is still valid, unless it was
+ * rewritten in place with at least the same size, which is not detected */
+#ifdef HAVE_INOTIFY
+static bool file_appended(File *file) {
+	struct stat meta, info = text_stat(file->text);
+	if (stat(file->name, &meta) == -1)
+		return false;
+	return meta.st_dev == info.st_dev && meta.st_ino == info.st_ino &&
+	       meta.st_size >= info.st_size;
+}
+#endif
+
+/* handle the modifications reported for watched files */
+static void files_watch_update(Vis *vis) {
+#ifdef HAVE_INOTIFY
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	ssize_t len;
+	while ((len = read(vis->inotify, buf, sizeof buf)) > 0) {
+		for (char *ptr = buf; ptr < buf + len; ) {
+			const struct inotify_event *event = (const struct inotify_event*)ptr;
+			ptr += sizeof *event + event->len;
+			if (!(event->mask & IN_MODIFY))
+				continue;
+			for (File *file = vis->files; file; file = file->next) {
+				if (file->watch == event->wd && !file_appended(file))
+					file_private(vis, file);
+			}
+		}
+	}
+#endif
+}
+
 static void file_free(Vis *vis, File *file) {
 	if (!file)
 		return;
 	if (--file->refcount > 0)
 		return;
 
+	file_save_finish(vis, file);
+	file_unwatch(vis, file);
+	if (file->load_fd != -1)
+		close(file->load_fd);
+	for (int i = 0; i < LENGTH(vis->registers); i++)
+		register_detach(&vis->registers[i], file->text);
+	text_journal_close(file->text);
 	text_free(file->text);
 	free((char*)file->name);
 
@@ -85,7 +173,10 @@ static File *file_new_text(Vis *vis, Text *text) {
 	if (!file)
 		return NULL;
 	file->text = text;
+	file->load_fd = -1;
+	file->watch = -1;
 	file->stat = text_stat(text);
+	text_history_limit(text, vis->history_limit);
 	file->refcount++;
 	if (vis->files)
 		vis->files->prev = file;
@@ -94,6 +185,199 @@ static File *file_new_text(Vis *vis, Text *text) {
 	return file;
 }
 
+/* the undo history of dir/name is stored in dir/.name.vis-undo, the
+ * journal of unsaved modifications in dir/.name.vis-journal and the
+ * new line index in dir/.name.vis-lines */
+static char *file_meta_name(File *file, const char *suffix) {
+	if (!file->name)
+		return NULL;
+	const char *base = strrchr(file->name, '/');
+	base = base ? base + 1 : file->name;
+	size_t len = strlen(file->name) + strlen(suffix) + sizeof("..");
+	char *name = malloc(len);
+	if (name)
+		snprintf(name, len, "%.*s.%s.%s", (int)(base - file->name), file->name, base, suffix);
+	return name;
+}
+
+bool file_history_load(File *file) {
+	char *name = file_meta_name(file, "vis-undo");
+	bool ret = name && text_history_load(file->text, name);
+	free(name);
+	return ret;
+}
+
+bool file_history_save(File *file) {
+	char *name = file_meta_name(file, "vis-undo");
+	bool ret = name && text_history_save(file->text, name);
+	free(name);
+	return ret;
+}
+
+static bool file_lines_index(File *file) {
+	char *name = file_meta_name(file, "vis-lines");
+	bool ret = name && text_lines_index(file->text, name);
+	free(name);
+	return ret;
+}
+
+bool file_save_finish(Vis *vis, File *file) {
+	if (!file->save)
+		return true;
+	bool ret = text_save_finish(file->save);
+	file->save = NULL;
+	if (!ret) {
+		vis_info_show(vis, "Can't write `%s': %s", file->name, strerror(errno));
+		return false;
+	}
+	file->stat = text_stat(file->text);
+	if (vis->undofile && !file_history_save(file))
+		vis_info_show(vis, "Can't write undo history of `%s'", file->name);
+	return true;
+}
+
+/* the input of a file is read in blocks growing from LOAD_BLOCK_MIN, such that
+ * the first screen is displayed quickly, up to LOAD_BLOCK_MAX bytes. in between
+ * the editor remains responsive */
+#define LOAD_BLOCK_MIN (1 << 16)
+#define LOAD_BLOCK_MAX (1 << 24)
+
+/* read the next block of input, windows displaying the end of the text are
+ * redrawn. returns false if reading failed */
+static bool file_load(Vis *vis, File *file) {
+	Text *txt = file->text;
+	size_t size = text_size(txt);
+	size_t block = MIN(MAX(file->loaded, LOAD_BLOCK_MIN), LOAD_BLOCK_MAX);
+	ssize_t len = text_load_fd(txt, file->load_fd, block);
+	if (len == -1 && errno == EAGAIN)
+		return true;
+	if (len > 0) {
+		file->loaded += len;
+	} else {
+		if (len == -1)
+			vis_info_show(vis, "Can not read from stdin: %s", strerror(errno));
+		int flags = fcntl(file->load_fd, F_GETFL);
+		if (flags != -1)
+			fcntl(file->load_fd, F_SETFL, flags & ~O_NONBLOCK);
+		close(file->load_fd);
+		file->load_fd = -1;
+	}
+	for (Win *win = vis->windows; win; win = win->next) {
+		if (win->file != file)
+			continue;
+		if (len > 0 && view_viewport_get(win->view).end >= size)
+			view_draw(win->view);
+		win->ui->draw_status(win->ui);
+	}
+	return len != -1;
+}
+
+bool file_load_finish(Vis *vis, File *file) {
+	if (file->load_fd == -1)
+		return true;
+	int flags = fcntl(file->load_fd, F_GETFL);
+	if (flags != -1)
+		fcntl(file->load_fd, F_SETFL, flags & ~O_NONBLOCK);
+	while (file->load_fd != -1) {
+		if (!file_load(vis, file))
+			return false;
+	}
+	return true;
+}
+
+/* read the data appended to a followed file. windows whose cursor is at the end
+ * of the text keep it there, such that new data is scrolled into view */
+static void file_follow(Vis *vis, File *file) {
+	Text *txt = file->text;
+	size_t size = text_size(txt);
+	ssize_t len = text_follow(txt, file->name);
+	if (len == 0)
+		return;
+	if (len == -1) {
+		file->follow = false;
+		vis_info_show(vis, "Stopped following `%s': %s", file->name,
+		              errno == ESTALE ? "file was replaced or truncated" : strerror(errno));
+		return;
+	}
+	file->stat = text_stat(txt);
+	for (Win *win = vis->windows; win; win = win->next) {
+		if (win->file != file)
+			continue;
+		if (view_cursor_get(win->view) == size)
+			view_cursor_to(win->view, text_size(txt));
+		else if (view_viewport_get(win->view).end >= size)
+			view_draw(win->view);
+		win->ui->draw_status(win->ui);
+	}
+}
+
+/* check followed files for appended data, returns whether there are any */
+static bool files_follow(Vis *vis, bool check) {
+	bool following = false;
+	for (File *file = vis->files; file; file = file->next) {
+		if (check && file->follow)
+			file_follow(vis, file);
+		following |= file->follow;
+	}
+	return following;
+}
+
+/* complete finished background saves, returns whether any are still pending */
+static bool files_save_update(Vis *vis) {
+	bool pending = false;
+	for (File *file = vis->files; file; file = file->next) {
+		if (!file->save)
+			continue;
+		if (text_save_done(file->save))
+			file_save_finish(vis, file);
+		else
+			pending = true;
+		for (Win *win = vis->windows; win; win = win->next) {
+			if (win->file == file)
+				win->ui->draw_status(win->ui);
+		}
+	}
+	return pending;
+}
+
+/* start journaling the modifications, or recover them if requested */
+static bool file_journal_open(Vis *vis, File *file) {
+	struct stat meta;
+	char *name = file_meta_name(file, "vis-journal");
+	if (!name)
+		return !file->name;
+	bool ret = true;
+	if (vis->journal_recover) {
+		ret = text_journal_recover(file->text, name);
+	} else if (lstat(name, &meta) == 0) {
+		/* never replace a journal which might be needed for recovery */
+		vis_info_show(vis, "Found journal of `%s', recover with: vis -r", file->name);
+	} else if (vis->journal) {
+		text_journal_open(file->text, name);
+	}
+	free(name);
+	return ret;
+}
+
+/* write the journals, returns whether any are waiting to be synced */
+static bool files_journal_flush(Vis *vis, bool sync) {
+	bool pending = false;
+	for (File *file = vis->files; file; file = file->next) {
+		if (!text_journal_flush(file->text, sync))
+			vis_info_show(vis, "Can't write journal of `%s'", file->name);
+		pending |= text_journal_pending(file->text);
+	}
+	return pending;
+}
+
+/* compress unused buffers, returns whether further ones might be */
+static bool files_compress(Vis *vis) {
+	bool pending = false;
+	for (File *file = vis->files; file; file = file->next)
+		pending |= text_compress(file->text);
+	return pending;
+}
+
 static File *file_new(Vis *vis, const char *filename) {
 	if (filename) {
 		/* try to detect whether the same file is already open in another window
@@ -106,9 +390,10 @@ static File *file_new(Vis *vis, const char *filename) {
 		}
 	}
 
-	Text *text = text_load(filename);
+	Text *text = text_load_encoding(filename, vis->encoding);
+	bool exists = text != NULL;
 	if (!text && filename && errno == ENOENT)
-		text = text_load(NULL);
+		text = text_load_encoding(NULL, vis->encoding);
 	if (!text)
 		return NULL;
 
@@ -120,6 +405,17 @@ static File *file_new(Vis *vis, const char *filename) {
 
 	if (filename)
 		file->name = strdup(filename);
+	file_watch(vis, file);
+	if (exists && vis->lineindex)
+		file_lines_index(file);
+	if (exists && vis->undofile)
+		file_history_load(file);
+	if (!file_journal_open(vis, file)) {
+		int err = errno;
+		file_free(vis, file);
+		errno = err;
+		return NULL;
+	}
 	return file;
 }
 
@@ -177,6 +473,29 @@ static void window_free(Win *win) {
 	free(win);
 }
 
+/* enable large file mode for windows displaying files above the threshold */
+static void window_large(Vis *vis, Win *win) {
+	size_t size = text_size(win->file->text);
+	view_large_set(win->view, vis->largefile && size >= vis->largefile);
+}
+
+/* update large file mode of all windows, since files might have grown or the
+ * threshold changed. those with estimated line numbers are redrawn once the
+ * actual ones are known, returns whether any estimates are still displayed */
+static bool windows_large_update(Vis *vis) {
+	bool estimated = false;
+	for (Win *win = vis->windows; win; win = win->next) {
+		window_large(vis, win);
+		if (!view_lines_estimated(win->view))
+			continue;
+		if (text_lines_ready(win->file->text))
+			view_draw(win->view);
+		else
+			estimated = true;
+	}
+	return estimated;
+}
+
 static Win *window_new_file(Vis *vis, File *file) {
 	Win *win = calloc(1, sizeof(Win));
 	if (!win)
@@ -188,6 +507,7 @@ static Win *window_new_file(Vis *vis, File *file) {
 		.selection = window_selection_changed,
 	};
 	win->jumplist = ringbuf_alloc(31);
+	win->nibble = -1;
 	win->view = view_new(file->text, vis->lua, &win->events);
 	win->ui = vis->ui->window_new(vis->ui, win->view, file);
 	if (!win->jumplist || !win->view || !win->ui) {
@@ -195,6 +515,7 @@ static Win *window_new_file(Vis *vis, File *file) {
 		return NULL;
 	}
 	view_tabwidth_set(win->view, vis->tabwidth);
+	window_large(vis, win);
 	if (vis->windows)
 		vis->windows->prev = win;
 	win->next = vis->windows;
@@ -309,6 +630,8 @@ Vis *vis_new(Ui *ui) {
 	Vis *vis = calloc(1, sizeof(Vis));
 	if (!vis)
 		return NULL;
+	vis->inotify = -1;
+	vis->thread = pthread_self();
 	lua_State *L = luaL_newstate();
 	if (!(vis->lua = L))
 		goto err;
@@ -371,6 +694,7 @@ Vis *vis_new(Ui *ui) {
 	vis->ui->init(vis->ui, vis);
 	vis->tabwidth = 8;
 	vis->expandtab = false;
+	vis->largefile = 256 << 20;
 	for (int i = 0; i < VIS_MODE_LAST; i++) {
 		Mode *mode = &vis_modes[i];
 		if (!(mode->bindings = map_new()))
@@ -400,16 +724,19 @@ void vis_free(Vis *vis) {
 		return;
 	if (vis->lua)
 		lua_close(vis->lua);
+	/* released first, such that closing the files does not copy their content */
+	for (int i = 0; i < LENGTH(vis->registers); i++)
+		register_release(&vis->registers[i]);
 	while (vis->windows)
 		vis_window_close(vis->windows);
 	file_free(vis, vis->prompt->file);
 	window_free(vis->prompt);
 	text_regex_free(vis->search_pattern);
-	for (int i = 0; i < LENGTH(vis->registers); i++)
-		register_release(&vis->registers[i]);
 	for (int i = 0; i < LENGTH(vis->macros); i++)
 		macro_release(&vis->macros[i]);
 	vis->ui->free(vis->ui);
+	if (vis->inotify != -1)
+		close(vis->inotify);
 	map_free(vis->cmds);
 	map_free(vis->options);
 	map_free(vis->actions);
@@ -426,7 +753,39 @@ void vis_insert(Vis *vis, size_t pos, const char *data, size_t len) {
 	windows_invalidate(vis, pos, pos + len);
 }
 
+void vis_insert_register(Vis *vis, size_t pos, Register *reg) {
+	register_insert(reg, vis->win->file->text, pos);
+	windows_invalidate(vis, pos, pos + reg->len);
+}
+
+/* in hex mode bytes are entered as two hex digits, other keys are ignored.
+ * returns the number of bytes completed by `data' which are stored in `bytes' */
+static size_t window_hex_input(Win *win, const char *data, size_t len, char *bytes) {
+	size_t count = 0;
+	for (size_t i = 0; i < len; i++) {
+		unsigned char c = data[i];
+		if (!isxdigit(c)) {
+			win->nibble = -1;
+			continue;
+		}
+		int digit = isdigit(c) ? c - '0' : tolower(c) - 'a' + 10;
+		if (win->nibble == -1) {
+			win->nibble = digit;
+		} else {
+			bytes[count++] = win->nibble << 4 | digit;
+			win->nibble = -1;
+		}
+	}
+	return count;
+}
+
 void vis_insert_key(Vis *vis, const char *data, size_t len) {
+	char bytes[len+1];
+	if (view_hex_get(vis->win->view)) {
+		if (!(len = window_hex_input(vis->win, data, len, bytes)))
+			return;
+		data = bytes;
+	}
 	for (Cursor *c = view_cursors(vis->win->view); c; c = view_cursors_next(c)) {
 		size_t pos = view_cursors_pos(c);
 		vis_insert(vis, pos, data, len);
@@ -451,9 +810,23 @@ void vis_replace(Vis *vis, size_t pos, const char *data, size_t len) {
 }
 
 void vis_replace_key(Vis *vis, const char *data, size_t len) {
+	char bytes[len+1];
+	bool hex = view_hex_get(vis->win->view);
+	if (hex) {
+		if (!(len = window_hex_input(vis->win, data, len, bytes)))
+			return;
+		data = bytes;
+	}
 	for (Cursor *c = view_cursors(vis->win->view); c; c = view_cursors_next(c)) {
 		size_t pos = view_cursors_pos(c);
-		vis_replace(vis, pos, data, len);
+		if (hex) {
+			/* overwrite as many bytes as entered */
+			Text *txt = vis->win->file->text;
+			text_delete(txt, pos, MIN(len, text_size(txt) - pos));
+			vis_insert(vis, pos, data, len);
+		} else {
+			vis_replace(vis, pos, data, len);
+		}
 		view_cursors_scroll_to(c, pos + len);
 	}
 }
@@ -554,6 +927,13 @@ static void action_do(Vis *vis, Action *a) {
 	bool linewise = !(a->type & CHARWISE) && (
 		a->type & LINEWISE || (a->movement && a->movement->type & LINEWISE) ||
 		vis->mode == &vis_modes[VIS_MODE_VISUAL_LINE]);
+	/* cursor positions returned by batched operators, they only become
+	 * valid once all changes are committed */
+	size_t *positions = NULL, count = 0;
+	if (a->op && a->op->batch) {
+		text_edit_begin(txt);
+		positions = malloc(view_cursors_count(view) * sizeof(size_t));
+	}
 
 	for (Cursor *cursor = view_cursors(view), *next; cursor; cursor = next) {
 
@@ -650,7 +1030,10 @@ static void action_do(Vis *vis, Action *a) {
 
 		if (a->op) {
 			size_t pos = a->op->func(vis, txt, &c);
-			if (pos != EPOS) {
+			if (a->op->batch) {
+				if (positions)
+					positions[count++] = pos;
+			} else if (pos != EPOS) {
 				view_cursors_to(cursor, pos);
 			} else {
 				view_cursors_dispose(cursor);
@@ -658,6 +1041,23 @@ static void action_do(Vis *vis, Action *a) {
 		}
 	}
 
+	if (a->op && a->op->batch && !text_edit_commit(txt)) {
+		/* nothing was changed, the cursors remain where they are */
+		text_edit_abort(txt);
+		vis_info_show(vis, "Failed to apply changes: %s", strerror(errno));
+	} else if (a->op && a->op->batch) {
+		Cursor *cursor = view_cursors(view), *next;
+		for (size_t i = 0; positions && i < count && cursor; i++, cursor = next) {
+			next = view_cursors_next(cursor);
+			size_t pos = text_edit_pos(txt, positions[i]);
+			if (pos != EPOS)
+				view_cursors_to(cursor, pos);
+			else
+				view_cursors_dispose(cursor);
+		}
+	}
+	free(positions);
+
 	if (a->op) {
 		/* we do not support visual repeat, still do something resonable */
 		if (vis->mode->visual && !a->movement && !a->textobj)
@@ -852,15 +1252,34 @@ static const char *getkey(Vis *vis) {
 
 bool vis_signal_handler(Vis *vis, int signum, const siginfo_t *siginfo, const void *context) {
 	switch (signum) {
-	case SIGBUS:
+	case SIGBUS: {
+		/* scanner and writer threads abort their file access, as they
+		 * must neither modify the files nor jump into the main loop */
+		if (!pthread_equal(pthread_self(), vis->thread)) {
+			for (File *file = vis->files; file; file = file->next) {
+				if (text_sigbus(file->text, siginfo->si_addr))
+					file->truncated = true;
+			}
+			vis->sigbus = true;
+			if (text_sigbus_abort(siginfo->si_addr))
+				return true;
+			/* retrying the access would fault forever */
+			signal(SIGBUS, SIG_DFL);
+			return false;
+		}
+		bool recovered = false;
 		for (File *file = vis->files; file; file = file->next) {
-			if (text_sigbus(file->text, siginfo->si_addr))
+			if (text_sigbus(file->text, siginfo->si_addr)) {
 				file->truncated = true;
+				recovered = text_sigbus_recover(file->text, siginfo->si_addr);
+			}
 		}
 		vis->sigbus = true;
-		if (vis->running)
+		/* the faulting access is retried, otherwise it is aborted */
+		if (vis->running && !recovered)
 			siglongjmp(vis->sigbus_jmpbuf, 1);
 		return true;
+	}
 	case SIGINT:
 		vis->cancel_filter = true;
 		return true;
@@ -880,6 +1299,9 @@ static void vis_args(Vis *vis, int argc, char *argv[]) {
 			case 'v':
 				vis_die(vis, "vis %s, compiled " __DATE__ " " __TIME__ "\n", VERSION);
 				break;
+			case 'r':
+				vis->journal_recover = true;
+				break;
 			case '\0':
 				break;
 			default:
@@ -889,6 +1311,8 @@ static void vis_args(Vis *vis, int argc, char *argv[]) {
 		} else if (argv[i][0] == '+') {
 			cmd = argv[i] + (argv[i][1] == '/' || argv[i][1] == '?');
 		} else if (!vis_window_new(vis, argv[i])) {
+			if (vis->journal_recover)
+				vis_die(vis, "Can not recover `%s': %s\n", argv[i], strerror(errno));
 			vis_die(vis, "Can not load `%s': %s\n", argv[i], strerror(errno));
 		} else if (cmd) {
 			prompt_cmd(vis, cmd[0], cmd+1);
@@ -900,16 +1324,15 @@ static void vis_args(Vis *vis, int argc, char *argv[]) {
 		if (!strcmp(argv[argc-1], "-")) {
 			if (!vis_window_new(vis, NULL))
 				vis_die(vis, "Can not create empty buffer\n");
-			ssize_t len = 0;
-			char buf[PIPE_BUF];
+			/* the input is read in the main loop, such that its
+			 * beginning is displayed right away */
 			File *file = vis->win->file;
-			Text *txt = file->text;
 			file->is_stdin = true;
-			while ((len = read(STDIN_FILENO, buf, sizeof buf)) > 0)
-				text_insert(txt, text_size(txt), buf, len);
-			if (len == -1)
+			int flags;
+			if ((file->load_fd = dup(STDIN_FILENO)) == -1 ||
+			    (flags = fcntl(file->load_fd, F_GETFL)) == -1 ||
+			    fcntl(file->load_fd, F_SETFL, flags|O_NONBLOCK) == -1)
 				vis_die(vis, "Can not read from stdin\n");
-			text_snapshot(txt);
 			int fd = open("/dev/tty", O_RDONLY);
 			if (fd == -1)
 				vis_die(vis, "Can not reopen stdin\n");
@@ -918,15 +1341,28 @@ static void vis_args(Vis *vis, int argc, char *argv[]) {
 		} else if (!vis_window_new(vis, NULL)) {
 			vis_die(vis, "Can not create empty buffer\n");
 		}
-		if (cmd)
+		/* commands operate on the complete input */
+		if (cmd && file_load_finish(vis, vis->win->file))
 			prompt_cmd(vis, cmd[0], cmd+1);
 	}
+
+	vis->journal_recover = false;
 }
 
 int vis_run(Vis *vis, int argc, char *argv[]) {
 	vis_args(vis, argc, argv);
 
 	struct timespec idle = { .tv_nsec = 0 }, *timeout = NULL;
+	/* interval in which the progress of background saves is displayed */
+	struct timespec progress = { .tv_nsec = 100000000 };
+	/* delay after the last input until journals are synced to disk */
+	struct timespec sync = { .tv_sec = 1 };
+	/* interval after which buffers not accessed in the meantime are compressed */
+	struct timespec cold = { .tv_sec = 10 };
+	bool compress = true;
+	/* interval in which followed files are checked for appended data */
+	struct timespec poll = { .tv_sec = 1 };
+	unsigned int polls = 0;
 
 	sigset_t emptyset;
 	sigemptyset(&emptyset);
@@ -940,12 +1376,24 @@ int vis_run(Vis *vis, int argc, char *argv[]) {
 		fd_set fds;
 		FD_ZERO(&fds);
 		FD_SET(STDIN_FILENO, &fds);
+		int nfds = STDIN_FILENO + 1;
+		if (vis->inotify != -1) {
+			FD_SET(vis->inotify, &fds);
+			nfds = MAX(nfds, vis->inotify + 1);
+		}
+		for (File *file = vis->files; file; file = file->next) {
+			if (file->load_fd != -1) {
+				FD_SET(file->load_fd, &fds);
+				nfds = MAX(nfds, file->load_fd + 1);
+			}
+		}
 
 		if (vis->sigbus) {
 			char *name = NULL;
 			for (Win *next, *win = vis->windows; win; win = next) {
 				next = win->next;
-				if (win->file->truncated) {
+				/* windows are only closed if the content can not be preserved */
+				if (win->file->truncated && !file_private(vis, win->file)) {
 					free(name);
 					name = strdup(win->file->name);
 					vis_window_close(win);
@@ -953,15 +1401,28 @@ int vis_run(Vis *vis, int argc, char *argv[]) {
 			}
 			if (!vis->windows)
 				vis_die(vis, "WARNING: file `%s' truncated!\n", name ? name : "-");
-			else
-				vis_info_show(vis, "WARNING: file `%s' truncated!\n", name ? name : "-");
+			else if (name)
+				vis_info_show(vis, "WARNING: file `%s' truncated!\n", name);
 			vis->sigbus = false;
 			free(name);
 		}
 
+		bool saving = files_save_update(vis);
+		bool syncing = files_journal_flush(vis, false);
+		bool following = files_follow(vis, false);
+		bool estimated = windows_large_update(vis);
 		vis_update(vis);
 		idle.tv_sec = vis->mode->idle_timeout;
-		int r = pselect(1, &fds, NULL, NULL, timeout, &emptyset);
+		struct timespec *wait = timeout;
+		if (saving || (!wait && estimated))
+			wait = &progress;
+		else if (!wait && syncing)
+			wait = &sync;
+		else if (!wait && following)
+			wait = &poll;
+		else if (!wait && compress)
+			wait = &cold;
+		int r = pselect(nfds, &fds, NULL, NULL, wait, &emptyset);
 		if (r == -1 && errno == EINTR)
 			continue;
 
@@ -970,6 +1431,36 @@ int vis_run(Vis *vis, int argc, char *argv[]) {
 			vis_die(vis, "Error in mainloop: %s\n", strerror(errno));
 		}
 
+		/* input of files being loaded is read without affecting the idle handler */
+		if (r > 0) {
+			if (vis->inotify != -1 && FD_ISSET(vis->inotify, &fds))
+				files_watch_update(vis);
+			for (File *file = vis->files; file; file = file->next) {
+				if (file->load_fd != -1 && FD_ISSET(file->load_fd, &fds))
+					file_load(vis, file);
+			}
+			compress = true;
+			polls = 0;
+			if (!FD_ISSET(STDIN_FILENO, &fds))
+				continue;
+		}
+
+		/* modifications are made durable once no further input arrives */
+		if (r == 0 && syncing)
+			files_journal_flush(vis, true);
+		/* appended data might fill further buffers to compress, polling
+		 * followed files thus replaces the wait for compression */
+		if (r == 0 && following) {
+			files_follow(vis, true);
+			compress = true;
+		}
+		if (r == 0 && (wait == &cold || (wait == &poll && ++polls % (cold.tv_sec / poll.tv_sec) == 0)))
+			compress = files_compress(vis);
+
+		/* the idle handler is deferred until pending saves are completed */
+		if (r == 0 && wait != timeout)
+			continue;
+
 		if (!FD_ISSET(STDIN_FILENO, &fds)) {
 			if (vis->mode->idle)
 				vis->mode->idle(vis);
@@ -983,6 +1474,8 @@ int vis_run(Vis *vis, int argc, char *argv[]) {
 
 		while ((key = getkey(vis)))
 			vis_keys_push(vis, key);
+		compress = true;
+		polls = 0;
 
 		if (vis->mode->idle)
 			timeout = &idle;
@@ -1339,6 +1832,17 @@ const char *vis_file_name(File *file) {
 	return file->name;
 }
 
+ssize_t vis_file_load_progress(File *file) {
+	return file->load_fd == -1 ? -1 : (ssize_t)file->loaded;
+}
+
+int vis_file_save_progress(File *file) {
+	if (!file->save)
+		return -1;
+	size_t total, written = text_save_progress(file->save, &total);
+	return total ? (int)(written * 100 / total) : 100;
+}
+
 bool vis_theme_load(Vis *vis, const char *name) {
 	lua_State *L = vis->lua;
 	if (!L)
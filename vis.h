@@ -86,6 +86,7 @@ void vis_info_hide(Vis*);
 /* these function operate on the currently focused window but make sure
  * that all windows which show the affected region are redrawn too. */
 void vis_insert(Vis*, size_t pos, const char *data, size_t len);
+void vis_insert_register(Vis*, size_t pos, Register*);
 void vis_delete(Vis*, size_t pos, size_t len);
 void vis_replace(Vis*, size_t pos, const char *data, size_t len);
 /* these functions perform their operation at the current cursor position(s) */
@@ -384,6 +385,10 @@ Text *vis_text(Vis*);
 View *vis_view(Vis*);
 Text *vis_file_text(File*);
 const char *vis_file_name(File*);
+/* progress in percent of a pending background save, -1 if there is none */
+int vis_file_save_progress(File*);
+/* number of bytes read so far of a file still being loaded, -1 once complete */
+ssize_t vis_file_load_progress(File*);
 
 bool vis_theme_load(Vis*, const char *name);
 